@@ -1,8 +1,15 @@
 #include "Triangle.hpp"
 #include "rasterizer.hpp"
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
 #include <eigen3/Eigen/Eigen>
 #include <iostream>
+#include <mutex>
 #include <opencv2/opencv.hpp>
+#include <thread>
 
 constexpr double MY_PI = 3.1415926;
 
@@ -78,13 +85,135 @@ Eigen::Matrix4f get_projection_matrix(float eye_fov, float aspect_ratio,
     return scale*perspToOrtho*projection;
 }
 
+// Writes the frames of the batch mode on a thread of its own, so that encoding frame k overlaps
+// with rendering frame k + 1. The pixel buffers go back and forth between the two threads
+// instead of being allocated for every frame.
+class frame_writer
+{
+public:
+    frame_writer(int width, int height, std::string prefix)
+        : width(width), height(height), prefix(std::move(prefix)), worker([this] { run(); })
+    {
+    }
+
+    // Writes the frames still queued
+    ~frame_writer()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            done = true;
+        }
+        changed.notify_all();
+        worker.join();
+    }
+
+    // Queues the BGR8 pixels as the next frame, <prefix>0000.png for the first one. They are
+    // swapped with a buffer the writer is done with rather than copied, so the rasterizer renders
+    // the next frame into that one. Waits while two frames are already queued, which bounds the
+    // memory and the lag of the writer.
+    void push(std::vector<uint8_t>& pixels)
+    {
+        std::vector<uint8_t> frame;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this] { return queued.size() < 2; });
+            if (!spare.empty())
+            {
+                frame = std::move(spare.back());
+                spare.pop_back();
+            }
+        }
+        frame.swap(pixels);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queued.push_back(std::move(frame));
+        }
+        changed.notify_all();
+    }
+
+private:
+    void run()
+    {
+        for (int index = 0;; index++)
+        {
+            std::vector<uint8_t> frame;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [this] { return !queued.empty() || done; });
+                if (queued.empty())
+                    return;
+                frame = std::move(queued.front());
+                queued.pop_front();
+            }
+            changed.notify_all();
+
+            char number[16];
+            std::snprintf(number, sizeof(number), "%04d.png", index);
+            cv::Mat image(height, width, CV_8UC3, frame.data());
+            cv::imwrite(prefix + number, image);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            spare.push_back(std::move(frame));
+        }
+    }
+
+    int width, height;
+    std::string prefix;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<std::vector<uint8_t>> queued;
+    std::vector<std::vector<uint8_t>> spare;
+    bool done = false;
+    std::thread worker;
+};
+
+// Renders frames images with render_frame(angle), the angles going from `from` towards `to` in
+// equal steps, `to` itself excluded so that a full turn loops. Prints the frame rate and the
+// percentiles of the time a frame takes to render and pack, the writing of the files left out.
+template <typename F>
+void render_batch(rst::rasterizer& r, int frames, float from, float to, const std::string& prefix, F&& render_frame)
+{
+    std::vector<double> latencies;
+    auto start = std::chrono::steady_clock::now();
+    {
+        frame_writer writer(700, 700, prefix);
+        for (int k = 0; k < frames; k++)
+        {
+            auto frame_start = std::chrono::steady_clock::now();
+            render_frame(from + (to - from) * k / frames);
+            std::vector<uint8_t>& pixels = r.output_buffer(rst::PixelFormat::BGR8);
+            latencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frame_start).count());
+            writer.push(pixels);
+        }
+    }
+    double total = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Nearest rank percentiles
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p)
+    { return latencies[std::max(0, (int)std::ceil(p * latencies.size()) - 1)]; };
+    std::printf("%d frames in %.2f s, %.1f frames/s\n", frames, total, frames / total);
+    std::printf("frame time: p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+                percentile(0.5), percentile(0.9), percentile(0.99), latencies.back());
+}
+
 int main(int argc, const char** argv)
 {
     float angle = 0;
     bool command_line = false;
     std::string filename = "output.png";
 
-    if (argc >= 3) {
+    // Batch mode: Rasterizer -b frames from to prefix renders frames images of the triangle
+    // turning from angle `from` towards `to`, to prefix0000.png and on
+    int batch_frames = 0;
+    float batch_from = 0, batch_to = 0;
+    if (argc == 6 && std::string(argv[1]) == "-b") {
+        batch_frames = std::stoi(argv[2]);
+        batch_from = std::stof(argv[3]);
+        batch_to = std::stof(argv[4]);
+        filename = std::string(argv[5]);
+    }
+    else if (argc >= 3) {
         command_line = true;
         angle = std::stof(argv[2]); // -r by default
         if (argc == 4) {
@@ -102,12 +231,23 @@ int main(int argc, const char** argv)
 
     std::vector<Eigen::Vector3i> ind{{0, 1, 2}};
 
-    auto pos_id = r.load_positions(pos);
-    auto ind_id = r.load_indices(ind);
+    auto pos_id = r.load_positions(std::move(pos));
+    auto ind_id = r.load_indices(std::move(ind));
 
     int key = 0;
     int frame_count = 0;
 
+    if (batch_frames > 0) {
+        r.set_view(get_view_matrix(eye_pos));
+        r.set_projection(get_projection_matrix(45, 1, 0.1, 50));
+        render_batch(r, batch_frames, batch_from, batch_to, filename, [&](float frame_angle) {
+            r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+            r.set_model(get_model_matrix(frame_angle));
+            r.draw(pos_id, ind_id, rst::Primitive::Triangle);
+        });
+        return 0;
+    }
+
     if (command_line) {
         r.clear(rst::Buffers::Color | rst::Buffers::Depth);
 
@@ -116,8 +256,7 @@ int main(int argc, const char** argv)
         r.set_projection(get_projection_matrix(45, 1, 0.1, 50));
 
         r.draw(pos_id, ind_id, rst::Primitive::Triangle);
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
+        cv::Mat image(700, 700, CV_8UC3, r.output_buffer(rst::PixelFormat::BGR8).data());
 
         cv::imwrite(filename, image);
 
@@ -133,8 +272,7 @@ int main(int argc, const char** argv)
 
         r.draw(pos_id, ind_id, rst::Primitive::Triangle);
 
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
+        cv::Mat image(700, 700, CV_8UC3, r.output_buffer(rst::PixelFormat::BGR8).data());
         cv::imshow("image", image);
         key = cv::waitKey(10);
 
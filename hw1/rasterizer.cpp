@@ -9,34 +9,74 @@
 #include <stdexcept>
 
 
-rst::pos_buf_id rst::rasterizer::load_positions(const std::vector<Eigen::Vector3f> &positions)
+rst::pos_buf_id rst::rasterizer::load_positions(std::vector<Eigen::Vector3f> positions)
 {
-    auto id = get_next_id();
-    pos_buf.emplace(id, positions);
-
-    return {id};
+    return {pos_buf.add(std::move(positions))};
 }
 
-rst::ind_buf_id rst::rasterizer::load_indices(const std::vector<Eigen::Vector3i> &indices)
+rst::ind_buf_id rst::rasterizer::load_indices(std::vector<Eigen::Vector3i> indices)
 {
-    auto id = get_next_id();
-    ind_buf.emplace(id, indices);
+    // The edges of the wireframe, each edge shared by two triangles only once
+    std::vector<std::array<int, 2>> edges;
+    edges.reserve(3 * indices.size());
+    for (auto& i : indices)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            int a = i[k], b = i[(k + 1) % 3];
+            edges.push_back({std::min(a, b), std::max(a, b)});
+        }
+    }
+    std::sort(edges.begin(), edges.end());
+    edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+    edge_buf.add(std::move(edges));
 
-    return {id};
+    return {ind_buf.add(std::move(indices))};
 }
 
 // Bresenham's line drawing algorithm
 // Code taken from a stack overflow answer: https://stackoverflow.com/a/16405254
-void rst::rasterizer::draw_line(Eigen::Vector3f begin, Eigen::Vector3f end)
+// The pixels of a line come in runs along its major axis, which are written as one span each.
+void rst::rasterizer::draw_line(Eigen::Vector3f begin, Eigen::Vector3f end, int row0, int row1)
 {
+    if (line_aa)
+    {
+        draw_line_aa(begin, end, row0, row1);
+        return;
+    }
+
     auto x1 = begin.x();
     auto y1 = begin.y();
     auto x2 = end.x();
     auto y2 = end.y();
 
-    Eigen::Vector3f line_color = {255, 255, 255};
+    const Eigen::Vector3f line_color = {255, 255, 255};
+    row0 = std::max(row0, 0);
+    row1 = std::min(row1, height);
+
+    // Pixels [xa, xb] of row y and [ya, yb] of column x. The clipped end points are inside the
+    // viewport, but Bresenham may overshoot them by a pixel.
+    auto fill_row = [&](int y, int xa, int xb)
+    {
+        xa = std::max(xa, 0);
+        xb = std::min(xb, width - 1);
+        if (y < row0 || y >= row1 || xa > xb)
+            return;
+        auto row = frame_buf.begin() + get_index(0, y);
+        std::fill(row + xa, row + xb + 1, line_color);
+    };
+    auto fill_column = [&](int x, int ya, int yb)
+    {
+        ya = std::max(ya, row0);
+        yb = std::min(yb, row1 - 1);
+        if (x < 0 || x >= width || ya > yb)
+            return;
+        Eigen::Vector3f* pixel = &frame_buf[get_index(x, ya)];
+        for (int y = ya; y <= yb; y++, pixel -= width)
+            *pixel = line_color;
+    };
 
-    int x,y,dx,dy,dx1,dy1,px,py,xe,ye,i;
+    int x,y,dx,dy,dx1,dy1,px,py,xe,ye;
 
     dx=x2-x1;
     dy=y2-y1;
@@ -44,6 +84,7 @@ void rst::rasterizer::draw_line(Eigen::Vector3f begin, Eigen::Vector3f end)
     dy1=fabs(dy);
     px=2*dy1-dx1;
     py=2*dx1-dy1;
+    const int step = (dx<0 && dy<0) || (dx>0 && dy>0) ? 1 : -1;
 
     if(dy1<=dx1)
     {
@@ -59,9 +100,8 @@ void rst::rasterizer::draw_line(Eigen::Vector3f begin, Eigen::Vector3f end)
             y=y2;
             xe=x1;
         }
-        Eigen::Vector3f point = Eigen::Vector3f(x, y, 1.0f);
-        set_pixel(point,line_color);
-        for(i=0;x<xe;i++)
+        int span = x;
+        while(x<xe)
         {
             x=x+1;
             if(px<0)
@@ -70,20 +110,15 @@ void rst::rasterizer::draw_line(Eigen::Vector3f begin, Eigen::Vector3f end)
             }
             else
             {
-                if((dx<0 && dy<0) || (dx>0 && dy>0))
-                {
-                    y=y+1;
-                }
-                else
-                {
-                    y=y-1;
-                }
+                fill_row(y, span, x-1);
+                span = x;
+                y=y+step;
                 px=px+2*(dy1-dx1);
+                if ((step > 0 && y >= row1) || (step < 0 && y < row0))
+                    return;
             }
-//            delay(0);
-            Eigen::Vector3f point = Eigen::Vector3f(x, y, 1.0f);
-            set_pixel(point,line_color);
         }
+        fill_row(y, span, x);
     }
     else
     {
@@ -99,31 +134,75 @@ void rst::rasterizer::draw_line(Eigen::Vector3f begin, Eigen::Vector3f end)
             y=y2;
             ye=y1;
         }
-        Eigen::Vector3f point = Eigen::Vector3f(x, y, 1.0f);
-        set_pixel(point,line_color);
-        for(i=0;y<ye;i++)
+        int span = y;
+        while(y<ye && y<row1)
         {
             y=y+1;
-            if(py<=0)
+            if(py>0)
             {
-                py=py+2*dx1;
+                fill_column(x, span, y-1);
+                span = y;
+                x=x+step;
+                py=py+2*(dx1-dy1);
             }
             else
             {
-                if((dx<0 && dy<0) || (dx>0 && dy>0))
-                {
-                    x=x+1;
-                }
-                else
-                {
-                    x=x-1;
-                }
-                py=py+2*(dx1-dy1);
+                py=py+2*dx1;
             }
-//            delay(0);
-            Eigen::Vector3f point = Eigen::Vector3f(x, y, 1.0f);
-            set_pixel(point,line_color);
         }
+        fill_column(x, span, y);
+    }
+}
+
+// Xiaolin Wu's line: along the major axis, every pixel column (or row) gets the two pixels
+// straddling the line, with coverages that add up to one, blended over the frame buffer
+void rst::rasterizer::draw_line_aa(Eigen::Vector3f begin, Eigen::Vector3f end, int row0, int row1)
+{
+    const Eigen::Vector3f line_color = {255, 255, 255};
+    row0 = std::max(row0, 0);
+    row1 = std::min(row1, height);
+
+    // Pixel centers are at half-integer coordinates
+    float x0 = begin.x() - 0.5f, y0 = begin.y() - 0.5f;
+    float x1 = end.x() - 0.5f, y1 = end.y() - 0.5f;
+    const bool steep = std::abs(y1 - y0) > std::abs(x1 - x0);
+    if (steep)
+    {
+        std::swap(x0, y0);
+        std::swap(x1, y1);
+    }
+    if (x0 > x1)
+    {
+        std::swap(x0, x1);
+        std::swap(y0, y1);
+    }
+    const float gradient = x1 > x0 ? (y1 - y0) / (x1 - x0) : 1.f;
+
+    auto plot = [&](int x, int y, float coverage)
+    {
+        if (steep)
+            std::swap(x, y);
+        if (x < 0 || x >= width || y < row0 || y >= row1)
+            return;
+        Eigen::Vector3f& pixel = frame_buf[get_index(x, y)];
+        pixel += coverage * (line_color - pixel);
+    };
+    auto fpart = [](float v) { return v - std::floor(v); };
+
+    // The end points cover their pixel column by how much of it the line spans
+    const int xa = (int)std::round(x0), xb = (int)std::round(x1);
+    const float ya = y0 + gradient * (xa - x0), yb = y1 + gradient * (xb - x1);
+    const float gap_a = 1 - fpart(x0 + 0.5f), gap_b = fpart(x1 + 0.5f);
+    plot(xa, (int)std::floor(ya), (1 - fpart(ya)) * gap_a);
+    plot(xa, (int)std::floor(ya) + 1, fpart(ya) * gap_a);
+    plot(xb, (int)std::floor(yb), (1 - fpart(yb)) * gap_b);
+    plot(xb, (int)std::floor(yb) + 1, fpart(yb) * gap_b);
+
+    float y = ya + gradient;
+    for (int x = xa + 1; x < xb; x++, y += gradient)
+    {
+        plot(x, (int)std::floor(y), 1 - fpart(y));
+        plot(x, (int)std::floor(y) + 1, fpart(y));
     }
 }
 
@@ -132,60 +211,247 @@ auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
     return Vector4f(v3.x(), v3.y(), v3.z(), w);
 }
 
-void rst::rasterizer::draw(rst::pos_buf_id pos_buffer, rst::ind_buf_id ind_buffer, rst::Primitive type)
+// Sign of w in front of the eye, which looks down -z in view space. The projection matrices of
+// the assignments keep w = z, the usual one has w = -z.
+static float visible_w_sign(const Eigen::Matrix4f& projection)
+{
+    return projection(3, 2) > 0 ? -1.f : 1.f;
+}
+
+// Half-spaces of clip space a vertex can be outside of. Primitives crossing the near plane or the
+// guard band, GUARD_BAND times the size of the viewport around it, are clipped; the viewport edges
+// only serve to cull the triangles entirely outside one of them.
+enum clip_bits
+{
+    CLIP_NEAR = 1 << 0,
+    CLIP_GUARD_LEFT = 1 << 1,
+    CLIP_GUARD_RIGHT = 1 << 2,
+    CLIP_GUARD_BOTTOM = 1 << 3,
+    CLIP_GUARD_TOP = 1 << 4,
+    CLIP_LEFT = 1 << 5,
+    CLIP_RIGHT = 1 << 6,
+    CLIP_BOTTOM = 1 << 7,
+    CLIP_TOP = 1 << 8,
+    CLIP_PLANES = CLIP_NEAR | CLIP_GUARD_LEFT | CLIP_GUARD_RIGHT | CLIP_GUARD_BOTTOM | CLIP_GUARD_TOP
+};
+static constexpr float GUARD_BAND = 4;
+
+// The projection matrices do not map the near plane to a fixed depth, so vertices are clipped at a
+// small distance in w instead; what matters is that none reaches w = 0 or gets behind the eye.
+static constexpr float NEAR_W = 1e-5f;
+
+// Signed distance of a vertex to the clip plane of bit, positive inside
+static float clip_distance(const Eigen::Vector4f& v, float w_sign, int bit)
 {
-    if (type != rst::Primitive::Triangle)
+    float w = w_sign * v.w();
+    switch (bit)
     {
-        throw std::runtime_error("Drawing primitives other than triangle is not implemented yet!");
+    case CLIP_NEAR:
+        return w - NEAR_W;
+    case CLIP_GUARD_LEFT:
+        return GUARD_BAND * w + v.x();
+    case CLIP_GUARD_RIGHT:
+        return GUARD_BAND * w - v.x();
+    case CLIP_GUARD_BOTTOM:
+        return GUARD_BAND * w + v.y();
+    case CLIP_GUARD_TOP:
+        return GUARD_BAND * w - v.y();
+    case CLIP_LEFT:
+        return w + v.x();
+    case CLIP_RIGHT:
+        return w - v.x();
+    case CLIP_BOTTOM:
+        return w + v.y();
+    default:
+        return w - v.y();
     }
-    auto& buf = pos_buf[pos_buffer.pos_id];
-    auto& ind = ind_buf[ind_buffer.ind_id];
+}
 
-    float f1 = (100 - 0.1) / 2.0;
-    float f2 = (100 + 0.1) / 2.0;
+static int clip_outcode(const Eigen::Vector4f& v, float w_sign)
+{
+    int code = 0;
+    for (int bit = CLIP_NEAR; bit <= CLIP_TOP; bit <<= 1)
+    {
+        if (clip_distance(v, w_sign, bit) < 0)
+            code |= bit;
+    }
+    return code;
+}
 
-    Eigen::Matrix4f mvp = projection * view * model;
-    for (auto& i : ind)
+// Keeps the part of the segment ab inside the near plane and the guard band, returns false when
+// nothing is left
+static bool clip_line(Eigen::Vector4f& a, Eigen::Vector4f& b, float w_sign)
+{
+    float t0 = 0, t1 = 1;
+    for (int bit = CLIP_NEAR; bit <= CLIP_GUARD_TOP; bit <<= 1)
     {
-        Triangle t;
+        float da = clip_distance(a, w_sign, bit), db = clip_distance(b, w_sign, bit);
+        if (da < 0 && db < 0)
+            return false;
+        if (da < 0)
+            t0 = std::max(t0, da / (da - db));
+        else if (db < 0)
+            t1 = std::min(t1, da / (da - db));
+    }
+    if (t0 > t1)
+        return false;
+    Eigen::Vector4f d = b - a;
+    b = a + t1 * d;
+    a = a + t0 * d;
+    return true;
+}
 
-        Eigen::Vector4f v[] = {
-                mvp * to_vec4(buf[i[0]], 1.0f),
-                mvp * to_vec4(buf[i[1]], 1.0f),
-                mvp * to_vec4(buf[i[2]], 1.0f)
-        };
+// Cohen-Sutherland: keeps the part of the screen space segment ab inside [0, x_max] x [0, y_max],
+// returns false when nothing is left
+static bool clip_to_viewport(Eigen::Vector3f& a, Eigen::Vector3f& b, float x_max, float y_max)
+{
+    enum { LEFT = 1, RIGHT = 2, BOTTOM = 4, TOP = 8 };
+    auto outcode = [&](const Eigen::Vector3f& p)
+    {
+        return (p.x() < 0 ? LEFT : p.x() > x_max ? RIGHT : 0) | (p.y() < 0 ? BOTTOM : p.y() > y_max ? TOP : 0);
+    };
+    int code_a = outcode(a), code_b = outcode(b);
+    while (code_a | code_b)
+    {
+        if (code_a & code_b)
+            return false;
 
-        for (auto& vec : v) {
-            vec /= vec.w();
+        // Move an outside end point to the edge of the first half-plane it is outside of
+        Eigen::Vector3f& p = code_a ? a : b;
+        const int code = code_a ? code_a : code_b;
+        const Eigen::Vector3f d = b - a;
+        if (code & (LEFT | RIGHT))
+        {
+            float x = code & LEFT ? 0 : x_max;
+            p = a + (x - a.x()) / d.x() * d;
+            p.x() = x;
+        }
+        else
+        {
+            float y = code & BOTTOM ? 0 : y_max;
+            p = a + (y - a.y()) / d.y() * d;
+            p.y() = y;
         }
+        (code_a ? code_a : code_b) = outcode(p);
+    }
+    return true;
+}
+
+// Homogeneous division and viewport transformation
+static Eigen::Vector3f to_screen(const Eigen::Vector4f& clip, int width, int height)
+{
+    float f1 = (100 - 0.1) / 2.0;
+    float f2 = (100 + 0.1) / 2.0;
+
+    Eigen::Vector4f vert = clip / clip.w();
+    vert.x() = 0.5*width*(vert.x()+1.0);
+    vert.y() = 0.5*height*(vert.y()+1.0);
+    vert.z() = vert.z() * f1 + f2;
+    return vert.head<3>();
+}
 
-        for (auto & vert : v)
+void rst::rasterizer::draw(rst::pos_buf_id pos_buffer, rst::ind_buf_id ind_buffer, rst::Primitive type)
+{
+    command_list commands;
+    commands.draw(pos_buffer, ind_buffer, type, model);
+    execute(commands);
+}
+
+void rst::rasterizer::execute(const command_list& commands)
+{
+    const auto& cmds = commands.commands();
+    const int n_cmd = cmds.size();
+    for (auto& cmd : cmds)
+    {
+        if (cmd.type != rst::Primitive::Triangle)
         {
-            vert.x() = 0.5*width*(vert.x()+1.0);
-            vert.y() = 0.5*height*(vert.y()+1.0);
-            vert.z() = vert.z() * f1 + f2;
+            throw std::runtime_error("Drawing primitives other than triangle is not implemented yet!");
         }
+    }
+    const int n_thrd = std::max(1u, std::thread::hardware_concurrency());
+    const int band_height = (height + n_thrd - 1) / n_thrd;
+    const float w_sign = visible_w_sign(projection);
 
-        for (int i = 0; i < 3; ++i)
+    // first_edge[c] is the index of the first edge of command c among the edges of all the
+    // commands, which the geometry workers split in contiguous ranges
+    std::vector<int> first_edge(n_cmd + 1, 0);
+    std::vector<Eigen::Matrix4f> mvps(n_cmd);
+    for (int c = 0; c < n_cmd; c++)
+    {
+        first_edge[c + 1] = first_edge[c] + edge_buf[cmds[c].ind_buffer.ind_id].size();
+        mvps[c] = projection * view * cmds[c].model;
+    }
+    const int n_edge = first_edge[n_cmd];
+
+    screen_lines.resize(n_thrd);
+    band_bins.resize(n_thrd);
+
+    // Geometry pass: transformation, clipping and binning of a range of edges per worker
+    auto geometry_worker = [&](int w)
+    {
+        auto& lines = screen_lines[w];
+        auto& bins = band_bins[w];
+        lines.clear();
+        bins.resize(n_thrd);
+        for (auto& bin : bins)
         {
-            t.setVertex(i, v[i].head<3>());
-            t.setVertex(i, v[i].head<3>());
-            t.setVertex(i, v[i].head<3>());
+            bin.clear();
         }
 
-        t.setColor(0, 255.0,  0.0,  0.0);
-        t.setColor(1, 0.0  ,255.0,  0.0);
-        t.setColor(2, 0.0  ,  0.0,255.0);
+        const int chunk = (n_edge + n_thrd - 1) / n_thrd;
+        const int begin = std::min(n_edge, w * chunk), end = std::min(n_edge, (w + 1) * chunk);
+        int c = std::upper_bound(first_edge.begin(), first_edge.end(), begin) - first_edge.begin() - 1;
+        for (int f = begin; f < end; f++)
+        {
+            while (f >= first_edge[c + 1])
+            {
+                c++;
+            }
+            const auto& buf = pos_buf[cmds[c].pos_buffer.pos_id];
+            const std::array<int, 2>& e = edge_buf[cmds[c].ind_buffer.ind_id][f - first_edge[c]];
 
-        rasterize_wireframe(t);
-    }
-}
+            Eigen::Vector4f a = mvps[c] * to_vec4(buf[e[0]], 1.0f);
+            Eigen::Vector4f b = mvps[c] * to_vec4(buf[e[1]], 1.0f);
+            int ca = clip_outcode(a, w_sign), cb = clip_outcode(b, w_sign);
+            if ((ca & cb) != 0)
+            {
+                continue;
+            }
+            if (((ca | cb) & CLIP_PLANES) != 0 && !clip_line(a, b, w_sign))
+            {
+                continue;
+            }
 
-void rst::rasterizer::rasterize_wireframe(const Triangle& t)
-{
-    draw_line(t.c(), t.a());
-    draw_line(t.c(), t.b());
-    draw_line(t.b(), t.a());
+            Eigen::Vector3f sa = to_screen(a, width, height), sb = to_screen(b, width, height);
+            if (!clip_to_viewport(sa, sb, width - 1, height - 1))
+            {
+                continue;
+            }
+            // The rows of the end points, and one more on each side where Bresenham can overshoot
+            int b1 = std::max(0, (int)std::min(sa.y(), sb.y()) - 1) / band_height;
+            int b2 = std::min(height - 1, (int)std::max(sa.y(), sb.y()) + 1) / band_height;
+            for (int band = b1; band <= b2; band++)
+            {
+                bins[band].push_back(lines.size());
+            }
+            lines.push_back({sa, sb});
+        }
+    };
+    run_workers(n_thrd, geometry_worker);
+
+    // Raster pass: every worker draws the rows of its band, so no pixel is written by two of them
+    auto raster_worker = [&](int band)
+    {
+        const int y0 = band * band_height, y1 = std::min(height, y0 + band_height);
+        for (int w = 0; w < n_thrd; w++)
+        {
+            for (int i : band_bins[w][band])
+            {
+                draw_line(screen_lines[w][i][0], screen_lines[w][i][1], y0, y1);
+            }
+        }
+    };
+    run_workers(n_thrd, raster_worker);
 }
 
 void rst::rasterizer::set_model(const Eigen::Matrix4f& m)
@@ -221,9 +487,48 @@ rst::rasterizer::rasterizer(int w, int h) : width(w), height(h)
     depth_buf.resize(w * h);
 }
 
+std::vector<uint8_t>& rst::rasterizer::output_buffer(PixelFormat format)
+{
+    // One pass over the frame buffer does the conversion to bytes and the channel order
+    const int channels = format == PixelFormat::RGBA8 ? 4 : 3;
+    output_buf.resize(width * height * channels);
+    const float* in = frame_buf.data()->data();
+    uint8_t* out = output_buf.data();
+    auto to_byte = [](float v) { return (uint8_t)std::lrint(std::min(255.f, std::max(0.f, v))); };
+
+    const int n_thrd = std::max(1u, std::thread::hardware_concurrency());
+    const int n_pixel = width * height;
+    auto pack_worker = [&](int t)
+    {
+        const int chunk = (n_pixel + n_thrd - 1) / n_thrd;
+        const int end = std::min(n_pixel, (t + 1) * chunk);
+        if (format == PixelFormat::RGBA8)
+        {
+            for (int i = t * chunk; i < end; i++)
+            {
+                out[4 * i] = to_byte(in[3 * i]);
+                out[4 * i + 1] = to_byte(in[3 * i + 1]);
+                out[4 * i + 2] = to_byte(in[3 * i + 2]);
+                out[4 * i + 3] = 255;
+            }
+        }
+        else
+        {
+            for (int i = t * chunk; i < end; i++)
+            {
+                out[3 * i] = to_byte(in[3 * i + 2]);
+                out[3 * i + 1] = to_byte(in[3 * i + 1]);
+                out[3 * i + 2] = to_byte(in[3 * i]);
+            }
+        }
+    };
+    run_workers(n_thrd, pack_worker);
+    return output_buf;
+}
+
 int rst::rasterizer::get_index(int x, int y)
 {
-    return (height-y)*width + x;
+    return (height-1-y)*width + x;
 }
 
 void rst::rasterizer::set_pixel(const Eigen::Vector3f& point, const Eigen::Vector3f& color)
@@ -231,7 +536,7 @@ void rst::rasterizer::set_pixel(const Eigen::Vector3f& point, const Eigen::Vecto
     //old index: auto ind = point.y() + point.x() * width;
     if (point.x() < 0 || point.x() >= width ||
         point.y() < 0 || point.y() >= height) return;
-    auto ind = (height-point.y())*width + point.x();
+    auto ind = (height-1-point.y())*width + point.x();
     frame_buf[ind] = color;
 }
 
@@ -6,7 +6,13 @@
 
 #include "Triangle.hpp"
 #include <algorithm>
+#include <cstdint>
+#include <array>
+#include <climits>
 #include <eigen3/Eigen/Eigen>
+#include <future>
+#include <thread>
+#include <vector>
 using namespace Eigen;
 
 namespace rst {
@@ -32,6 +38,14 @@ enum class Primitive
     Triangle
 };
 
+// Byte layouts of output_buffer(). BGR8 is the layout of a CV_8UC3 cv::Mat, RGBA8 the one of
+// most image files and textures.
+enum class PixelFormat
+{
+    BGR8,
+    RGBA8
+};
+
 /*
  * For the curious : The draw function takes two buffer id's as its arguments.
  * These two structs make sure that if you mix up with their orders, the
@@ -47,12 +61,74 @@ struct ind_buf_id
     int ind_id = 0;
 };
 
+// Buffers of one type, each in its own contiguous vector. A handle is the index of the slot of
+// its buffer, so a draw finds its buffers without a search, and a vector passed as an rvalue is
+// moved in rather than copied.
+template <typename T>
+class buffer_pool
+{
+  public:
+    int add(std::vector<T> data)
+    {
+        slots.push_back(std::move(data));
+        return (int)slots.size() - 1;
+    }
+
+    const std::vector<T>& operator[](int id) const { return slots[id]; }
+
+  private:
+    std::vector<std::vector<T>> slots;
+};
+
+// Runs worker(0) .. worker(n_thrd - 1) on their own threads and waits for all of them
+template <typename F>
+void run_workers(int n_thrd, F&& worker)
+{
+    std::vector<std::future<void>> futures;
+    futures.reserve(n_thrd);
+    for (int t = 0; t < n_thrd; t++)
+    {
+        futures.emplace_back(std::async(std::launch::async, worker, t));
+    }
+    for (auto& f : futures)
+    {
+        f.get();
+    }
+}
+
+// One recorded draw: the buffers of a mesh and the model matrix it is drawn with
+struct draw_command
+{
+    pos_buf_id pos_buffer;
+    ind_buf_id ind_buffer;
+    Primitive type;
+    Eigen::Matrix4f model;
+};
+
+// Draws recorded for rasterizer::execute(), which renders all of them in one pass. The list can
+// be executed any number of times and cleared to record the next frame.
+class command_list
+{
+  public:
+    void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, Primitive type, const Eigen::Matrix4f& model)
+    {
+        cmds.push_back({pos_buffer, ind_buffer, type, model});
+    }
+
+    void clear() { cmds.clear(); }
+
+    const std::vector<draw_command>& commands() const { return cmds; }
+
+  private:
+    std::vector<draw_command> cmds;
+};
+
 class rasterizer
 {
   public:
     rasterizer(int w, int h);
-    pos_buf_id load_positions(const std::vector<Eigen::Vector3f>& positions);
-    ind_buf_id load_indices(const std::vector<Eigen::Vector3i>& indices);
+    pos_buf_id load_positions(std::vector<Eigen::Vector3f> positions);
+    ind_buf_id load_indices(std::vector<Eigen::Vector3i> indices);
 
     void set_model(const Eigen::Matrix4f& m);
     void set_view(const Eigen::Matrix4f& v);
@@ -62,29 +138,52 @@ class rasterizer
 
     void clear(Buffers buff);
 
+    // Draws one mesh with the current model matrix, as a command list of one draw
     void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, Primitive type);
 
+    // Draws all the commands of the list, each with its own model matrix and the current view and
+    // projection. The edges of all the draws are transformed, clipped and binned to horizontal
+    // bands of the screen in one parallel pass, then every band draws its edges on its own thread.
+    // An edge shared by two triangles is drawn once.
+    void execute(const command_list& commands);
+
+    // Draw the wireframe with Wu's anti-aliased lines instead of Bresenham's
+    void set_line_antialiasing(bool on) { line_aa = on; }
+
     std::vector<Eigen::Vector3f>& frame_buffer() { return frame_buf; }
 
+    // The frame buffer with 8 bits per channel, clamped to [0, 255] and rounded, in format. The
+    // bytes stay valid until the next call, so a cv::Mat can wrap them without a copy.
+    std::vector<uint8_t>& output_buffer(PixelFormat format = PixelFormat::BGR8);
+
   private:
-    void draw_line(Eigen::Vector3f begin, Eigen::Vector3f end);
-    void rasterize_wireframe(const Triangle& t);
+    // Draw the pixels of the line in the rows [row0, row1). The end points must be inside the
+    // viewport.
+    void draw_line(Eigen::Vector3f begin, Eigen::Vector3f end, int row0 = 0, int row1 = INT_MAX);
+    void draw_line_aa(Eigen::Vector3f begin, Eigen::Vector3f end, int row0, int row1);
 
   private:
     Eigen::Matrix4f model;
     Eigen::Matrix4f view;
     Eigen::Matrix4f projection;
 
-    std::map<int, std::vector<Eigen::Vector3f>> pos_buf;
-    std::map<int, std::vector<Eigen::Vector3i>> ind_buf;
+    buffer_pool<Eigen::Vector3f> pos_buf;
+    buffer_pool<Eigen::Vector3i> ind_buf;
+    buffer_pool<std::array<int, 2>> edge_buf; // the edges of ind_buf, by ind_id
 
     std::vector<Eigen::Vector3f> frame_buf;
+    std::vector<uint8_t> output_buf;
     std::vector<float> depth_buf;
     int get_index(int x, int y);
 
-    int width, height;
+    // Screen space edges of execute(), one list per worker of the geometry pass.
+    // band_bins[worker][band] lists the edges of that worker crossing the band. Both keep their
+    // storage from one call to the next.
+    std::vector<std::vector<std::array<Eigen::Vector3f, 2>>> screen_lines;
+    std::vector<std::vector<std::vector<int>>> band_bins;
+
+    bool line_aa = false;
 
-    int next_id = 0;
-    int get_next_id() { return next_id++; }
+    int width, height;
 };
 } // namespace rst
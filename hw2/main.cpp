@@ -50,7 +50,7 @@ int main(int argc, const char** argv)
     bool command_line = false;
     std::string filename = "output.png";
 
-    if (argc == 2)
+    if (argc >= 2)
     {
         command_line = true;
         filename = std::string(argv[1]);
@@ -58,6 +58,18 @@ int main(int argc, const char** argv)
 
     rst::rasterizer r(700, 700);
 
+    // Optional samples per pixel: Rasterizer output.png 4
+    if (argc >= 3)
+    {
+        r.set_msaa(std::stoi(argv[2]));
+    }
+
+    // Optional opacity of the triangles, blended order-independently below 1: Rasterizer output.png 1 0.5
+    if (argc >= 4)
+    {
+        r.set_opacity(std::stof(argv[3]));
+    }
+
     Eigen::Vector3f eye_pos = {0,0,5};
 
 
@@ -87,9 +99,9 @@ int main(int argc, const char** argv)
                     {185.0, 217.0, 238.0}
             };
 
-    auto pos_id = r.load_positions(pos);
-    auto ind_id = r.load_indices(ind);
-    auto col_id = r.load_colors(cols);
+    auto pos_id = r.load_positions(std::move(pos));
+    auto ind_id = r.load_indices(std::move(ind));
+    auto col_id = r.load_colors(std::move(cols));
 
     int key = 0;
     int frame_count = 0;
@@ -103,9 +115,7 @@ int main(int argc, const char** argv)
         r.set_projection(get_projection_matrix(45, 1, 0.1, 50));
 
         r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle);
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
-        cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
+        cv::Mat image(700, 700, CV_8UC3, r.output_buffer(rst::PixelFormat::BGR8).data());
 
         cv::imwrite(filename, image);
 
@@ -122,9 +132,7 @@ int main(int argc, const char** argv)
 
         r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle);
 
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
-        cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
+        cv::Mat image(700, 700, CV_8UC3, r.output_buffer(rst::PixelFormat::BGR8).data());
         cv::imshow("image", image);
         key = cv::waitKey(10);
 
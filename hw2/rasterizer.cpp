@@ -8,30 +8,23 @@
 #include "rasterizer.hpp"
 #include <opencv2/opencv.hpp>
 #include <math.h>
+#include <stdexcept>
+#include <atomic>
 
 
-rst::pos_buf_id rst::rasterizer::load_positions(const std::vector<Eigen::Vector3f> &positions)
+rst::pos_buf_id rst::rasterizer::load_positions(std::vector<Eigen::Vector3f> positions)
 {
-    auto id = get_next_id();
-    pos_buf.emplace(id, positions);
-
-    return {id};
+    return {pos_buf.add(std::move(positions))};
 }
 
-rst::ind_buf_id rst::rasterizer::load_indices(const std::vector<Eigen::Vector3i> &indices)
+rst::ind_buf_id rst::rasterizer::load_indices(std::vector<Eigen::Vector3i> indices)
 {
-    auto id = get_next_id();
-    ind_buf.emplace(id, indices);
-
-    return {id};
+    return {ind_buf.add(std::move(indices))};
 }
 
-rst::col_buf_id rst::rasterizer::load_colors(const std::vector<Eigen::Vector3f> &cols)
+rst::col_buf_id rst::rasterizer::load_colors(std::vector<Eigen::Vector3f> cols)
 {
-    auto id = get_next_id();
-    col_buf.emplace(id, cols);
-
-    return {id};
+    return {col_buf.add(std::move(cols))};
 }
 
 auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
@@ -40,152 +33,607 @@ auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
 }
 
 
-static bool insideTriangle(int x, int y, const Vector3f* _v)
-{   
-    // TODO : Implement this function to check if the point (x, y) is inside the triangle represented by _v[0], _v[1], _v[2]
-    
-    Vector3f zv[3]; //用于判断点是否在三角形内的向量,符号全同则在里面否则不在
-    Vector3f vii;
-    Vector3f vip;
-    for(int i = 0;i<3;++i)
-    {
-        //点是三维向量?那z值设为? z一定是0吗?
+// Sub-pixel precision of the triangles: their screen positions are snapped to 1/256 of a pixel,
+// 16.8 fixed point, so that the edge functions can be evaluated exactly in 64-bit integers
+static constexpr int SUBPIXEL_BITS = 8;
+static constexpr float SUBPIXEL_ONE = 1 << SUBPIXEL_BITS;
+
+static float snap(float x)
+{
+    return std::nearbyint(x * SUBPIXEL_ONE) / SUBPIXEL_ONE;
+}
 
-        // 三角形 01 12 20 边向量
-        if(i == 2)
+// Edge functions of a snapped triangle at the fixed-point sample (X, Y): e(i) = a[i] * X +
+// b[i] * Y + c[i] is twice the area spanned by the sample and the edge opposite to vertex i,
+// positive inside whatever the winding, and the three add up to area. They are exact, so the
+// two triangles sharing an edge see opposite values at every sample; the samples on the edge
+// itself go to the triangle for which it is a top or left edge, which has bias[i] = 0 instead
+// of 1. A sample is covered when e(i) >= bias[i] for all three edges.
+struct fixed_edges
+{
+    int64_t a[3], b[3], c[3], bias[3];
+    int64_t area;
+
+    // False for a triangle of zero area
+    bool setup(const Vector3f* v)
+    {
+        int64_t X[3], Y[3];
+        for (int k = 0; k < 3; k++)
         {
-            vii = _v[0]-_v[2];
+            X[k] = std::llrint(v[k].x() * SUBPIXEL_ONE);
+            Y[k] = std::llrint(v[k].y() * SUBPIXEL_ONE);
         }
-        else
-        {        
-            {vii = _v[i+1]-_v[i];}
+        area = (X[1] - X[0]) * (Y[2] - Y[0]) - (X[2] - X[0]) * (Y[1] - Y[0]);
+        if (area == 0)
+            return false;
+        const int64_t sign = area > 0 ? 1 : -1;
+        area *= sign;
+        for (int i = 0; i < 3; i++)
+        {
+            const int p = (i + 1) % 3, q = (i + 2) % 3;
+            a[i] = sign * (Y[p] - Y[q]);
+            b[i] = sign * (X[q] - X[p]);
+            c[i] = sign * (X[p] * Y[q] - X[q] * Y[p]);
+            // Screen y goes up: the inside is right of a left edge and below a top edge
+            bias[i] = a[i] > 0 || (a[i] == 0 && b[i] < 0) ? 0 : 1;
         }
-        vip = Vector3f(float(x),float(y),_v[i].z())-_v[i]; //Vector : vi to P
-        zv[i] = vii.cross(vip);
+        return true;
     }
-    if(zv[0].z()>=0&& zv[1].z()>=0&& zv[2].z()>=0)
+
+    int64_t e(int i, int64_t X, int64_t Y) const { return a[i] * X + b[i] * Y + c[i]; }
+};
+
+// Sign of w in front of the eye, which looks down -z in view space. The projection matrices of
+// the assignments keep w = z, the usual one has w = -z.
+static float visible_w_sign(const Eigen::Matrix4f& projection)
+{
+    return projection(3, 2) > 0 ? -1.f : 1.f;
+}
+
+// Half-spaces of clip space a vertex can be outside of. Primitives crossing the near plane or the
+// guard band, GUARD_BAND times the size of the viewport around it, are clipped; the viewport edges
+// only serve to cull the triangles entirely outside one of them.
+enum clip_bits
+{
+    CLIP_NEAR = 1 << 0,
+    CLIP_GUARD_LEFT = 1 << 1,
+    CLIP_GUARD_RIGHT = 1 << 2,
+    CLIP_GUARD_BOTTOM = 1 << 3,
+    CLIP_GUARD_TOP = 1 << 4,
+    CLIP_LEFT = 1 << 5,
+    CLIP_RIGHT = 1 << 6,
+    CLIP_BOTTOM = 1 << 7,
+    CLIP_TOP = 1 << 8,
+    CLIP_PLANES = CLIP_NEAR | CLIP_GUARD_LEFT | CLIP_GUARD_RIGHT | CLIP_GUARD_BOTTOM | CLIP_GUARD_TOP
+};
+static constexpr float GUARD_BAND = 4;
+
+// The projection matrices do not map the near plane to a fixed depth, so vertices are clipped at a
+// small distance in w instead; what matters is that none reaches w = 0 or gets behind the eye.
+static constexpr float NEAR_W = 1e-5f;
+
+// Signed distance of a vertex to the clip plane of bit, positive inside
+static float clip_distance(const Eigen::Vector4f& v, float w_sign, int bit)
+{
+    float w = w_sign * v.w();
+    switch (bit)
     {
-        return true;
+    case CLIP_NEAR:
+        return w - NEAR_W;
+    case CLIP_GUARD_LEFT:
+        return GUARD_BAND * w + v.x();
+    case CLIP_GUARD_RIGHT:
+        return GUARD_BAND * w - v.x();
+    case CLIP_GUARD_BOTTOM:
+        return GUARD_BAND * w + v.y();
+    case CLIP_GUARD_TOP:
+        return GUARD_BAND * w - v.y();
+    case CLIP_LEFT:
+        return w + v.x();
+    case CLIP_RIGHT:
+        return w - v.x();
+    case CLIP_BOTTOM:
+        return w + v.y();
+    default:
+        return w - v.y();
     }
-    if (zv[0].z()<=0&& zv[1].z()<=0&& zv[2].z()<=0)
+}
+
+static int clip_outcode(const Eigen::Vector4f& v, float w_sign)
+{
+    int code = 0;
+    for (int bit = CLIP_NEAR; bit <= CLIP_TOP; bit <<= 1)
     {
-        return true;
+        if (clip_distance(v, w_sign, bit) < 0)
+            code |= bit;
     }
-    return false;
+    return code;
+}
+
+// Homogeneous division and viewport transformation
+static Eigen::Vector3f to_screen(const Eigen::Vector4f& clip, int width, int height)
+{
+    float f1 = (50 - 0.1) / 2.0;
+    float f2 = (50 + 0.1) / 2.0;
 
+    Eigen::Vector4f vert = clip / clip.w();
+    vert.x() = 0.5*width*(vert.x()+1.0);
+    vert.y() = 0.5*height*(vert.y()+1.0);
+    vert.z() = vert.z() * f1 + f2;
+    return vert.head<3>();
 }
 
-static std::tuple<float, float, float> computeBarycentric2D(float x, float y, const Vector3f* v)
+// Sample positions relative to the pixel, which is centered on integer coordinates, in the
+// standard D3D patterns
+static const float* sample_offsets(int samples)
 {
-    float c1 = (x*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*y + v[1].x()*v[2].y() - v[2].x()*v[1].y()) / (v[0].x()*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*v[0].y() + v[1].x()*v[2].y() - v[2].x()*v[1].y());
-    float c2 = (x*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*y + v[2].x()*v[0].y() - v[0].x()*v[2].y()) / (v[1].x()*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*v[1].y() + v[2].x()*v[0].y() - v[0].x()*v[2].y());
-    float c3 = (x*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*y + v[0].x()*v[1].y() - v[1].x()*v[0].y()) / (v[2].x()*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*v[2].y() + v[0].x()*v[1].y() - v[1].x()*v[0].y());
-    return {c1,c2,c3};
+    static const float offsets_2[] = {0.25f, 0.25f, -0.25f, -0.25f};
+    static const float offsets_4[] = {-0.125f, -0.375f, 0.375f, -0.125f, -0.375f, 0.125f, 0.125f, 0.375f};
+    static const float offsets_8[] = {0.0625f, -0.1875f, -0.0625f, 0.1875f, 0.3125f, 0.0625f, -0.1875f, -0.3125f,
+                                      -0.3125f, 0.3125f, -0.4375f, -0.0625f, 0.1875f, 0.4375f, 0.4375f, -0.4375f};
+    return samples == 2 ? offsets_2 : samples == 4 ? offsets_4 : offsets_8;
 }
 
 void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type)
 {
-    auto& buf = pos_buf[pos_buffer.pos_id];
-    auto& ind = ind_buf[ind_buffer.ind_id];
-    auto& col = col_buf[col_buffer.col_id];
+    command_list commands;
+    commands.draw(pos_buffer, ind_buffer, col_buffer, type, model, opacity);
+    execute(commands);
+}
 
-    float f1 = (50 - 0.1) / 2.0;
-    float f2 = (50 + 0.1) / 2.0;
+void rst::rasterizer::execute(const command_list& commands)
+{
+    const auto& cmds = commands.commands();
+    const int n_cmd = cmds.size();
+    const int n_thrd = std::max(1u, std::thread::hardware_concurrency());
+    const int n_tile_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    const int n_tile_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+    const int n_tile = n_tile_x * n_tile_y;
+    const float w_sign = visible_w_sign(projection);
+
+    // first_tri[c] is the index of the first triangle of command c among the triangles of all
+    // the commands, which the geometry workers split in contiguous ranges
+    std::vector<int> first_tri(n_cmd + 1, 0);
+    std::vector<Eigen::Matrix4f> mvps(n_cmd);
+    bool transparent = false;
+    for (int c = 0; c < n_cmd; c++)
+    {
+        first_tri[c + 1] = first_tri[c] + ind_buf[cmds[c].ind_buffer.ind_id].size();
+        mvps[c] = projection * view * cmds[c].model;
+        transparent |= cmds[c].opacity < 1;
+    }
+    const int n_tri = first_tri[n_cmd];
 
-    Eigen::Matrix4f mvp = projection * view * model;
-    for (auto& i : ind)
-    {
-        Triangle t;
-        Eigen::Vector4f v[] = {
-                mvp * to_vec4(buf[i[0]], 1.0f),
-                mvp * to_vec4(buf[i[1]], 1.0f),
-                mvp * to_vec4(buf[i[2]], 1.0f)
-        };
-        //Homogeneous division
-        for (auto& vec : v) {
-            vec /= vec.w();
-        }
-        //Viewport transformation
-        for (auto & vert : v)
+    screen_tris.resize(n_thrd);
+    screen_opacity.resize(n_thrd);
+    tile_bins.resize(n_thrd);
+    blend_bins.resize(n_thrd);
+    if (transparent)
+    {
+        blend_accum.resize(width * height);
+        blend_reveal.resize(width * height);
+    }
+
+    // The samples of a pixel are on its center without MSAA
+    static const float center[2] = {0, 0};
+    const float* offsets = msaa > 1 ? sample_offsets(msaa) : center;
+    std::atomic<long> triangles{0}, culled_degenerate{0}, culled_facing{0}, culled_sub_pixel{0};
+
+    // Geometry pass: transformation, clipping and binning of a range of triangles per worker
+    auto geometry_worker = [&](int w)
+    {
+        auto& tris = screen_tris[w];
+        auto& tri_opacity = screen_opacity[w];
+        tris.clear();
+        tri_opacity.clear();
+        for (auto* bins : {&tile_bins[w], &blend_bins[w]})
         {
-            vert.x() = 0.5*width*(vert.x()+1.0);
-            vert.y() = 0.5*height*(vert.y()+1.0);
-            vert.z() = vert.z() * f1 + f2;
+            bins->resize(n_tile);
+            for (auto& bin : *bins)
+            {
+                bin.clear();
+            }
         }
 
-        for (int i = 0; i < 3; ++i)
+        long n_drawn = 0, n_degenerate = 0, n_facing = 0, n_sub_pixel = 0;
+        const int chunk = (n_tri + n_thrd - 1) / n_thrd;
+        const int begin = std::min(n_tri, w * chunk), end = std::min(n_tri, (w + 1) * chunk);
+        int c = std::upper_bound(first_tri.begin(), first_tri.end(), begin) - first_tri.begin() - 1;
+
+        // Clipped polygon, at most one more vertex per clip plane
+        Eigen::Vector4f poly_pos[8], next_pos[8];
+        Eigen::Vector3f poly_col[8], next_col[8];
+        for (int f = begin; f < end; f++)
         {
-            t.setVertex(i, v[i].head<3>());
-            t.setVertex(i, v[i].head<3>());
-            t.setVertex(i, v[i].head<3>());
-        }
+            while (f >= first_tri[c + 1])
+            {
+                c++;
+            }
+            const auto& buf = pos_buf[cmds[c].pos_buffer.pos_id];
+            const auto& col = col_buf[cmds[c].col_buffer.col_id];
+            const Eigen::Vector3i& i = ind_buf[cmds[c].ind_buffer.ind_id][f - first_tri[c]];
+
+            for (int k = 0; k < 3; k++)
+            {
+                poly_pos[k] = mvps[c] * to_vec4(buf[i[k]], 1.0f);
+                poly_col[k] = col[i[k]];
+            }
+            int c0 = clip_outcode(poly_pos[0], w_sign), c1 = clip_outcode(poly_pos[1], w_sign), c2 = clip_outcode(poly_pos[2], w_sign);
+            if ((c0 & c1 & c2) != 0)
+            {
+                continue;
+            }
+
+            // Sutherland-Hodgman against the planes some vertex is outside of. Clip space is linear
+            // in the positions, so the colors of the new vertices interpolate linearly too.
+            int n = 3;
+            for (int bit = CLIP_NEAR; bit <= CLIP_GUARD_TOP && n >= 3; bit <<= 1)
+            {
+                if (((c0 | c1 | c2) & bit) == 0)
+                    continue;
+                int m = 0;
+                for (int k = 0; k < n; k++)
+                {
+                    int l = (k + 1) % n;
+                    float da = clip_distance(poly_pos[k], w_sign, bit), db = clip_distance(poly_pos[l], w_sign, bit);
+                    if (da >= 0)
+                    {
+                        next_pos[m] = poly_pos[k];
+                        next_col[m++] = poly_col[k];
+                    }
+                    if ((da >= 0) != (db >= 0))
+                    {
+                        float t = da / (da - db);
+                        next_pos[m] = poly_pos[k] + t * (poly_pos[l] - poly_pos[k]);
+                        next_col[m++] = poly_col[k] + t * (poly_col[l] - poly_col[k]);
+                    }
+                }
+                std::copy(next_pos, next_pos + m, poly_pos);
+                std::copy(next_col, next_col + m, poly_col);
+                n = m;
+            }
 
-        auto col_x = col[i[0]];
-        auto col_y = col[i[1]];
-        auto col_z = col[i[2]];
+            Eigen::Vector3f screen[8];
+            for (int k = 0; k < n; k++)
+            {
+                screen[k] = to_screen(poly_pos[k], width, height);
+                screen[k].x() = snap(screen[k].x());
+                screen[k].y() = snap(screen[k].y());
+            }
+            for (int k = 2; k < n; k++)
+            {
+                const int fan[3] = {0, k - 1, k};
+                Triangle t;
+                for (int j = 0; j < 3; j++)
+                {
+                    t.setVertex(j, screen[fan[j]]);
+                    t.setColor(j, poly_col[fan[j]][0], poly_col[fan[j]][1], poly_col[fan[j]][2]);
+                }
 
-        t.setColor(0, col_x[0], col_x[1], col_x[2]);
-        t.setColor(1, col_y[0], col_y[1], col_y[2]);
-        t.setColor(2, col_z[0], col_z[1], col_z[2]);
+                // Tiles of the bounding box, widened by the half pixel the samples reach around
+                // the pixel centers
+                const Vector3f* v = t.v;
+                int tx1 = std::max(0, (int)std::floor(std::min({v[0].x(), v[1].x(), v[2].x()}) - 0.5f) / TILE_SIZE);
+                int tx2 = std::min(n_tile_x - 1, (int)std::ceil(std::max({v[0].x(), v[1].x(), v[2].x()}) + 0.5f) / TILE_SIZE);
+                int ty1 = std::max(0, (int)std::floor(std::min({v[0].y(), v[1].y(), v[2].y()}) - 0.5f) / TILE_SIZE);
+                int ty2 = std::min(n_tile_y - 1, (int)std::ceil(std::max({v[0].y(), v[1].y(), v[2].y()}) + 0.5f) / TILE_SIZE);
+                if (tx1 > tx2 || ty1 > ty2)
+                    continue;
+
+                // Culling. The signed area is positive for counter-clockwise triangles, and the
+                // bounding box holds no sample when none of the sample offsets of a pixel lands
+                // inside its bounds along x, or along y.
+                const float area = (v[1].x() - v[0].x()) * (v[2].y() - v[0].y()) - (v[2].x() - v[0].x()) * (v[1].y() - v[0].y());
+                if (!(std::abs(area) > 0))
+                {
+                    n_degenerate++;
+                    continue;
+                }
+                if ((culling == Culling::Back && area < 0) || (culling == Culling::Front && area > 0))
+                {
+                    n_facing++;
+                    continue;
+                }
+                const float x_min = std::min({v[0].x(), v[1].x(), v[2].x()}), x_max = std::max({v[0].x(), v[1].x(), v[2].x()});
+                const float y_min = std::min({v[0].y(), v[1].y(), v[2].y()}), y_max = std::max({v[0].y(), v[1].y(), v[2].y()});
+                bool hits_x = false, hits_y = false;
+                for (int s = 0; s < msaa; s++)
+                {
+                    hits_x |= std::ceil(x_min - offsets[2 * s]) <= x_max - offsets[2 * s];
+                    hits_y |= std::ceil(y_min - offsets[2 * s + 1]) <= y_max - offsets[2 * s + 1];
+                }
+                if (!hits_x || !hits_y)
+                {
+                    n_sub_pixel++;
+                    continue;
+                }
+                n_drawn++;
+
+                auto& bins = cmds[c].opacity < 1 ? blend_bins[w] : tile_bins[w];
+                for (int ty = ty1; ty <= ty2; ty++)
+                {
+                    for (int tx = tx1; tx <= tx2; tx++)
+                    {
+                        bins[ty * n_tile_x + tx].push_back(tris.size());
+                    }
+                }
+                tris.push_back(t);
+                tri_opacity.push_back(cmds[c].opacity);
+            }
+        }
+        triangles += n_drawn;
+        culled_degenerate += n_degenerate;
+        culled_facing += n_facing;
+        culled_sub_pixel += n_sub_pixel;
+    };
+    run_workers(n_thrd, geometry_worker);
+    stats.triangles = triangles;
+    stats.culled_degenerate = culled_degenerate;
+    stats.culled_facing = culled_facing;
+    stats.culled_sub_pixel = culled_sub_pixel;
+
+    // Raster pass: the workers pull tiles until none is left. The bins are visited in the order of
+    // the workers, which took the triangles in order, so every tile sees the commands in order.
+    // The transparent triangles come after all the opaque ones, whose depth they are tested
+    // against.
+    std::atomic<int> next_tile{0};
+    auto raster_worker = [&](int)
+    {
+        for (int tile = next_tile++; tile < n_tile; tile = next_tile++)
+        {
+            int x0 = (tile % n_tile_x) * TILE_SIZE;
+            int y0 = (tile / n_tile_x) * TILE_SIZE;
+            int x1 = std::min(x0 + TILE_SIZE, width);
+            int y1 = std::min(y0 + TILE_SIZE, height);
+            for (int w = 0; w < n_thrd; w++)
+            {
+                for (int i : tile_bins[w][tile])
+                {
+                    if (msaa > 1)
+                        rasterize_triangle_msaa(screen_tris[w][i], x0, y0, x1, y1);
+                    else
+                        rasterize_triangle(screen_tris[w][i], x0, y0, x1, y1);
+                }
+            }
+            if (!transparent)
+                continue;
+            for (int y = y0; y < y1; y++)
+            {
+                const int row = (height - 1 - y) * width;
+                std::fill(blend_accum.begin() + row + x0, blend_accum.begin() + row + x1, Eigen::Vector4f::Zero());
+                std::fill(blend_reveal.begin() + row + x0, blend_reveal.begin() + row + x1, 1.f);
+            }
+            for (int w = 0; w < n_thrd; w++)
+            {
+                for (int i : blend_bins[w][tile])
+                {
+                    blend_triangle(screen_tris[w][i], screen_opacity[w][i], x0, y0, x1, y1);
+                }
+            }
+        }
+    };
+    run_workers(n_thrd, raster_worker);
 
-        rasterize_triangle(t);
+    if (msaa > 1)
+    {
+        resolve();
+    }
+    if (transparent)
+    {
+        // The samples are resolved for the whole frame, so compositing takes a pass of its own
+        next_tile = 0;
+        run_workers(n_thrd, [&](int)
+        {
+            for (int tile = next_tile++; tile < n_tile; tile = next_tile++)
+            {
+                int x0 = (tile % n_tile_x) * TILE_SIZE;
+                int y0 = (tile / n_tile_x) * TILE_SIZE;
+                composite(x0, y0, std::min(x0 + TILE_SIZE, width), std::min(y0 + TILE_SIZE, height));
+            }
+        });
     }
 }
 
+// Weight of a transparent fragment at depth z, so that nearer fragments dominate the average
+// color of a pixel. The depth of the assignments is not a distance and may well be negative, so
+// the weight falls off exponentially with it rather than with a power as in McGuire and Bavoil.
+static float blend_weight(float alpha, float z)
+{
+    return alpha * std::min(3e3f, std::max(1e-2f, 10 * std::exp(-5 * z)));
+}
 
+void rst::rasterizer::blend_triangle(const Triangle& t, float alpha, int x0, int y0, int x1, int y1) {
+    const Vector3f* v = t.v;
+    fixed_edges edges;
+    if (!edges.setup(v))
+        return;
+    const float inv_area = 1.f / edges.area;
+
+    // Without MSAA the pixel center is the only sample
+    static const float center[2] = {0, 0};
+    const int samples = msaa;
+    const float* offsets = msaa > 1 ? sample_offsets(msaa) : center;
+    int64_t offset_x[8], offset_y[8];
+    for (int s = 0; s < samples; s++)
+    {
+        offset_x[s] = std::llrint(offsets[2*s] * SUBPIXEL_ONE);
+        offset_y[s] = std::llrint(offsets[2*s + 1] * SUBPIXEL_ONE);
+    }
+    const float reach = msaa > 1 ? 0.5f : 0;
+    const int bx1 = std::max(x0, (int)std::ceil(std::min({v[0].x(), v[1].x(), v[2].x()}) - reach));
+    const int bx2 = std::min(x1 - 1, (int)std::floor(std::max({v[0].x(), v[1].x(), v[2].x()}) + reach));
+    const int by1 = std::max(y0, (int)std::ceil(std::min({v[0].y(), v[1].y(), v[2].y()}) - reach));
+    const int by2 = std::min(y1 - 1, (int)std::floor(std::max({v[0].y(), v[1].y(), v[2].y()}) + reach));
+
+    const Eigen::Vector3f color = t.getColor();
+    const int plane = width * height;
+    for (int y = by1; y <= by2; y++)
+    {
+        for (int x = bx1; x <= bx2; x++)
+        {
+            // The covered samples in front of the opaque surfaces, the fraction of them scaling
+            // the opacity of the fragment at their mean depth
+            const int ind = (height-1-y)*width + x;
+            int passed = 0;
+            float z_sum = 0;
+            for (int s = 0; s < samples; s++)
+            {
+                const int64_t X = ((int64_t)x << SUBPIXEL_BITS) + offset_x[s], Y = ((int64_t)y << SUBPIXEL_BITS) + offset_y[s];
+                const int64_t e0 = edges.e(0, X, Y), e1 = edges.e(1, X, Y), e2 = edges.e(2, X, Y);
+                if (e0 < edges.bias[0] || e1 < edges.bias[1] || e2 < edges.bias[2])
+                    continue;
+                float z = (e0*inv_area)*v[0].z() + (e1*inv_area)*v[1].z() + (e2*inv_area)*v[2].z();
+                if (z < depth_buf[s*plane + ind])
+                {
+                    passed++;
+                    z_sum += z;
+                }
+            }
+            if (passed == 0)
+                continue;
 
-//Screen space rasterization
-void rst::rasterizer::rasterize_triangle(const Triangle& t) {
-    auto v = t.toVector4();
-    
-    bool rst = insideTriangle(350,200,t.v);
-
-    // TODO : Find out the bounding box of current triangle.
-
-    //AABB bounding box 
-    int x1{INT_FAST16_MAX},x2{-INT_FAST16_MAX},y1{INT_FAST16_MAX},y2{-INT_FAST16_MAX};//取整
-
-    for(int i =0;i<3;i++)
-    {
-        if(t.v[i].x()<x1)
-            x1 = t.v[i].x();
-        if(t.v[i].x()>x2)
-            x2 = t.v[i].x();
-        if(t.v[i].y()<y1)
-            y1 = t.v[i].y();
-        if(t.v[i].y()>y2)
-            y2 = t.v[i].y();    
-    } 
-   // iterate through the pixel and find if the current pixel is inside the triangle
-    for(int x = x1;x<=x2;x++)
-    {
-        for( int y = y1;y<=y2;y++)
+            const float a = alpha * passed / samples;
+            const float weight = blend_weight(a, z_sum / passed);
+            blend_accum[ind] += Eigen::Vector4f(color.x(), color.y(), color.z(), 1) * weight;
+            blend_reveal[ind] *= 1 - a;
+        }
+    }
+}
+
+void rst::rasterizer::composite(int x0, int y0, int x1, int y1)
+{
+    for (int y = y0; y < y1; y++)
+    {
+        for (int x = x0; x < x1; x++)
         {
-            if(insideTriangle(x,y,t.v))
-            {
-                auto[alpha, beta, gamma] = computeBarycentric2D(x, y, t.v);
-                float w_reciprocal = 1.0/(alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-                float z_interpolated = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-                z_interpolated *= w_reciprocal;
-                auto ind = (height-1-y)*width + x;
-                if(depth_buf[ind]>z_interpolated)
+            const int ind = (height - 1 - y) * width + x;
+            const float reveal = blend_reveal[ind];
+            if (reveal == 1)
+                continue;
+            // Weighted average of the colors, covering the opaque color by the total opacity
+            const Eigen::Vector4f& accum = blend_accum[ind];
+            const Eigen::Vector3f average = accum.head<3>() / std::max(accum.w(), 1e-5f);
+            frame_buf[ind] = average * (1 - reveal) + frame_buf[ind] * reveal;
+        }
+    }
+}
+
+//Multisampled rasterization
+void rst::rasterizer::rasterize_triangle_msaa(const Triangle& t, int x0, int y0, int x1, int y1) {
+    const Vector3f* v = t.v;
+
+    fixed_edges edges;
+    if (!edges.setup(v))
+        return;
+    const float inv_area = 1.f / edges.area;
+
+    // The samples reach half a pixel around the pixel centers
+    const int bx1 = std::max(x0, (int)std::floor(std::min({v[0].x(), v[1].x(), v[2].x()}) - 0.5f));
+    const int bx2 = std::min(x1 - 1, (int)std::ceil(std::max({v[0].x(), v[1].x(), v[2].x()}) + 0.5f));
+    const int by1 = std::max(y0, (int)std::floor(std::min({v[0].y(), v[1].y(), v[2].y()}) - 0.5f));
+    const int by2 = std::min(y1 - 1, (int)std::ceil(std::max({v[0].y(), v[1].y(), v[2].y()}) + 0.5f));
+
+    // The sample offsets are multiples of 1/16 of a pixel, exact in fixed point
+    const float* offsets = sample_offsets(msaa);
+    int64_t offset_x[8], offset_y[8];
+    for (int s = 0; s < msaa; s++)
+    {
+        offset_x[s] = std::llrint(offsets[2*s] * SUBPIXEL_ONE);
+        offset_y[s] = std::llrint(offsets[2*s + 1] * SUBPIXEL_ONE);
+    }
+    const int plane = width * height;
+    for (int y = by1; y <= by2; y++)
+    {
+        for (int x = bx1; x <= bx2; x++)
+        {
+            // Coverage and depth test of every sample, then one shading for all those passing
+            const int ind = (height-1-y)*width + x;
+            unsigned passed = 0;
+            float z[8];
+            for (int s = 0; s < msaa; s++)
+            {
+                const int64_t X = ((int64_t)x << SUBPIXEL_BITS) + offset_x[s], Y = ((int64_t)y << SUBPIXEL_BITS) + offset_y[s];
+                const int64_t e0 = edges.e(0, X, Y), e1 = edges.e(1, X, Y), e2 = edges.e(2, X, Y);
+                if (e0 < edges.bias[0] || e1 < edges.bias[1] || e2 < edges.bias[2])
+                    continue;
+                z[s] = (e0*inv_area)*v[0].z() + (e1*inv_area)*v[1].z() + (e2*inv_area)*v[2].z();
+                if (z[s] < depth_buf[s*plane + ind])
+                    passed |= 1u << s;
+            }
+            if (passed == 0)
+                continue;
+
+            Eigen::Vector3f color = t.getColor();
+            for (int s = 0; s < msaa; s++)
+            {
+                if (passed & (1u << s))
                 {
-                    depth_buf[ind] = z_interpolated; 
-                    set_pixel(Vector3f((float)x,(float)y,0),t.getColor());
+                    depth_buf[s*plane + ind] = z[s];
+                    sample_buf[s*plane + ind] = color;
                 }
             }
         }
     }
+}
 
+void rst::rasterizer::resolve()
+{
+    // The sample planes are plain float arrays laid out like the frame buffer, so the average is
+    // a few straight loops over floats that vectorize
+    const int n = width * height * 3;
+    const float* samples = sample_buf.data()->data();
+    float* out = frame_buf.data()->data();
+    std::copy(samples, samples + n, out);
+    for (int s = 1; s < msaa; s++)
+    {
+        const float* plane = samples + s * n;
+        for (int i = 0; i < n; i++)
+            out[i] += plane[i];
+    }
+    const float scale = 1.f / msaa;
+    for (int i = 0; i < n; i++)
+        out[i] *= scale;
+}
 
 
-    // If so, use the following code to get the interpolated z value.
-    //auto[alpha, beta, gamma] = computeBarycentric2D(x, y, t.v);
-    //float w_reciprocal = 1.0/(alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-    //float z_interpolated = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-    //z_interpolated *= w_reciprocal;
 
-    // TODO : set the current pixel (use the set_pixel function) to the color of the triangle (use getColor function) if it should be painted.
+//Screen space rasterization
+void rst::rasterizer::rasterize_triangle(const Triangle& t, int tile_x0, int tile_y0, int tile_x1, int tile_y1) {
+    const Vector3f* v = t.v;
+    fixed_edges edges;
+    if (!edges.setup(v))
+        return;
+    const float inv_area = 1.f / edges.area;
+
+    // Pixels of the tile whose center is inside the bounding box
+    const int x1 = std::max(tile_x0, (int)std::ceil(std::min({v[0].x(), v[1].x(), v[2].x()})));
+    const int x2 = std::min(tile_x1 - 1, (int)std::floor(std::max({v[0].x(), v[1].x(), v[2].x()})));
+    const int y1 = std::max(tile_y0, (int)std::ceil(std::min({v[0].y(), v[1].y(), v[2].y()})));
+    const int y2 = std::min(tile_y1 - 1, (int)std::floor(std::max({v[0].y(), v[1].y(), v[2].y()})));
+
+    // The edge functions step by a[i] << SUBPIXEL_BITS from one pixel to the next. Shifted by their
+    // bias, a pixel is covered when none of the three is negative.
+    const int64_t d0 = edges.a[0] << SUBPIXEL_BITS, d1 = edges.a[1] << SUBPIXEL_BITS, d2 = edges.a[2] << SUBPIXEL_BITS;
+    const Eigen::Vector3f color = t.getColor();
+    for (int y = y1; y <= y2; y++)
+    {
+        const int64_t X = (int64_t)x1 << SUBPIXEL_BITS, Y = (int64_t)y << SUBPIXEL_BITS;
+        int64_t e0 = edges.e(0, X, Y) - edges.bias[0];
+        int64_t e1 = edges.e(1, X, Y) - edges.bias[1];
+        int64_t e2 = edges.e(2, X, Y) - edges.bias[2];
+        for (int x = x1; x <= x2; x++, e0 += d0, e1 += d1, e2 += d2)
+        {
+            if ((e0 | e1 | e2) < 0)
+                continue;
+            float z = ((e0 + edges.bias[0])*inv_area)*v[0].z() + ((e1 + edges.bias[1])*inv_area)*v[1].z() + ((e2 + edges.bias[2])*inv_area)*v[2].z();
+            auto ind = (height-1-y)*width + x;
+            if (depth_buf[ind] > z)
+            {
+                depth_buf[ind] = z;
+                set_pixel(Vector3f((float)x,(float)y,0), color);
+            }
+        }
+    }
 }
 
 void rst::rasterizer::set_model(const Eigen::Matrix4f& m)
@@ -208,6 +656,7 @@ void rst::rasterizer::clear(rst::Buffers buff)
     if ((buff & rst::Buffers::Color) == rst::Buffers::Color)
     {
         std::fill(frame_buf.begin(), frame_buf.end(), Eigen::Vector3f{0, 0, 0});
+        std::fill(sample_buf.begin(), sample_buf.end(), Eigen::Vector3f{0, 0, 0});
     }
     if ((buff & rst::Buffers::Depth) == rst::Buffers::Depth)
     {
@@ -221,6 +670,57 @@ rst::rasterizer::rasterizer(int w, int h) : width(w), height(h)
     depth_buf.resize(w * h);
 }
 
+void rst::rasterizer::set_msaa(int samples)
+{
+    if (samples != 1 && samples != 2 && samples != 4 && samples != 8)
+    {
+        throw std::runtime_error("MSAA supports 1, 2, 4 or 8 samples per pixel");
+    }
+    msaa = samples;
+    depth_buf.assign(width * height * msaa, std::numeric_limits<float>::infinity());
+    sample_buf.assign(msaa > 1 ? width * height * msaa : 0, Eigen::Vector3f{0, 0, 0});
+    std::fill(frame_buf.begin(), frame_buf.end(), Eigen::Vector3f{0, 0, 0});
+}
+
+std::vector<uint8_t>& rst::rasterizer::output_buffer(PixelFormat format)
+{
+    // One pass over the frame buffer does the conversion to bytes and the channel order
+    const int channels = format == PixelFormat::RGBA8 ? 4 : 3;
+    output_buf.resize(width * height * channels);
+    const float* in = frame_buf.data()->data();
+    uint8_t* out = output_buf.data();
+    auto to_byte = [](float v) { return (uint8_t)std::lrint(std::min(255.f, std::max(0.f, v))); };
+
+    const int n_thrd = std::max(1u, std::thread::hardware_concurrency());
+    const int n_pixel = width * height;
+    auto pack_worker = [&](int t)
+    {
+        const int chunk = (n_pixel + n_thrd - 1) / n_thrd;
+        const int end = std::min(n_pixel, (t + 1) * chunk);
+        if (format == PixelFormat::RGBA8)
+        {
+            for (int i = t * chunk; i < end; i++)
+            {
+                out[4 * i] = to_byte(in[3 * i]);
+                out[4 * i + 1] = to_byte(in[3 * i + 1]);
+                out[4 * i + 2] = to_byte(in[3 * i + 2]);
+                out[4 * i + 3] = 255;
+            }
+        }
+        else
+        {
+            for (int i = t * chunk; i < end; i++)
+            {
+                out[3 * i] = to_byte(in[3 * i + 2]);
+                out[3 * i + 1] = to_byte(in[3 * i + 1]);
+                out[3 * i + 2] = to_byte(in[3 * i]);
+            }
+        }
+    };
+    run_workers(n_thrd, pack_worker);
+    return output_buf;
+}
+
 int rst::rasterizer::get_index(int x, int y)
 {
     return (height-1-y)*width + x;
@@ -229,6 +729,8 @@ int rst::rasterizer::get_index(int x, int y)
 void rst::rasterizer::set_pixel(const Eigen::Vector3f& point, const Eigen::Vector3f& color)
 {
     //old index: auto ind = point.y() + point.x() * width;
+    if (point.x() < 0 || point.x() >= width ||
+        point.y() < 0 || point.y() >= height) return;
     auto ind = (height-1-point.y())*width + point.x();
     frame_buf[ind] = color;
 
@@ -6,6 +6,10 @@
 
 #include <eigen3/Eigen/Eigen>
 #include <algorithm>
+#include <cstdint>
+#include <future>
+#include <thread>
+#include <vector>
 #include "global.hpp"
 #include "Triangle.hpp"
 using namespace Eigen;
@@ -34,6 +38,34 @@ namespace rst
         Triangle
     };
 
+    // Byte layouts of output_buffer(). BGR8 is the layout of a CV_8UC3 cv::Mat, RGBA8 the one of
+    // most image files and textures.
+    enum class PixelFormat
+    {
+        BGR8,
+        RGBA8
+    };
+
+    // Which triangles draw() skips by their winding on screen. Front faces are counter-clockwise
+    // with y up, like OpenGL.
+    enum class Culling
+    {
+        None,
+        Back,
+        Front
+    };
+
+    // Triangle counters of the last draw() or execute(). The triangles left after clipping whose
+    // bounding box meets the screen are either drawn, or culled for the first of these reasons:
+    // zero area, facing away, or no sample point inside their bounding box.
+    struct draw_stats
+    {
+        long triangles = 0;
+        long culled_degenerate = 0;
+        long culled_facing = 0;
+        long culled_sub_pixel = 0;
+    };
+
     /*
      * For the curious : The draw function takes two buffer id's as its arguments. These two structs
      * make sure that if you mix up with their orders, the compiler won't compile it.
@@ -54,13 +86,82 @@ namespace rst
         int col_id = 0;
     };
 
+    // Buffers of one type, each in its own contiguous vector. A handle is the index of the slot of
+    // its buffer, so a draw finds its buffers without a search, and a vector passed as an rvalue is
+    // moved in rather than copied.
+    template <typename T>
+    class buffer_pool
+    {
+    public:
+        int add(std::vector<T> data)
+        {
+            slots.push_back(std::move(data));
+            return (int)slots.size() - 1;
+        }
+
+        const std::vector<T>& operator[](int id) const { return slots[id]; }
+
+    private:
+        std::vector<std::vector<T>> slots;
+    };
+
+    // Square screen tiles of the raster pass of execute(). A tile is only ever touched by the worker
+    // that took it, so the depth test and the buffer writes need no synchronisation.
+    constexpr int TILE_SIZE = 32;
+
+    // Runs worker(0) .. worker(n_thrd - 1) on their own threads and waits for all of them
+    template <typename F>
+    void run_workers(int n_thrd, F&& worker)
+    {
+        std::vector<std::future<void>> futures;
+        futures.reserve(n_thrd);
+        for (int t = 0; t < n_thrd; t++)
+        {
+            futures.emplace_back(std::async(std::launch::async, worker, t));
+        }
+        for (auto& f : futures)
+        {
+            f.get();
+        }
+    }
+
+    // One recorded draw: the buffers of a mesh, and the model matrix and opacity it is drawn with
+    struct draw_command
+    {
+        pos_buf_id pos_buffer;
+        ind_buf_id ind_buffer;
+        col_buf_id col_buffer;
+        Primitive type;
+        Eigen::Matrix4f model;
+        float opacity;
+    };
+
+    // Draws recorded for rasterizer::execute(), which renders all of them in one pass. The list can
+    // be executed any number of times and cleared to record the next frame.
+    class command_list
+    {
+    public:
+        void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type, const Eigen::Matrix4f& model,
+                  float opacity = 1)
+        {
+            cmds.push_back({pos_buffer, ind_buffer, col_buffer, type, model, opacity});
+        }
+
+        void clear() { cmds.clear(); }
+
+        const std::vector<draw_command>& commands() const { return cmds; }
+
+    private:
+        std::vector<draw_command> cmds;
+    };
+
     class rasterizer
     {
     public:
         rasterizer(int w, int h);
-        pos_buf_id load_positions(const std::vector<Eigen::Vector3f>& positions);
-        ind_buf_id load_indices(const std::vector<Eigen::Vector3i>& indices);
-        col_buf_id load_colors(const std::vector<Eigen::Vector3f>& colors);
+        pos_buf_id load_positions(std::vector<Eigen::Vector3f> positions);
+        ind_buf_id load_indices(std::vector<Eigen::Vector3i> indices);
+        col_buf_id load_colors(std::vector<Eigen::Vector3f> colors);
 
         void set_model(const Eigen::Matrix4f& m);
         void set_view(const Eigen::Matrix4f& v);
@@ -70,14 +171,53 @@ namespace rst
 
         void clear(Buffers buff);
 
+        // Opacity of the meshes drawn by draw(), 1 by default
+        void set_opacity(float a) { opacity = a; }
+
+        // Draws one mesh with the current model matrix and opacity, as a command list of one draw
         void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type);
 
+        // Draws all the commands of the list, each with its own model matrix and the current view
+        // and projection. The triangles of all the draws are transformed, clipped and binned to
+        // screen tiles in one parallel pass, then the tiles are rasterized in parallel, each one
+        // drawing its triangles in the order of the commands.
+        //
+        // Commands with an opacity below 1 are transparent, and blended with weighted blended
+        // order-independent transparency: every tile draws them after its opaque triangles,
+        // depth tested without writing the depth, into per-pixel sums weighted by opacity and
+        // depth, and the sums are composited over the frame buffer once all the tiles are done.
+        // No sorting is needed, and the result does not depend on the order of the triangles.
+        void execute(const command_list& commands);
+
+        // Samples per pixel: 1 (the default), 2, 4 or 8. With more than one, every sample keeps its
+        // own depth and color, a triangle is shaded once per pixel for all the samples it covers,
+        // and draw() averages the samples into the frame buffer. Clears both buffers.
+        void set_msaa(int samples);
+
+        void set_culling(Culling c) { culling = c; }
+        const draw_stats& last_draw_stats() const { return stats; }
+
         std::vector<Eigen::Vector3f>& frame_buffer() { return frame_buf; }
 
+        // The frame buffer with 8 bits per channel, clamped to [0, 255] and rounded, in format. The
+        // bytes stay valid until the next call, so a cv::Mat can wrap them without a copy.
+        std::vector<uint8_t>& output_buffer(PixelFormat format = PixelFormat::BGR8);
+
     private:
         void draw_line(Eigen::Vector3f begin, Eigen::Vector3f end);
 
-        void rasterize_triangle(const Triangle& t);
+        // Rasterize the part of t inside the tile [x0, x1) x [y0, y1)
+        void rasterize_triangle(const Triangle& t, int x0, int y0, int x1, int y1);
+        void rasterize_triangle_msaa(const Triangle& t, int x0, int y0, int x1, int y1);
+
+        // Accumulates the part of a transparent triangle inside the tile into the blend buffers
+        void blend_triangle(const Triangle& t, float alpha, int x0, int y0, int x1, int y1);
+
+        // Blends the transparent fragments accumulated in the tile over the frame buffer
+        void composite(int x0, int y0, int x1, int y1);
+
+        // Averages the samples of every pixel into frame_buf
+        void resolve();
 
         // VERTEX SHADER -> MVP -> Clipping -> /.W -> VIEWPORT -> DRAWLINE/DRAWTRI -> FRAGSHADER
 
@@ -86,18 +226,39 @@ namespace rst
         Eigen::Matrix4f view;
         Eigen::Matrix4f projection;
 
-        std::map<int, std::vector<Eigen::Vector3f>> pos_buf;
-        std::map<int, std::vector<Eigen::Vector3i>> ind_buf;
-        std::map<int, std::vector<Eigen::Vector3f>> col_buf;
+        buffer_pool<Eigen::Vector3f> pos_buf;
+        buffer_pool<Eigen::Vector3i> ind_buf;
+        buffer_pool<Eigen::Vector3f> col_buf;
 
         std::vector<Eigen::Vector3f> frame_buf;
+        std::vector<uint8_t> output_buf;
 
         std::vector<float> depth_buf;
         int get_index(int x, int y);
 
-        int width, height;
+        // With msaa > 1, depth_buf and sample_buf hold one plane per sample: sample s of the pixel
+        // at index i is at s * width * height + i
+        int msaa = 1;
+        std::vector<Eigen::Vector3f> sample_buf;
+
+        Culling culling = Culling::None;
+        draw_stats stats;
+        float opacity = 1;
+
+        // Sums of the transparent fragments of every pixel: the weighted premultiplied colors
+        // and weights in blend_accum, and the product of their transparencies in blend_reveal
+        std::vector<Eigen::Vector4f> blend_accum;
+        std::vector<float> blend_reveal;
 
-        int next_id = 0;
-        int get_next_id() { return next_id++; }
+        // Screen space triangles of execute(), one list per worker of the geometry pass, with the
+        // opacity of their command. tile_bins[worker][tile] lists the opaque triangles of that
+        // worker touching the tile, and blend_bins the transparent ones. All keep their storage
+        // from one call to the next.
+        std::vector<std::vector<Triangle>> screen_tris;
+        std::vector<std::vector<float>> screen_opacity;
+        std::vector<std::vector<std::vector<int>>> tile_bins;
+        std::vector<std::vector<std::vector<int>>> blend_bins;
+
+        int width, height;
     };
 }
@@ -23,6 +23,9 @@ struct fragment_shader_payload
     Eigen::Vector3f color;
     Eigen::Vector3f normal;
     Eigen::Vector2f tex_coords;
+    // change of tex_coords from one pixel to the next along the screen x and y axes
+    Eigen::Vector2f tex_coords_dx = Eigen::Vector2f::Zero();
+    Eigen::Vector2f tex_coords_dy = Eigen::Vector2f::Zero();
     Texture* texture;
 };
 
@@ -31,4 +34,60 @@ struct vertex_shader_payload
     Eigen::Vector3f position;
 };
 
+// Up to capacity fragments in structure-of-arrays form. A batch shader is any callable taking a
+// fragment_batch& that fills out_color for the first count fragments, so it can run every step
+// of the shading as one loop over the fragments that the compiler vectorizes.
+struct fragment_batch
+{
+    static constexpr int capacity = 64;
+
+    int count = 0;
+    float view_pos[3][capacity];
+    float color[3][capacity];
+    float normal[3][capacity];
+    float tex_coords[2][capacity];
+    float tex_coords_dx[2][capacity];
+    float tex_coords_dy[2][capacity];
+    Texture* texture = nullptr;
+
+    float out_color[3][capacity];
+
+    fragment_shader_payload payload(int i) const
+    {
+        fragment_shader_payload p(Eigen::Vector3f(color[0][i], color[1][i], color[2][i]),
+                                  Eigen::Vector3f(normal[0][i], normal[1][i], normal[2][i]),
+                                  Eigen::Vector2f(tex_coords[0][i], tex_coords[1][i]), texture);
+        p.view_pos = Eigen::Vector3f(view_pos[0][i], view_pos[1][i], view_pos[2][i]);
+        p.tex_coords_dx = Eigen::Vector2f(tex_coords_dx[0][i], tex_coords_dx[1][i]);
+        p.tex_coords_dy = Eigen::Vector2f(tex_coords_dy[0][i], tex_coords_dy[1][i]);
+        return p;
+    }
+
+    void set_out_color(int i, const Eigen::Vector3f& c)
+    {
+        out_color[0][i] = c.x();
+        out_color[1][i] = c.y();
+        out_color[2][i] = c.z();
+    }
+};
+
+// Batch shader running a shader of a single fragment_shader_payload on every fragment
+template <typename F>
+struct per_fragment_shader
+{
+    F shader;
+
+    void operator()(fragment_batch& batch) const
+    {
+        for (int i = 0; i < batch.count; i++)
+            batch.set_out_color(i, shader(batch.payload(i)));
+    }
+};
+
+template <typename F>
+per_fragment_shader<F> per_fragment(F shader)
+{
+    return {shader};
+}
+
 #endif //RASTERIZER_SHADER_H
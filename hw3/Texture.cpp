@@ -2,3 +2,217 @@
 // Created by LEI XU on 4/27/19.
 //
 
+#include <cmath>
+#include "Texture.hpp"
+
+namespace
+{
+    uint32_t pack_rgb(const float *rgb)
+    {
+        uint32_t texel = 0xff000000u;
+        for (int k = 0; k < 3; k++)
+        {
+            texel |= (uint32_t)std::lround(std::min(255.f, std::max(0.f, rgb[k]))) << (8 * k);
+        }
+        return texel;
+    }
+
+    float channel(uint32_t texel, int k)
+    {
+        return (float)((texel >> (8 * k)) & 0xff);
+    }
+
+    float clamp01(float x)
+    {
+        return std::min(1.f, std::max(0.f, x));
+    }
+}
+
+Texture::Texture(const std::string &name)
+{
+    cv::Mat image_data = cv::imread(name);
+    cv::cvtColor(image_data, image_data, cv::COLOR_RGB2BGR);
+    width = image_data.cols;
+    height = image_data.rows;
+
+    std::vector<float> rgb(width * height * 3);
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            auto color = image_data.at<cv::Vec3b>(y, x);
+            for (int k = 0; k < 3; k++)
+                rgb[(y * width + x) * 3 + k] = color[k];
+        }
+    }
+
+    // Heights and their differences, clamped at the borders. v grows towards the top of the image.
+    const int tiles_x = (width + 3) / 4;
+    auto height_at = [&](int x, int y)
+    {
+        x = std::min(std::max(x, 0), width - 1);
+        y = std::min(std::max(y, 0), height - 1);
+        const float *c = &rgb[(y * width + x) * 3];
+        return std::sqrt(c[0] * c[0] + c[1] * c[1] + c[2] * c[2]);
+    };
+    heights.resize(tiles_x * ((height + 3) / 4) * 16);
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            float h = height_at(x, y);
+            heights[((y >> 2) * tiles_x + (x >> 2)) * 16 + (y & 3) * 4 + (x & 3)] = {h, height_at(x + 1, y) - h, height_at(x, y - 1) - h};
+        }
+    }
+
+    // Every level averages 2x2 texels of the previous one. The averages stay in float until
+    // they are packed so the rounding does not add up down the pyramid.
+    int w = width, h = height;
+    while (true)
+    {
+        mip_level level;
+        level.width = w;
+        level.height = h;
+        level.tiles_x = (w + 3) / 4;
+        level.texels.assign(level.tiles_x * ((h + 3) / 4) * 16, 0);
+        for (int y = 0; y < h; y++)
+        {
+            for (int x = 0; x < w; x++)
+            {
+                level.texels[((y >> 2) * level.tiles_x + (x >> 2)) * 16 + (y & 3) * 4 + (x & 3)] = pack_rgb(&rgb[(y * w + x) * 3]);
+            }
+        }
+        levels.push_back(std::move(level));
+        if (w == 1 && h == 1)
+            break;
+
+        int next_w = std::max(1, w / 2), next_h = std::max(1, h / 2);
+        std::vector<float> next(next_w * next_h * 3);
+        for (int y = 0; y < next_h; y++)
+        {
+            int y0 = std::min(2 * y, h - 1), y1 = std::min(2 * y + 1, h - 1);
+            for (int x = 0; x < next_w; x++)
+            {
+                int x0 = std::min(2 * x, w - 1), x1 = std::min(2 * x + 1, w - 1);
+                for (int k = 0; k < 3; k++)
+                {
+                    next[(y * next_w + x) * 3 + k] = 0.25f * (rgb[(y0 * w + x0) * 3 + k] + rgb[(y0 * w + x1) * 3 + k] +
+                                                              rgb[(y1 * w + x0) * 3 + k] + rgb[(y1 * w + x1) * 3 + k]);
+                }
+            }
+        }
+        rgb.swap(next);
+        w = next_w;
+        h = next_h;
+    }
+}
+
+Eigen::Vector3f Texture::getColor(float u, float v) const
+{
+    const mip_level &level = levels[0];
+    int x = std::min((int)(clamp01(u) * width), width - 1);
+    int y = std::min((int)((1 - clamp01(v)) * height), height - 1);
+    uint32_t texel = level.fetch(x, y);
+    return Eigen::Vector3f(channel(texel, 0), channel(texel, 1), channel(texel, 2));
+}
+
+void Texture::bilinear(const mip_level &level, float u, float v, float rgb[3]) const
+{
+    // Texel centers are at half-integer coordinates
+    float x = clamp01(u) * level.width - 0.5f;
+    float y = (1 - clamp01(v)) * level.height - 0.5f;
+    int x0 = (int)std::floor(x), y0 = (int)std::floor(y);
+    float s = x - x0, t = y - y0;
+
+    uint32_t c00 = level.fetch(x0, y0), c10 = level.fetch(x0 + 1, y0);
+    uint32_t c01 = level.fetch(x0, y0 + 1), c11 = level.fetch(x0 + 1, y0 + 1);
+    for (int k = 0; k < 3; k++)
+    {
+        float top = channel(c00, k) + s * (channel(c10, k) - channel(c00, k));
+        float bottom = channel(c01, k) + s * (channel(c11, k) - channel(c01, k));
+        rgb[k] = top + t * (bottom - top);
+    }
+}
+
+Eigen::Vector3f Texture::getColorBilinear(float u, float v) const
+{
+    float rgb[3];
+    bilinear(levels[0], u, v, rgb);
+    return Eigen::Vector3f(rgb[0], rgb[1], rgb[2]);
+}
+
+float Texture::level_of_detail(float du_dx, float dv_dx, float du_dy, float dv_dy) const
+{
+    // log2 of the longer side of the pixel footprint, measured in texels of the full image
+    float x2 = du_dx * du_dx * width * width + dv_dx * dv_dx * height * height;
+    float y2 = du_dy * du_dy * width * width + dv_dy * dv_dy * height * height;
+    float lod = 0.5f * std::log2(std::max(x2, y2));
+    return std::min((float)levels.size() - 1, std::max(0.f, lod));
+}
+
+void Texture::trilinear(float u, float v, float lod, float rgb[3]) const
+{
+    int l0 = (int)lod;
+    float t = lod - l0;
+    bilinear(levels[l0], u, v, rgb);
+    if (t > 0 && l0 + 1 < (int)levels.size())
+    {
+        float next[3];
+        bilinear(levels[l0 + 1], u, v, next);
+        for (int k = 0; k < 3; k++)
+            rgb[k] += t * (next[k] - rgb[k]);
+    }
+}
+
+Eigen::Vector3f Texture::getColorTrilinear(float u, float v, const Eigen::Vector2f &duv_dx, const Eigen::Vector2f &duv_dy) const
+{
+    float rgb[3];
+    trilinear(u, v, level_of_detail(duv_dx.x(), duv_dx.y(), duv_dy.x(), duv_dy.y()), rgb);
+    return Eigen::Vector3f(rgb[0], rgb[1], rgb[2]);
+}
+
+void Texture::getColorsTrilinear(int n, const float *u, const float *v, const float *du_dx, const float *dv_dx,
+                                 const float *du_dy, const float *dv_dy, float *const rgb[3]) const
+{
+    for (int i = 0; i < n; i++)
+    {
+        float color[3];
+        trilinear(u[i], v[i], level_of_detail(du_dx[i], dv_dx[i], du_dy[i], dv_dy[i]), color);
+        rgb[0][i] = color[0];
+        rgb[1][i] = color[1];
+        rgb[2][i] = color[2];
+    }
+}
+
+Eigen::Vector3f Texture::getHeight(float u, float v) const
+{
+    float hgt[3];
+    float *const out[3] = {&hgt[0], &hgt[1], &hgt[2]};
+    getHeights(1, &u, &v, out);
+    return Eigen::Vector3f(hgt[0], hgt[1], hgt[2]);
+}
+
+void Texture::getHeights(int n, const float *u, const float *v, float *const hgt[3]) const
+{
+    const int tiles_x = levels[0].tiles_x;
+    auto fetch = [&](int x, int y) -> const height_texel &
+    {
+        x = std::min(std::max(x, 0), width - 1);
+        y = std::min(std::max(y, 0), height - 1);
+        return heights[((y >> 2) * tiles_x + (x >> 2)) * 16 + (y & 3) * 4 + (x & 3)];
+    };
+    for (int i = 0; i < n; i++)
+    {
+        float x = clamp01(u[i]) * width - 0.5f;
+        float y = (1 - clamp01(v[i])) * height - 0.5f;
+        int x0 = (int)std::floor(x), y0 = (int)std::floor(y);
+        float s = x - x0, t = y - y0;
+
+        const height_texel &c00 = fetch(x0, y0), &c10 = fetch(x0 + 1, y0);
+        const height_texel &c01 = fetch(x0, y0 + 1), &c11 = fetch(x0 + 1, y0 + 1);
+        const float w00 = (1 - s) * (1 - t), w10 = s * (1 - t), w01 = (1 - s) * t, w11 = s * t;
+        hgt[0][i] = w00 * c00.h + w10 * c10.h + w01 * c01.h + w11 * c11.h;
+        hgt[1][i] = w00 * c00.dh_du + w10 * c10.dh_du + w01 * c01.dh_du + w11 * c11.dh_du;
+        hgt[2][i] = w00 * c00.dh_dv + w10 * c10.dh_dv + w01 * c01.dh_dv + w11 * c11.dh_dv;
+    }
+}
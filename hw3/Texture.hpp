@@ -5,38 +5,73 @@
 #ifndef RASTERIZER_TEXTURE_H
 #define RASTERIZER_TEXTURE_H
 #include "global.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <vector>
 #include <eigen3/Eigen/Eigen>
 #include <opencv2/opencv.hpp>
 class Texture
 {
 private:
-    cv::Mat image_data;
+    // One level of the mip pyramid. The RGBA8 texels are stored in 4x4 tiles of 64 bytes, so the
+    // four texels of a bilinear lookup are in one or two cache lines instead of two image rows.
+    struct mip_level
+    {
+        int width, height;
+        int tiles_x;
+        std::vector<uint32_t> texels;
 
-public:
-    Texture(const std::string &name)
+        // Texel (x, y), both clamped to the level
+        uint32_t fetch(int x, int y) const
+        {
+            x = std::min(std::max(x, 0), width - 1);
+            y = std::min(std::max(y, 0), height - 1);
+            return texels[((y >> 2) * tiles_x + (x >> 2)) * 16 + (y & 3) * 4 + (x & 3)];
+        }
+    };
+
+    // levels[0] is the image, every next level half the size of the previous one down to 1x1
+    std::vector<mip_level> levels;
+
+    // The image read as a height field h = |color|, with the differences to the next texel along u
+    // and along v, in the tile layout of the mip levels. Bump and displacement mapping get all
+    // three from one lookup instead of finite differences over three color lookups.
+    struct height_texel
     {
-        image_data = cv::imread(name);
-        cv::cvtColor(image_data, image_data, cv::COLOR_RGB2BGR);
-        width = image_data.cols;
-        height = image_data.rows;
-    }
+        float h, dh_du, dh_dv;
+    };
+    std::vector<height_texel> heights;
+
+    void bilinear(const mip_level &level, float u, float v, float rgb[3]) const;
+    void trilinear(float u, float v, float lod, float rgb[3]) const;
+
+    // Mip level whose texels are about the size of a pixel
+    float level_of_detail(float du_dx, float dv_dx, float du_dy, float dv_dy) const;
+
+public:
+    Texture(const std::string &name);
 
     int width, height;
 
-    Eigen::Vector3f getColor(float u, float v)
-    {
-        if (u < 0)
-            u = 0;
-        if (v < 0)
-            v = 0;
-        if (u > 1)
-            u = 1;
-        if (v > 1)
-            v = 1;
-        auto u_img = u * width;
-        auto v_img = (1 - v) * height;
-        auto color = image_data.at<cv::Vec3b>(v_img, u_img);
-        return Eigen::Vector3f(color[0], color[1], color[2]);
-    }
+    // Nearest texel of the full resolution image, u and v clamped to [0, 1]
+    Eigen::Vector3f getColor(float u, float v) const;
+
+    Eigen::Vector3f getColorBilinear(float u, float v) const;
+
+    // Bilinear lookups in the two mip levels closest to the footprint of a pixel, given by the
+    // derivatives of the texture coordinates along the screen x and y axes
+    Eigen::Vector3f getColorTrilinear(float u, float v, const Eigen::Vector2f &duv_dx, const Eigen::Vector2f &duv_dy) const;
+
+    // Height h(u, v), h(u + 1 / width, v) - h(u, v) and h(u, v + 1 / height) - h(u, v), filtered
+    // bilinearly
+    Eigen::Vector3f getHeight(float u, float v) const;
+
+    // getHeight on n lookups at once, into hgt[0][i], hgt[1][i] and hgt[2][i]
+    void getHeights(int n, const float *u, const float *v, float *const hgt[3]) const;
+
+    // getColorTrilinear on n lookups at once, for the batch shaders. The colors go to
+    // rgb[0][i], rgb[1][i] and rgb[2][i].
+    void getColorsTrilinear(int n, const float *u, const float *v, const float *du_dx, const float *dv_dx,
+                            const float *du_dy, const float *dv_dy, float *const rgb[3]) const;
 };
 #endif // RASTERIZER_TEXTURE_H
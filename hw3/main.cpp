@@ -1,4 +1,12 @@
 #include <iostream>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
 #include <opencv2/opencv.hpp>
 
 #include "global.hpp"
@@ -23,6 +31,22 @@ Eigen::Matrix4f get_view_matrix(Eigen::Vector3f eye_pos)
     return view;
 }
 
+// View matrix of an eye at eye_pos looking at target, with up pointing up on screen
+Eigen::Matrix4f get_look_at_matrix(Eigen::Vector3f eye_pos, Eigen::Vector3f target, Eigen::Vector3f up)
+{
+    Eigen::Vector3f z = (eye_pos - target).normalized();
+    Eigen::Vector3f x = up.cross(z).normalized();
+    Eigen::Vector3f y = z.cross(x);
+
+    Eigen::Matrix4f rotate;
+    rotate << x.x(), x.y(), x.z(), 0,
+        y.x(), y.y(), y.z(), 0,
+        z.x(), z.y(), z.z(), 0,
+        0, 0, 0, 1;
+
+    return rotate * get_view_matrix(eye_pos);
+}
+
 Eigen::Matrix4f get_model_matrix(float angle)
 {
     Eigen::Matrix4f rotation;
@@ -103,7 +127,7 @@ Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload &payload)
     if (payload.texture)
     {
         Vector2f uv = payload.tex_coords; // 是否是做uv映射?
-        return_color = payload.texture->getColor((uv.x()), abs(uv.y()));
+        return_color = payload.texture->getColorTrilinear(uv.x(), abs(uv.y()), payload.tex_coords_dx, payload.tex_coords_dy);
         // TODO: Get the texture value at the texture coordinates of the current fragment
     }
     Eigen::Vector3f texture_color;
@@ -191,6 +215,220 @@ Eigen::Vector3f phong_fragment_shader(const fragment_shader_payload &payload)
     return result_color * 255.f;
 }
 
+// Depth of the mesh seen from a point light, rendered by a rasterizer of its own in the depth-only
+// mode, so the pass never runs a shader. The light and the lookups are in the view space of the
+// camera, like the lights of the shaders.
+class shadow_map
+{
+public:
+    static constexpr int size = 512;
+
+    // The map frames a sphere of the given radius around target
+    shadow_map(std::vector<float> vertices, const rst::vertex_layout &layout, std::vector<Eigen::Vector3i> indices,
+               const Eigen::Vector3f &light_pos, const Eigen::Vector3f &target, float radius)
+        : r(size, size)
+    {
+        vtx_id = r.load_vertices(std::move(vertices), layout);
+        ind_id = r.load_indices(std::move(indices));
+        r.set_shading(rst::Shading::DepthOnly);
+        // Only the faces turned away from the light are kept: the lit surfaces are then far
+        // in front of the stored depth and do not shadow themselves
+        r.set_culling(rst::Culling::Front);
+
+        const float distance = (light_pos - target).norm();
+        const float fov = 2 * std::asin(std::min(1.f, radius / distance)) * 180 / MY_PI;
+        light_view = get_look_at_matrix(light_pos, target, {0, 1, 0});
+        light_projection = get_projection_matrix(fov, 1, std::max(0.1f, distance - radius), distance + radius);
+        camera_to_light = light_projection * light_view;
+    }
+
+    // Renders the mesh with the model and camera view matrices of the frame
+    void render(const Eigen::Matrix4f &model, const Eigen::Matrix4f &view)
+    {
+        r.clear(rst::Buffers::Depth);
+        r.set_model(model);
+        r.set_view(light_view * view);
+        r.set_projection(light_projection);
+        r.draw(vtx_id, ind_id, rst::Primitive::Triangle);
+    }
+
+    // Percentage closer filtering: the fraction of the 3x3 texels around the point (x, y, z) that
+    // do not hide it. Points outside of the map are lit.
+    float visibility(float x, float y, float z) const
+    {
+        const Eigen::Vector3f p = r.screen_position(camera_to_light * Eigen::Vector4f(x, y, z, 1));
+        const std::vector<float> &depth = r.depth_buffer();
+        const int cx = (int)std::lround(p.x()), cy = (int)std::lround(p.y());
+        int lit = 0;
+        for (int dy = -1; dy <= 1; dy++)
+        {
+            for (int dx = -1; dx <= 1; dx++)
+            {
+                const int tx = std::min(std::max(cx + dx, 0), size - 1), ty = std::min(std::max(cy + dy, 0), size - 1);
+                lit += p.z() - bias <= depth[(size - 1 - ty) * size + tx];
+            }
+        }
+        return lit / 9.f;
+    }
+
+private:
+    // In screen depth units, against the rounding of the depths and the slope of the surfaces
+    // across a texel
+    static constexpr float bias = 2e-3f;
+
+    rst::rasterizer r;
+    rst::vtx_buf_id vtx_id;
+    rst::ind_buf_id ind_id;
+    Eigen::Matrix4f light_view, light_projection, camera_to_light;
+};
+
+// phong_fragment_shader on a whole batch, every step being a loop over the fragments. With
+// shadows set, shadows[l] is the shadow map of lights[l], which then only lights the fragments
+// it sees.
+struct phong_batch_shader
+{
+    static constexpr unsigned varyings = rst::VARYINGS_VIEW_POS | rst::VARYINGS_NORMAL | rst::VARYINGS_COLOR;
+
+    light lights[2] = {{{20, 20, 20}, {100, 500, 500}}, {{-20, 20, 0}, {500, 500, 100}}};
+    const shadow_map *shadows = nullptr;
+
+    void operator()(fragment_batch &batch) const
+    {
+        const float ka = 0.005f;
+        const float ks = 0.7937f;
+
+        const float amb_light_intensity = 10;
+        const Eigen::Vector3f eye_dir = Eigen::Vector3f(0, 0, 10).normalized();
+
+        const float p = 150;
+
+        const int n = batch.count;
+        float n_dot_l[fragment_batch::capacity], n_dot_h[fragment_batch::capacity], rr[fragment_batch::capacity];
+        float specular[fragment_batch::capacity], lit[fragment_batch::capacity];
+
+        for (int k = 0; k < 3; k++)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                batch.out_color[k][i] = 0;
+            }
+        }
+
+        for (int l = 0; l < 2; l++)
+        {
+            const light &light = lights[l];
+            for (int i = 0; i < n; i++)
+            {
+                lit[i] = shadows ? shadows[l].visibility(batch.view_pos[0][i], batch.view_pos[1][i], batch.view_pos[2][i]) : 1;
+            }
+            for (int i = 0; i < n; i++)
+            {
+                float lx = light.position.x() - batch.view_pos[0][i];
+                float ly = light.position.y() - batch.view_pos[1][i];
+                float lz = light.position.z() - batch.view_pos[2][i];
+                rr[i] = lx * lx + ly * ly + lz * lz;
+                float l_len = std::sqrt(rr[i]);
+                lx /= l_len;
+                ly /= l_len;
+                lz /= l_len;
+
+                float hx = eye_dir.x() + lx, hy = eye_dir.y() + ly, hz = eye_dir.z() + lz;
+                float h_len = std::sqrt(hx * hx + hy * hy + hz * hz);
+
+                const float nx = batch.normal[0][i], ny = batch.normal[1][i], nz = batch.normal[2][i];
+                n_dot_l[i] = std::max(0.f, nx * lx + ny * ly + nz * lz);
+                n_dot_h[i] = (nx * hx + ny * hy + nz * hz) / h_len;
+            }
+            for (int i = 0; i < n; i++)
+            {
+                specular[i] = std::max(0.f, std::pow(n_dot_h[i], p));
+            }
+            for (int k = 0; k < 3; k++)
+            {
+                for (int i = 0; i < n; i++)
+                {
+                    float intensity = light.intensity[k] / rr[i] * lit[i];
+                    batch.out_color[k][i] += ka * amb_light_intensity + batch.color[k][i] * (intensity * n_dot_l[i]) + ks * (intensity * specular[i]);
+                }
+            }
+        }
+
+        for (int k = 0; k < 3; k++)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                batch.out_color[k][i] *= 255.f;
+            }
+        }
+    }
+};
+
+// texture_fragment_shader on a whole batch: the texture is sampled for every fragment in one
+// call, then lit by phong_batch_shader with the texture color in place of the vertex color
+struct texture_batch_shader
+{
+    // The vertex colors are replaced by the texture
+    static constexpr unsigned varyings = rst::VARYINGS_VIEW_POS | rst::VARYINGS_NORMAL | rst::VARYINGS_TEX_COORDS;
+
+    phong_batch_shader lighting{{{{20, 20, 20}, {500, 500, 500}}, {{-20, 20, 0}, {500, 500, 500}}}};
+
+    void operator()(fragment_batch &batch) const
+    {
+        const int n = batch.count;
+        if (!batch.texture)
+        {
+            for (int k = 0; k < 3; k++)
+            {
+                for (int i = 0; i < n; i++)
+                {
+                    batch.color[k][i] = 0;
+                }
+            }
+            lighting(batch);
+            return;
+        }
+
+        float v[fragment_batch::capacity];
+        for (int i = 0; i < n; i++)
+        {
+            v[i] = std::abs(batch.tex_coords[1][i]);
+        }
+        float *const rgb[3] = {batch.color[0], batch.color[1], batch.color[2]};
+        batch.texture->getColorsTrilinear(n, batch.tex_coords[0], v, batch.tex_coords_dx[0], batch.tex_coords_dx[1],
+                                          batch.tex_coords_dy[0], batch.tex_coords_dy[1], rgb);
+        for (int k = 0; k < 3; k++)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                batch.color[k][i] /= 255.f;
+            }
+        }
+        lighting(batch);
+    }
+};
+
+// Tilts the unit normal n by the height differences dU and dV, through the tangent frame
+// TBN = [t b n] built from n alone
+void perturb_normal(float &nx, float &ny, float &nz, float dU, float dV)
+{
+    float r = std::sqrt(nx * nx + nz * nz);
+    float tx = 1, ty = 0, tz = 0;
+    if (r > 0)
+    {
+        tx = nx * ny / r;
+        ty = r;
+        tz = nz * ny / r;
+    }
+    float bx = ny * tz - nz * ty, by = nz * tx - nx * tz, bz = nx * ty - ny * tx;
+
+    // TBN * (-dU, -dV, 1)
+    float x = nx - dU * tx - dV * bx, y = ny - dU * ty - dV * by, z = nz - dU * tz - dV * bz;
+    float length = std::sqrt(x * x + y * y + z * z);
+    nx = x / length;
+    ny = y / length;
+    nz = z / length;
+}
+
 Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload &payload)
 {
 
@@ -213,7 +451,6 @@ Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload &payl
 
     float kh = 0.2, kn = 0.1;
 
-    // TODO: Implement displacement mapping here
     // Let n = normal = (x, y, z)
     // Vector t = (x*y/sqrt(x*x+z*z),sqrt(x*x+z*z),z*y/sqrt(x*x+z*z))
     // Vector b = n cross product t
@@ -223,13 +460,29 @@ Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload &payl
     // Vector ln = (-dU, -dV, 1)
     // Position p = p + kn * n * h(u,v)
     // Normal n = normalize(TBN * ln)
+    if (payload.texture)
+    {
+        // h(u,v) and both differences come precomputed from the texture
+        Eigen::Vector3f hgt = payload.texture->getHeight(payload.tex_coords.x(), payload.tex_coords.y());
+        point += kn * normal * hgt.x();
+        perturb_normal(normal.x(), normal.y(), normal.z(), kh * kn * hgt.y(), kh * kn * hgt.z());
+    }
 
     Eigen::Vector3f result_color = {0, 0, 0};
 
     for (auto &light : lights)
     {
-        // TODO: For each light source in the code, calculate what the *ambient*, *diffuse*, and *specular*
-        // components are. Then, accumulate that result on the *result_color* object.
+        auto La = RGB_Mutiply(ka, amb_light_intensity);
+
+        // diffuse light
+        auto l = (light.position - point).normalized();
+        auto rr = (light.position - point).dot(light.position - point);
+
+        auto Ld = RGB_Mutiply(kd, (light.intensity / rr * std::max(0.f, normal.dot(l))));
+
+        auto h = (eye_pos.normalized() + l).normalized();
+        auto Ls = RGB_Mutiply(ks, light.intensity / rr * std::max(0.f, pow(normal.dot(h), p)));
+        result_color += La + Ld + Ls;
     }
 
     return result_color * 255.f;
@@ -237,27 +490,10 @@ Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload &payl
 
 Eigen::Vector3f bump_fragment_shader(const fragment_shader_payload &payload)
 {
-
-    Eigen::Vector3f ka = Eigen::Vector3f(0.005, 0.005, 0.005);
-    Eigen::Vector3f kd = payload.color;
-    Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
-
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
-
-    std::vector<light> lights = {l1, l2};
-    Eigen::Vector3f amb_light_intensity{10, 10, 10};
-    Eigen::Vector3f eye_pos{0, 0, 10};
-
-    float p = 150;
-
-    Eigen::Vector3f color = payload.color;
-    Eigen::Vector3f point = payload.view_pos;
     Eigen::Vector3f normal = payload.normal;
 
     float kh = 0.2, kn = 0.1;
 
-    // TODO: Implement bump mapping here
     // Let n = normal = (x, y, z)
     // Vector t = (x*y/sqrt(x*x+z*z),sqrt(x*x+z*z),z*y/sqrt(x*x+z*z))
     // Vector b = n cross product t
@@ -266,6 +502,11 @@ Eigen::Vector3f bump_fragment_shader(const fragment_shader_payload &payload)
     // dV = kh * kn * (h(u,v+1/h)-h(u,v))
     // Vector ln = (-dU, -dV, 1)
     // Normal n = normalize(TBN * ln)
+    if (payload.texture)
+    {
+        Eigen::Vector3f hgt = payload.texture->getHeight(payload.tex_coords.x(), payload.tex_coords.y());
+        perturb_normal(normal.x(), normal.y(), normal.z(), kh * kn * hgt.y(), kh * kn * hgt.z());
+    }
 
     Eigen::Vector3f result_color = {0, 0, 0};
     result_color = normal;
@@ -273,10 +514,202 @@ Eigen::Vector3f bump_fragment_shader(const fragment_shader_payload &payload)
     return result_color * 255.f;
 }
 
-int main(int argc, const char **argv)
+// bump_fragment_shader, or displacement_fragment_shader with displace set, on a whole batch. The
+// heights of every fragment come from one lookup call.
+struct bump_batch_shader
 {
-    std::vector<Triangle *> TriangleList;
+    bool displace = false;
+    phong_batch_shader lighting{{{{20, 20, 20}, {500, 500, 500}}, {{-20, 20, 0}, {500, 500, 500}}}};
 
+    void operator()(fragment_batch &batch) const
+    {
+        const float kh = 0.2f, kn = 0.1f;
+        const int n = batch.count;
+
+        if (batch.texture)
+        {
+            float h[fragment_batch::capacity], dh_du[fragment_batch::capacity], dh_dv[fragment_batch::capacity];
+            float *const hgt[3] = {h, dh_du, dh_dv};
+            batch.texture->getHeights(n, batch.tex_coords[0], batch.tex_coords[1], hgt);
+            if (displace)
+            {
+                for (int k = 0; k < 3; k++)
+                {
+                    for (int i = 0; i < n; i++)
+                    {
+                        batch.view_pos[k][i] += kn * batch.normal[k][i] * h[i];
+                    }
+                }
+            }
+            for (int i = 0; i < n; i++)
+            {
+                perturb_normal(batch.normal[0][i], batch.normal[1][i], batch.normal[2][i], kh * kn * dh_du[i], kh * kn * dh_dv[i]);
+            }
+        }
+
+        if (displace)
+        {
+            lighting(batch);
+            return;
+        }
+        for (int k = 0; k < 3; k++)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                batch.out_color[k][i] = batch.normal[k][i] * 255.f;
+            }
+        }
+    }
+};
+
+// Draws with the shader picked by name. Every branch instantiates the raster loop for its own
+// shader type, so the shader is inlined instead of being called through a std::function. The
+// shaders lighting the mesh use the shadow maps of their lights when shadows is set.
+void draw_with_shader(rst::rasterizer &r, rst::vtx_buf_id vtx_id, rst::ind_buf_id ind_id, const std::string &shader,
+                      const shadow_map *shadows = nullptr)
+{
+    if (shader == "texture")
+    {
+        texture_batch_shader texture_shader;
+        texture_shader.lighting.shadows = shadows;
+        r.draw(vtx_id, ind_id, rst::Primitive::Triangle, texture_shader);
+    }
+    else if (shader == "normal")
+        r.draw(vtx_id, ind_id, rst::Primitive::Triangle, per_fragment([](const fragment_shader_payload &payload)
+                                                                  { return normal_fragment_shader(payload); }));
+    else if (shader == "bump")
+        r.draw(vtx_id, ind_id, rst::Primitive::Triangle, bump_batch_shader{false});
+    else if (shader == "displacement")
+    {
+        bump_batch_shader displacement_shader{true};
+        displacement_shader.lighting.shadows = shadows;
+        r.draw(vtx_id, ind_id, rst::Primitive::Triangle, displacement_shader);
+    }
+    else
+    {
+        phong_batch_shader phong_shader;
+        phong_shader.shadows = shadows;
+        r.draw(vtx_id, ind_id, rst::Primitive::Triangle, phong_shader);
+    }
+}
+
+// Writes the frames of the batch mode on a thread of its own, so that encoding frame k overlaps
+// with rendering frame k + 1. The pixel buffers go back and forth between the two threads
+// instead of being allocated for every frame.
+class frame_writer
+{
+public:
+    frame_writer(int width, int height, std::string prefix)
+        : width(width), height(height), prefix(std::move(prefix)), worker([this]
+                                                                           { run(); })
+    {
+    }
+
+    // Writes the frames still queued
+    ~frame_writer()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            done = true;
+        }
+        changed.notify_all();
+        worker.join();
+    }
+
+    // Queues the BGR8 pixels as the next frame, <prefix>0000.png for the first one. They are
+    // swapped with a buffer the writer is done with rather than copied, so the rasterizer renders
+    // the next frame into that one. Waits while two frames are already queued, which bounds the
+    // memory and the lag of the writer.
+    void push(std::vector<uint8_t> &pixels)
+    {
+        std::vector<uint8_t> frame;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this]
+                         { return queued.size() < 2; });
+            if (!spare.empty())
+            {
+                frame = std::move(spare.back());
+                spare.pop_back();
+            }
+        }
+        frame.swap(pixels);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queued.push_back(std::move(frame));
+        }
+        changed.notify_all();
+    }
+
+private:
+    void run()
+    {
+        for (int index = 0;; index++)
+        {
+            std::vector<uint8_t> frame;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [this]
+                             { return !queued.empty() || done; });
+                if (queued.empty())
+                    return;
+                frame = std::move(queued.front());
+                queued.pop_front();
+            }
+            changed.notify_all();
+
+            char number[16];
+            std::snprintf(number, sizeof(number), "%04d.png", index);
+            cv::Mat image(height, width, CV_8UC3, frame.data());
+            cv::imwrite(prefix + number, image);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            spare.push_back(std::move(frame));
+        }
+    }
+
+    int width, height;
+    std::string prefix;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<std::vector<uint8_t>> queued;
+    std::vector<std::vector<uint8_t>> spare;
+    bool done = false;
+    std::thread worker;
+};
+
+// Renders frames images with render_frame(angle), the angles going from `from` towards `to` in
+// equal steps, `to` itself excluded so that a full turn loops. Prints the frame rate and the
+// percentiles of the time a frame takes to render and pack, the writing of the files left out.
+template <typename F>
+void render_batch(rst::rasterizer &r, int frames, float from, float to, const std::string &prefix, F &&render_frame)
+{
+    std::vector<double> latencies;
+    auto start = std::chrono::steady_clock::now();
+    {
+        frame_writer writer(700, 700, prefix);
+        for (int k = 0; k < frames; k++)
+        {
+            auto frame_start = std::chrono::steady_clock::now();
+            render_frame(from + (to - from) * k / frames);
+            std::vector<uint8_t> &pixels = r.output_buffer(rst::PixelFormat::BGR8);
+            latencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frame_start).count());
+            writer.push(pixels);
+        }
+    }
+    double total = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Nearest rank percentiles
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p)
+    { return latencies[std::max(0, (int)std::ceil(p * latencies.size()) - 1)]; };
+    std::printf("%d frames in %.2f s, %.1f frames/s\n", frames, total, frames / total);
+    std::printf("frame time: p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+                percentile(0.5), percentile(0.9), percentile(0.99), latencies.back());
+}
+
+int main(int argc, const char **argv)
+{
     float angle = 140.0;
     bool command_line = false;
 
@@ -284,83 +717,196 @@ int main(int argc, const char **argv)
     objl::Loader Loader;
     std::string obj_path = "./models/spot/";
 
-    // Load .obj File
+    // Load .obj File. The loader repeats a vertex for every face using it, merging the copies
+    // lets the rasterizer transform each vertex once.
+    // Interleaved as position, normal, color, texture coordinates
+    const rst::vertex_layout layout{11, 0, 3, 6, 9};
+    std::vector<float> vertices;
+    std::vector<Eigen::Vector3i> indices;
+    std::map<std::array<float, 8>, int> vertex_ids;
     bool loadout = Loader.LoadFile("./models/spot/spot_triangulated_good.obj");
     for (auto mesh : Loader.LoadedMeshes)
     {
         for (int i = 0; i < mesh.Vertices.size(); i += 3)
         {
-            Triangle *t = new Triangle();
+            Eigen::Vector3i triangle;
             for (int j = 0; j < 3; j++)
             {
-                t->setVertex(j, Vector4f(mesh.Vertices[i + j].Position.X, mesh.Vertices[i + j].Position.Y, mesh.Vertices[i + j].Position.Z, 1.0));
-                t->setNormal(j, Vector3f(mesh.Vertices[i + j].Normal.X, mesh.Vertices[i + j].Normal.Y, mesh.Vertices[i + j].Normal.Z));
-                t->setTexCoord(j, Vector2f(mesh.Vertices[i + j].TextureCoordinate.X, mesh.Vertices[i + j].TextureCoordinate.Y));
+                const auto &vert = mesh.Vertices[i + j];
+                std::array<float, 8> key = {vert.Position.X, vert.Position.Y, vert.Position.Z,
+                                            vert.Normal.X, vert.Normal.Y, vert.Normal.Z,
+                                            vert.TextureCoordinate.X, vert.TextureCoordinate.Y};
+                auto it = vertex_ids.find(key);
+                if (it == vertex_ids.end())
+                {
+                    it = vertex_ids.emplace(key, (int)(vertices.size() / layout.stride)).first;
+                    vertices.insert(vertices.end(), {vert.Position.X, vert.Position.Y, vert.Position.Z,
+                                                     vert.Normal.X, vert.Normal.Y, vert.Normal.Z,
+                                                     148, 121, 92,
+                                                     vert.TextureCoordinate.X, vert.TextureCoordinate.Y});
+                }
+                triangle[j] = it->second;
             }
-            TriangleList.push_back(t);
+            indices.push_back(triangle);
         }
     }
 
     rst::rasterizer r(700, 700);
 
+    // Copies: the shadow maps load the mesh too
+    auto vtx_id = r.load_vertices(vertices, layout);
+    auto ind_id = r.load_indices(indices);
+
+    // The spot model is closed, its back faces are always hidden
+    r.set_culling(rst::Culling::Back);
+
     auto texture_path = "hmap.jpg";
     r.set_texture(Texture(obj_path + texture_path));
 
-    std::function<Eigen::Vector3f(fragment_shader_payload)> active_shader = phong_fragment_shader;
+    std::string active_shader = "phong";
+    bool wireframe = false;
+    bool shadows = false;
+
+    // Batch mode: Rasterizer -b frames from to prefix [shader] [option] renders a turntable of
+    // frames images, the arguments after the prefix being those of the single image below
+    int batch_frames = 0;
+    float batch_from = 0, batch_to = 0;
+    if (argc >= 6 && std::string(argv[1]) == "-b")
+    {
+        batch_frames = std::stoi(argv[2]);
+        batch_from = std::stof(argv[3]);
+        batch_to = std::stof(argv[4]);
+        argc -= 4;
+        argv += 4;
+    }
 
     if (argc >= 2)
     {
         command_line = true;
         filename = std::string(argv[1]);
 
-        if (argc == 3 && std::string(argv[2]) == "texture")
+        if (argc >= 3 && std::string(argv[2]) == "texture")
         {
             std::cout << "Rasterizing using the texture shader\n";
-            active_shader = texture_fragment_shader;
+            active_shader = "texture";
             texture_path = "spot_texture.png";
             r.set_texture(Texture(obj_path + texture_path));
         }
-        else if (argc == 3 && std::string(argv[2]) == "normal")
+        else if (argc >= 3 && std::string(argv[2]) == "normal")
         {
             std::cout << "Rasterizing using the normal shader\n";
-            active_shader = normal_fragment_shader;
+            active_shader = "normal";
         }
-        else if (argc == 3 && std::string(argv[2]) == "phong")
+        else if (argc >= 3 && std::string(argv[2]) == "phong")
         {
             std::cout << "Rasterizing using the phong shader\n";
-            active_shader = phong_fragment_shader;
+            active_shader = "phong";
         }
-        else if (argc == 3 && std::string(argv[2]) == "bump")
+        else if (argc >= 3 && std::string(argv[2]) == "bump")
         {
             std::cout << "Rasterizing using the bump shader\n";
-            active_shader = bump_fragment_shader;
+            active_shader = "bump";
         }
-        else if (argc == 3 && std::string(argv[2]) == "displacement")
+        else if (argc >= 3 && std::string(argv[2]) == "displacement")
         {
             std::cout << "Rasterizing using the bump shader\n";
-            active_shader = displacement_fragment_shader;
+            active_shader = "displacement";
+        }
+
+        if (argc == 4 && std::string(argv[3]) == "prepass")
+        {
+            std::cout << "Shading after a depth pre-pass\n";
+            r.set_shading(rst::Shading::DepthPrepass);
+        }
+        else if (argc == 4 && std::string(argv[3]) == "deferred")
+        {
+            std::cout << "Shading from a G-buffer\n";
+            r.set_shading(rst::Shading::Deferred);
+        }
+        else if (argc == 4 && std::string(argv[3]) == "wireframe")
+        {
+            std::cout << "Drawing the anti-aliased wireframe over the mesh\n";
+            wireframe = true;
+            r.set_line_antialiasing(true);
+        }
+        else if (argc == 4 && std::string(argv[3]) == "transparent")
+        {
+            // The back faces show through the front ones
+            std::cout << "Blending the mesh at half opacity\n";
+            r.set_opacity(0.5f);
+            r.set_culling(rst::Culling::None);
+        }
+        else if (argc == 4 && std::string(argv[3]) == "shadows")
+        {
+            std::cout << "Shadowing the lights with shadow maps\n";
+            shadows = true;
         }
     }
 
     Eigen::Vector3f eye_pos = {0, 0, 10};
 
     r.set_vertex_shader(vertex_shader);
-    r.set_fragment_shader(active_shader);
+
+    // One shadow map per light of the shaders, framing the mesh however it turns around its
+    // origin, which the camera sees at -eye_pos
+    std::vector<shadow_map> shadow_maps;
+    if (shadows)
+    {
+        float radius = 0;
+        for (size_t i = 0; i < vertices.size(); i += layout.stride)
+        {
+            Eigen::Vector4f position(vertices[i], vertices[i + 1], vertices[i + 2], 1);
+            radius = std::max(radius, (get_model_matrix(0) * position).head<3>().norm());
+        }
+        shadow_maps.reserve(2);
+        for (const light &l : phong_batch_shader{}.lights)
+        {
+            shadow_maps.emplace_back(vertices, layout, indices, l.position, -eye_pos, radius);
+        }
+    }
+
+    // Renders the shadow maps for the model matrix, then the mesh with them
+    auto draw_mesh = [&](const Eigen::Matrix4f &model)
+    {
+        for (auto &map : shadow_maps)
+        {
+            map.render(model, get_view_matrix(eye_pos));
+        }
+        r.set_model(model);
+        draw_with_shader(r, vtx_id, ind_id, active_shader, shadow_maps.empty() ? nullptr : shadow_maps.data());
+    };
 
     int key = 0;
     int frame_count = 0;
 
+    if (batch_frames > 0)
+    {
+        r.set_view(get_view_matrix(eye_pos));
+        r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
+        render_batch(r, batch_frames, batch_from, batch_to, filename, [&](float frame_angle)
+                     {
+                         r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+                         draw_mesh(get_model_matrix(frame_angle));
+                         if (wireframe)
+                             r.draw(vtx_id, ind_id, rst::Primitive::Line); });
+        return 0;
+    }
+
     if (command_line)
     {
         r.clear(rst::Buffers::Color | rst::Buffers::Depth);
-        r.set_model(get_model_matrix(angle));
         r.set_view(get_view_matrix(eye_pos));
         r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
 
-        r.draw(TriangleList);
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
-        cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
+        draw_mesh(get_model_matrix(angle));
+        if (wireframe)
+            r.draw(vtx_id, ind_id, rst::Primitive::Line);
+        const auto &stats = r.last_draw_stats();
+        std::cout << "Fragments: " << stats.fragments << ", shaded: " << stats.shaded
+                  << ", overdraw shading avoided: " << stats.fragments - stats.shaded << "\n";
+        std::cout << "Triangles: " << stats.triangles << ", culled back-facing: " << stats.culled_facing
+                  << ", degenerate: " << stats.culled_degenerate << ", sub-pixel: " << stats.culled_sub_pixel << "\n";
+        cv::Mat image(700, 700, CV_8UC3, r.output_buffer(rst::PixelFormat::BGR8).data());
 
         cv::imwrite(filename, image);
 
@@ -371,15 +917,14 @@ int main(int argc, const char **argv)
     {
         r.clear(rst::Buffers::Color | rst::Buffers::Depth);
 
-        r.set_model(get_model_matrix(angle));
         r.set_view(get_view_matrix(eye_pos));
         r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
 
         // r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle);
-        r.draw(TriangleList);
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
-        cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
+        draw_mesh(get_model_matrix(angle));
+        if (wireframe)
+            r.draw(vtx_id, ind_id, rst::Primitive::Line);
+        cv::Mat image(700, 700, CV_8UC3, r.output_buffer(rst::PixelFormat::BGR8).data());
 
         cv::imshow("image", image);
         cv::imwrite(filename, image);
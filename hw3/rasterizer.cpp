@@ -3,55 +3,103 @@
 //
 
 #include <algorithm>
+#include <immintrin.h>
 #include "rasterizer.hpp"
 #include <opencv2/opencv.hpp>
 #include <math.h>
 
-rst::pos_buf_id rst::rasterizer::load_positions(const std::vector<Eigen::Vector3f> &positions)
+rst::pos_buf_id rst::rasterizer::load_positions(std::vector<Eigen::Vector3f> positions)
 {
-    auto id = get_next_id();
-    pos_buf.emplace(id, positions);
-
-    return {id};
+    return {pos_buf.add(std::move(positions))};
 }
 
-rst::ind_buf_id rst::rasterizer::load_indices(const std::vector<Eigen::Vector3i> &indices)
+rst::ind_buf_id rst::rasterizer::load_indices(std::vector<Eigen::Vector3i> indices)
 {
-    auto id = get_next_id();
-    ind_buf.emplace(id, indices);
+    // The edges of the wireframe, each edge shared by two triangles only once
+    std::vector<std::array<int, 2>> edges;
+    edges.reserve(3 * indices.size());
+    for (auto &i : indices)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            int a = i[k], b = i[(k + 1) % 3];
+            edges.push_back({std::min(a, b), std::max(a, b)});
+        }
+    }
+    std::sort(edges.begin(), edges.end());
+    edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+    edge_buf.add(std::move(edges));
+
+    return {ind_buf.add(std::move(indices))};
+}
 
-    return {id};
+rst::col_buf_id rst::rasterizer::load_colors(std::vector<Eigen::Vector3f> cols)
+{
+    return {col_buf.add(std::move(cols))};
 }
 
-rst::col_buf_id rst::rasterizer::load_colors(const std::vector<Eigen::Vector3f> &cols)
+rst::col_buf_id rst::rasterizer::load_normals(std::vector<Eigen::Vector3f> normals)
 {
-    auto id = get_next_id();
-    col_buf.emplace(id, cols);
+    normal_id = nor_buf.add(std::move(normals));
 
-    return {id};
+    return {normal_id};
 }
 
-rst::col_buf_id rst::rasterizer::load_normals(const std::vector<Eigen::Vector3f> &normals)
+rst::tex_buf_id rst::rasterizer::load_tex_coords(std::vector<Eigen::Vector2f> tex_coords)
 {
-    auto id = get_next_id();
-    nor_buf.emplace(id, normals);
+    tex_coords_id = tex_buf.add(std::move(tex_coords));
 
-    normal_id = id;
+    return {tex_coords_id};
+}
 
-    return {id};
+rst::vtx_buf_id rst::rasterizer::load_vertices(std::vector<float> vertices, const vertex_layout &layout)
+{
+    vtx_layouts.push_back(layout);
+    return {vtx_buf.add(std::move(vertices))};
 }
 
 // Bresenham's line drawing algorithm
-void rst::rasterizer::draw_line(Eigen::Vector3f begin, Eigen::Vector3f end)
+// The pixels of a line come in runs along its major axis, which are written as one span each.
+void rst::rasterizer::draw_line(Eigen::Vector3f begin, Eigen::Vector3f end, int row0, int row1)
 {
+    if (line_aa)
+    {
+        draw_line_aa(begin, end, row0, row1);
+        return;
+    }
+
     auto x1 = begin.x();
     auto y1 = begin.y();
     auto x2 = end.x();
     auto y2 = end.y();
 
-    Eigen::Vector3f line_color = {255, 255, 255};
+    const Eigen::Vector3f line_color = {255, 255, 255};
+    row0 = std::max(row0, 0);
+    row1 = std::min(row1, height);
+
+    // Pixels [xa, xb] of row y and [ya, yb] of column x. The clipped end points are inside the
+    // viewport, but Bresenham may overshoot them by a pixel.
+    auto fill_row = [&](int y, int xa, int xb)
+    {
+        xa = std::max(xa, 0);
+        xb = std::min(xb, width - 1);
+        if (y < row0 || y >= row1 || xa > xb)
+            return;
+        auto row = frame_buf.begin() + get_index(0, y);
+        std::fill(row + xa, row + xb + 1, line_color);
+    };
+    auto fill_column = [&](int x, int ya, int yb)
+    {
+        ya = std::max(ya, row0);
+        yb = std::min(yb, row1 - 1);
+        if (x < 0 || x >= width || ya > yb)
+            return;
+        Eigen::Vector3f *pixel = &frame_buf[get_index(x, ya)];
+        for (int y = ya; y <= yb; y++, pixel -= width)
+            *pixel = line_color;
+    };
 
-    int x, y, dx, dy, dx1, dy1, px, py, xe, ye, i;
+    int x, y, dx, dy, dx1, dy1, px, py, xe, ye;
 
     dx = x2 - x1;
     dy = y2 - y1;
@@ -59,6 +107,7 @@ void rst::rasterizer::draw_line(Eigen::Vector3f begin, Eigen::Vector3f end)
     dy1 = fabs(dy);
     px = 2 * dy1 - dx1;
     py = 2 * dx1 - dy1;
+    const int step = (dx < 0 && dy < 0) || (dx > 0 && dy > 0) ? 1 : -1;
 
     if (dy1 <= dx1)
     {
@@ -74,9 +123,8 @@ void rst::rasterizer::draw_line(Eigen::Vector3f begin, Eigen::Vector3f end)
             y = y2;
             xe = x1;
         }
-        Eigen::Vector2i point = Eigen::Vector2i(x, y);
-        set_pixel(point, line_color);
-        for (i = 0; x < xe; i++)
+        int span = x;
+        while (x < xe)
         {
             x = x + 1;
             if (px < 0)
@@ -85,20 +133,15 @@ void rst::rasterizer::draw_line(Eigen::Vector3f begin, Eigen::Vector3f end)
             }
             else
             {
-                if ((dx < 0 && dy < 0) || (dx > 0 && dy > 0))
-                {
-                    y = y + 1;
-                }
-                else
-                {
-                    y = y - 1;
-                }
+                fill_row(y, span, x - 1);
+                span = x;
+                y = y + step;
                 px = px + 2 * (dy1 - dx1);
+                if ((step > 0 && y >= row1) || (step < 0 && y < row0))
+                    return;
             }
-            //            delay(0);
-            Eigen::Vector2i point = Eigen::Vector2i(x, y);
-            set_pixel(point, line_color);
         }
+        fill_row(y, span, x);
     }
     else
     {
@@ -114,31 +157,76 @@ void rst::rasterizer::draw_line(Eigen::Vector3f begin, Eigen::Vector3f end)
             y = y2;
             ye = y1;
         }
-        Eigen::Vector2i point = Eigen::Vector2i(x, y);
-        set_pixel(point, line_color);
-        for (i = 0; y < ye; i++)
+        int span = y;
+        while (y < ye && y < row1)
         {
             y = y + 1;
-            if (py <= 0)
+            if (py > 0)
             {
-                py = py + 2 * dx1;
+                fill_column(x, span, y - 1);
+                span = y;
+                x = x + step;
+                py = py + 2 * (dx1 - dy1);
             }
             else
             {
-                if ((dx < 0 && dy < 0) || (dx > 0 && dy > 0))
-                {
-                    x = x + 1;
-                }
-                else
-                {
-                    x = x - 1;
-                }
-                py = py + 2 * (dx1 - dy1);
+                py = py + 2 * dx1;
             }
-            //            delay(0);
-            Eigen::Vector2i point = Eigen::Vector2i(x, y);
-            set_pixel(point, line_color);
         }
+        fill_column(x, span, y);
+    }
+}
+
+// Xiaolin Wu's line: along the major axis, every pixel column (or row) gets the two pixels
+// straddling the line, with coverages that add up to one, blended over the frame buffer
+void rst::rasterizer::draw_line_aa(Eigen::Vector3f begin, Eigen::Vector3f end, int row0, int row1)
+{
+    const Eigen::Vector3f line_color = {255, 255, 255};
+    row0 = std::max(row0, 0);
+    row1 = std::min(row1, height);
+
+    // Pixel centers are at half-integer coordinates
+    float x0 = begin.x() - 0.5f, y0 = begin.y() - 0.5f;
+    float x1 = end.x() - 0.5f, y1 = end.y() - 0.5f;
+    const bool steep = std::abs(y1 - y0) > std::abs(x1 - x0);
+    if (steep)
+    {
+        std::swap(x0, y0);
+        std::swap(x1, y1);
+    }
+    if (x0 > x1)
+    {
+        std::swap(x0, x1);
+        std::swap(y0, y1);
+    }
+    const float gradient = x1 > x0 ? (y1 - y0) / (x1 - x0) : 1.f;
+
+    auto plot = [&](int x, int y, float coverage)
+    {
+        if (steep)
+            std::swap(x, y);
+        if (x < 0 || x >= width || y < row0 || y >= row1)
+            return;
+        Eigen::Vector3f &pixel = frame_buf[get_index(x, y)];
+        pixel += coverage * (line_color - pixel);
+    };
+    auto fpart = [](float v)
+    { return v - std::floor(v); };
+
+    // The end points cover their pixel column by how much of it the line spans
+    const int xa = (int)std::round(x0), xb = (int)std::round(x1);
+    const float ya = y0 + gradient * (xa - x0), yb = y1 + gradient * (xb - x1);
+    const float gap_a = 1 - fpart(x0 + 0.5f), gap_b = fpart(x1 + 0.5f);
+    plot(xa, (int)std::floor(ya), (1 - fpart(ya)) * gap_a);
+    plot(xa, (int)std::floor(ya) + 1, fpart(ya) * gap_a);
+    plot(xb, (int)std::floor(yb), (1 - fpart(yb)) * gap_b);
+    plot(xb, (int)std::floor(yb) + 1, fpart(yb) * gap_b);
+
+    float y = ya + gradient;
+    for (int x = xa + 1; x < xb; x++, y += gradient)
+    {
+        plot(x, (int)std::floor(y), 1 - fpart(y));
+        plot(x, (int)std::floor(y) + 1, fpart(y));
     }
 }
 
@@ -147,167 +235,829 @@ auto to_vec4(const Eigen::Vector3f &v3, float w = 1.0f)
     return Vector4f(v3.x(), v3.y(), v3.z(), w);
 }
 
-static bool insideTriangle(int x, int y, const Vector4f *_v)
+// Sign of w in front of the eye, which looks down -z in view space. The projection matrices of
+// the assignments keep w = z, the usual one has w = -z.
+static float visible_w_sign(const Eigen::Matrix4f &projection)
 {
-    Vector3f v[3];
-    for (int i = 0; i < 3; i++)
-        v[i] = {_v[i].x(), _v[i].y(), 1.0};
-    Vector3f f0, f1, f2;
-    f0 = v[1].cross(v[0]);
-    f1 = v[2].cross(v[1]);
-    f2 = v[0].cross(v[2]);
-    Vector3f p(x, y, 1.);
-    if ((p.dot(f0) * f0.dot(v[2]) > 0) && (p.dot(f1) * f1.dot(v[0]) > 0) && (p.dot(f2) * f2.dot(v[1]) > 0))
-        return true;
-    return false;
+    return projection(3, 2) > 0 ? -1.f : 1.f;
 }
 
-static std::tuple<float, float, float> computeBarycentric2D(float x, float y, const Vector4f *v)
+// Vertices closer to the eye plane than this are clipped. The projection matrices do not map the
+// near plane to a fixed depth, so the rasterizer clips at a small distance in w instead; what
+// matters is that no vertex reaches w = 0 or gets behind the eye.
+static constexpr float NEAR_W = 1e-5f;
+
+// Signed distance of a vertex to the clip plane of bit, positive inside
+static float clip_distance(const Eigen::Vector4f &v, float w_sign, int bit)
 {
-    float c1 = (x * (v[1].y() - v[2].y()) + (v[2].x() - v[1].x()) * y + v[1].x() * v[2].y() - v[2].x() * v[1].y()) / (v[0].x() * (v[1].y() - v[2].y()) + (v[2].x() - v[1].x()) * v[0].y() + v[1].x() * v[2].y() - v[2].x() * v[1].y());
-    float c2 = (x * (v[2].y() - v[0].y()) + (v[0].x() - v[2].x()) * y + v[2].x() * v[0].y() - v[0].x() * v[2].y()) / (v[1].x() * (v[2].y() - v[0].y()) + (v[0].x() - v[2].x()) * v[1].y() + v[2].x() * v[0].y() - v[0].x() * v[2].y());
-    float c3 = (x * (v[0].y() - v[1].y()) + (v[1].x() - v[0].x()) * y + v[0].x() * v[1].y() - v[1].x() * v[0].y()) / (v[2].x() * (v[0].y() - v[1].y()) + (v[1].x() - v[0].x()) * v[2].y() + v[0].x() * v[1].y() - v[1].x() * v[0].y());
-    return {c1, c2, c3};
+    float w = w_sign * v.w();
+    switch (bit)
+    {
+    case rst::CLIP_NEAR:
+        return w - NEAR_W;
+    case rst::CLIP_GUARD_LEFT:
+        return rst::GUARD_BAND * w + v.x();
+    case rst::CLIP_GUARD_RIGHT:
+        return rst::GUARD_BAND * w - v.x();
+    case rst::CLIP_GUARD_BOTTOM:
+        return rst::GUARD_BAND * w + v.y();
+    case rst::CLIP_GUARD_TOP:
+        return rst::GUARD_BAND * w - v.y();
+    case rst::CLIP_LEFT:
+        return w + v.x();
+    case rst::CLIP_RIGHT:
+        return w - v.x();
+    case rst::CLIP_BOTTOM:
+        return w + v.y();
+    default:
+        return w - v.y();
+    }
 }
 
-void rst::rasterizer::draw(std::vector<Triangle *> &TriangleList)
+static int clip_outcode(const Eigen::Vector4f &v, float w_sign)
 {
+    int code = 0;
+    for (int bit = rst::CLIP_NEAR; bit <= rst::CLIP_TOP; bit <<= 1)
+    {
+        if (clip_distance(v, w_sign, bit) < 0)
+            code |= bit;
+    }
+    return code;
+}
+
+// Keeps the part of the segment ab inside the near plane and the guard band, returns false when
+// nothing is left
+static bool clip_line(Eigen::Vector4f &a, Eigen::Vector4f &b, float w_sign)
+{
+    float t0 = 0, t1 = 1;
+    for (int bit = rst::CLIP_NEAR; bit <= rst::CLIP_GUARD_TOP; bit <<= 1)
+    {
+        float da = clip_distance(a, w_sign, bit), db = clip_distance(b, w_sign, bit);
+        if (da < 0 && db < 0)
+            return false;
+        if (da < 0)
+            t0 = std::max(t0, da / (da - db));
+        else if (db < 0)
+            t1 = std::min(t1, da / (da - db));
+    }
+    if (t0 > t1)
+        return false;
+    Eigen::Vector4f d = b - a;
+    b = a + t1 * d;
+    a = a + t0 * d;
+    return true;
+}
+
+// Cohen-Sutherland: keeps the part of the screen space segment ab inside [0, x_max] x [0, y_max],
+// returns false when nothing is left
+static bool clip_to_viewport(Eigen::Vector3f &a, Eigen::Vector3f &b, float x_max, float y_max)
+{
+    enum
+    {
+        LEFT = 1,
+        RIGHT = 2,
+        BOTTOM = 4,
+        TOP = 8
+    };
+    auto outcode = [&](const Eigen::Vector3f &p)
+    {
+        return (p.x() < 0 ? LEFT : p.x() > x_max ? RIGHT : 0) | (p.y() < 0 ? BOTTOM : p.y() > y_max ? TOP : 0);
+    };
+    int code_a = outcode(a), code_b = outcode(b);
+    while (code_a | code_b)
+    {
+        if (code_a & code_b)
+            return false;
+
+        // Move an outside end point to the edge of the first half-plane it is outside of
+        Eigen::Vector3f &p = code_a ? a : b;
+        const int code = code_a ? code_a : code_b;
+        const Eigen::Vector3f d = b - a;
+        if (code & (LEFT | RIGHT))
+        {
+            float x = code & LEFT ? 0 : x_max;
+            p = a + (x - a.x()) / d.x() * d;
+            p.x() = x;
+        }
+        else
+        {
+            float y = code & BOTTOM ? 0 : y_max;
+            p = a + (y - a.y()) / d.y() * d;
+            p.y() = y;
+        }
+        (code_a ? code_a : code_b) = outcode(p);
+    }
+    return true;
+}
 
+// Homogeneous division and viewport transformation
+static Eigen::Vector3f to_screen(const Eigen::Vector4f &clip, int width, int height)
+{
     float f1 = (50 - 0.1) / 2.0;
     float f2 = (50 + 0.1) / 2.0;
 
-    Eigen::Matrix4f mvp = projection * view * model;
-    for (const auto &t : TriangleList)
+    float x = clip.x() / clip.w(), y = clip.y() / clip.w(), z = clip.z() / clip.w();
+    return Eigen::Vector3f(0.5 * width * (x + 1.0), 0.5 * height * (y + 1.0), z * f1 + f2);
+}
+
+// Everything the vertex stage needs from the matrices, computed once per draw
+struct vertex_transform
+{
+    Eigen::Matrix4f mv, mvp, inv_trans;
+    float w_sign;
+    int width, height;
+
+    vertex_transform(const Eigen::Matrix4f &model, const Eigen::Matrix4f &view, const Eigen::Matrix4f &projection, int w, int h)
+        : width(w), height(h)
     {
-        Triangle newtri = *t;
+        mv = view * model;
+        mvp = projection * view * model;
+        inv_trans = (view * model).inverse().transpose();
+        w_sign = visible_w_sign(projection);
+    }
 
-        std::array<Eigen::Vector4f, 3> mm{
-            (view * model * t->v[0]),
-            (view * model * t->v[1]),
-            (view * model * t->v[2])};
+    rst::post_vertex operator()(const Eigen::Vector4f &position, const Eigen::Vector3f &normal,
+                                const Eigen::Vector3f &color, const Eigen::Vector2f &tex_coords) const
+    {
+        rst::post_vertex out;
+        out.clip = mvp * position;
+        out.outcode = clip_outcode(out.clip, w_sign);
+        out.screen = to_screen(out.clip, width, height);
+        Eigen::Map<Eigen::Vector3f>(out.varyings + rst::VARYING_VIEW_POS) = (mv * position).head<3>();
+        Eigen::Map<Eigen::Vector3f>(out.varyings + rst::VARYING_NORMAL) = (inv_trans * to_vec4(normal, 0.0f)).head<3>();
+        Eigen::Map<Eigen::Vector3f>(out.varyings + rst::VARYING_COLOR) = color;
+        Eigen::Map<Eigen::Vector2f>(out.varyings + rst::VARYING_TEX_COORDS) = tex_coords;
+        return out;
+    }
+};
 
-        std::array<Eigen::Vector3f, 3> viewspace_pos;
+void rst::rasterizer::process_vertices(int n_vert, const std::vector<Eigen::Vector3i> &ind, const std::function<post_vertex(int)> &vertex)
+{
+    const int n_thrd = std::max(1u, std::thread::hardware_concurrency());
+    const int n_tri = ind.size();
+    post_vertices.resize(n_vert);
+    screen_tris.resize(n_tri);
 
-        std::transform(mm.begin(), mm.end(), viewspace_pos.begin(), [](auto &v)
-                       { return v.template head<3>(); });
+    auto vertex_worker = [&](int t)
+    {
+        const int chunk = (n_vert + n_thrd - 1) / n_thrd;
+        for (int i = t * chunk; i < std::min(n_vert, (t + 1) * chunk); i++)
+        {
+            post_vertices[i] = vertex(i);
+        }
+    };
+    run_workers(n_thrd, vertex_worker);
 
-        Eigen::Vector4f v[] = {
-            mvp * t->v[0],
-            mvp * t->v[1],
-            mvp * t->v[2]};
-        // Homogeneous division
-        for (auto &vec : v)
+    for (int i = 0; i < n_tri; i++)
+    {
+        for (int k = 0; k < 3; k++)
         {
-            vec.x() /= vec.w();
-            vec.y() /= vec.w();
-            vec.z() /= vec.w();
+            screen_tris[i].v[k] = ind[i][k];
         }
+    }
+}
+
+void rst::rasterizer::process_vertices(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer)
+{
+    const auto &pos = pos_buf[pos_buffer.pos_id];
+    const auto &col = col_buf[col_buffer.col_id];
+    const std::vector<Eigen::Vector3f> *nor = normal_id >= 0 ? &nor_buf[normal_id] : nullptr;
+    const std::vector<Eigen::Vector2f> *tex = tex_coords_id >= 0 ? &tex_buf[tex_coords_id] : nullptr;
+
+    const vertex_transform transform(model, view, projection, width, height);
+    process_vertices(pos.size(), ind_buf[ind_buffer.ind_id], [&](int i)
+                     { return transform(to_vec4(pos[i], 1.0f),
+                                        nor ? (*nor)[i] : Eigen::Vector3f::Zero(),
+                                        Eigen::Vector3f(col[i].x() / 255., col[i].y() / 255., col[i].z() / 255.),
+                                        tex ? (*tex)[i] : Eigen::Vector2f::Zero()); });
+}
 
-        Eigen::Matrix4f inv_trans = (view * model).inverse().transpose();
-        Eigen::Vector4f n[] = {
-            inv_trans * to_vec4(t->normal[0], 0.0f),
-            inv_trans * to_vec4(t->normal[1], 0.0f),
-            inv_trans * to_vec4(t->normal[2], 0.0f)};
+void rst::rasterizer::process_vertices(vtx_buf_id vtx_buffer, ind_buf_id ind_buffer)
+{
+    const std::vector<float> &vtx = vtx_buf[vtx_buffer.vtx_id];
+    const vertex_layout layout = vtx_layouts[vtx_buffer.vtx_id];
+
+    const vertex_transform transform(model, view, projection, width, height);
+    process_vertices(vtx.size() / layout.stride, ind_buf[ind_buffer.ind_id], [&](int i)
+                     {
+                         const float *v = vtx.data() + i * layout.stride;
+                         auto attribute3 = [v](int offset)
+                         { return offset >= 0 ? Eigen::Vector3f(v[offset], v[offset + 1], v[offset + 2]) : Eigen::Vector3f::Zero(); };
+                         Eigen::Vector3f color = attribute3(layout.color);
+                         return transform(Eigen::Vector4f(v[layout.position], v[layout.position + 1], v[layout.position + 2], 1.0f),
+                                          attribute3(layout.normal),
+                                          Eigen::Vector3f(color.x() / 255., color.y() / 255., color.z() / 255.),
+                                          layout.tex_coords >= 0 ? Eigen::Vector2f(v[layout.tex_coords], v[layout.tex_coords + 1]) : Eigen::Vector2f::Zero()); });
+}
+
+void rst::rasterizer::process_vertices(std::vector<Triangle *> &TriangleList)
+{
+    const vertex_transform transform(model, view, projection, width, height);
+    const int n_thrd = std::max(1u, std::thread::hardware_concurrency());
+    const int n_tri = TriangleList.size();
+    post_vertices.resize(3 * n_tri);
+    screen_tris.resize(n_tri);
 
-        // Viewport transformation
-        for (auto &vert : v)
+    // Nothing tells which vertices the triangles share, so each one gets its own three
+    const Eigen::Vector3f color(148 / 255., 121 / 255., 92 / 255.);
+    auto vertex_worker = [&](int t)
+    {
+        const int chunk = (n_tri + n_thrd - 1) / n_thrd;
+        for (int i = t * chunk; i < std::min(n_tri, (t + 1) * chunk); i++)
         {
-            vert.x() = 0.5 * width * (vert.x() + 1.0);
-            vert.y() = 0.5 * height * (vert.y() + 1.0);
-            vert.z() = vert.z() * f1 + f2;
+            const Triangle &tri = *TriangleList[i];
+            for (int k = 0; k < 3; k++)
+            {
+                post_vertices[3 * i + k] = transform(tri.v[k], tri.normal[k], color, tri.tex_coords[k]);
+                screen_tris[i].v[k] = 3 * i + k;
+            }
+        }
+    };
+    run_workers(n_thrd, vertex_worker);
+}
+
+void rst::rasterizer::clip_triangles()
+{
+    // Triangles are rarely clipped or culled, so a first pass looks for one before anything is
+    // copied
+    auto needs_work = [this](const screen_triangle &st)
+    {
+        int c0 = post_vertices[st.v[0]].outcode, c1 = post_vertices[st.v[1]].outcode, c2 = post_vertices[st.v[2]].outcode;
+        return (c0 & c1 & c2) != 0 || ((c0 | c1 | c2) & CLIP_PLANES) != 0;
+    };
+    if (std::none_of(screen_tris.begin(), screen_tris.end(), needs_work))
+        return;
+
+    const float w_sign = visible_w_sign(projection);
+    std::vector<screen_triangle> clipped;
+    clipped.reserve(screen_tris.size());
+    std::vector<int> polygon, next;
+    for (const screen_triangle &st : screen_tris)
+    {
+        int c0 = post_vertices[st.v[0]].outcode, c1 = post_vertices[st.v[1]].outcode, c2 = post_vertices[st.v[2]].outcode;
+        if ((c0 & c1 & c2) != 0)
+            continue;
+        if (((c0 | c1 | c2) & CLIP_PLANES) == 0)
+        {
+            clipped.push_back(st);
+            continue;
         }
 
-        for (int i = 0; i < 3; ++i)
+        // Sutherland-Hodgman, one plane after the other. Clip space is linear in the vertex
+        // positions, so the attributes of the new vertices interpolate linearly too.
+        polygon.assign(st.v, st.v + 3);
+        for (int bit = CLIP_NEAR; bit <= CLIP_GUARD_TOP && polygon.size() >= 3; bit <<= 1)
         {
-            // screen space coordinates
-            newtri.setVertex(i, v[i]);
+            if (((c0 | c1 | c2) & bit) == 0)
+                continue;
+            next.clear();
+            for (size_t k = 0; k < polygon.size(); k++)
+            {
+                int a = polygon[k], b = polygon[(k + 1) % polygon.size()];
+                float da = clip_distance(post_vertices[a].clip, w_sign, bit);
+                float db = clip_distance(post_vertices[b].clip, w_sign, bit);
+                if (da >= 0)
+                    next.push_back(a);
+                if ((da >= 0) != (db >= 0))
+                {
+                    const float t = da / (da - db);
+                    const post_vertex &pa = post_vertices[a], &pb = post_vertices[b];
+                    post_vertex p;
+                    p.clip = pa.clip + t * (pb.clip - pa.clip);
+                    p.outcode = clip_outcode(p.clip, w_sign);
+                    p.screen = to_screen(p.clip, width, height);
+                    for (int k = 0; k < VARYING_COUNT; k++)
+                    {
+                        p.varyings[k] = pa.varyings[k] + t * (pb.varyings[k] - pa.varyings[k]);
+                    }
+                    next.push_back(post_vertices.size());
+                    post_vertices.push_back(p);
+                }
+            }
+            polygon.swap(next);
         }
 
-        for (int i = 0; i < 3; ++i)
+        for (size_t k = 2; k < polygon.size(); k++)
         {
-            // view space normal
-            newtri.setNormal(i, n[i].head<3>());
+            screen_triangle fan;
+            fan.v[0] = polygon[0];
+            fan.v[1] = polygon[k - 1];
+            fan.v[2] = polygon[k];
+            clipped.push_back(fan);
         }
+    }
+    screen_tris.swap(clipped);
+}
 
-        newtri.setColor(0, 148, 121.0, 92.0);
-        newtri.setColor(1, 148, 121.0, 92.0);
-        newtri.setColor(2, 148, 121.0, 92.0);
+int rst::rasterizer::bin_triangles()
+{
+    const int n_thrd = std::max(1u, std::thread::hardware_concurrency());
+    const int n_tile_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    const int n_tile = n_tile_x * ((height + TILE_SIZE - 1) / TILE_SIZE);
+    const int n_tri = screen_tris.size();
 
-        // Also pass view space vertice position
-        rasterize_triangle(newtri, viewspace_pos);
+    // Every worker sets up a contiguous run of triangles and bins them into the tiles their
+    // bounding boxes overlap. The bins are per worker, so binning takes no lock, and reading them
+    // worker by worker keeps the submission order inside every tile.
+    tile_bins.resize(n_thrd);
+    for (auto &bins : tile_bins)
+    {
+        bins.resize(n_tile);
+        for (auto &bin : bins)
+        {
+            bin.clear();
+        }
     }
+
+    std::atomic<long> triangles{0}, culled_facing{0}, culled_degenerate{0}, culled_sub_pixel{0};
+    const int chunk = (n_tri + n_thrd - 1) / n_thrd;
+    auto geometry_worker = [&](int t)
+    {
+        auto &bins = tile_bins[t];
+        long n_drawn = 0, n_facing = 0, n_degenerate = 0, n_sub_pixel = 0;
+        for (int i = t * chunk; i < std::min(n_tri, (t + 1) * chunk); i++)
+        {
+            screen_triangle &st = screen_tris[i];
+            const post_vertex *p[] = {&post_vertices[st.v[0]], &post_vertices[st.v[1]], &post_vertices[st.v[2]]};
+            const Eigen::Vector3f &v0 = p[0]->screen, &v1 = p[1]->screen, &v2 = p[2]->screen;
+
+            // AABB bounding box
+            const float x_min = std::min({v0.x(), v1.x(), v2.x()}), x_max = std::max({v0.x(), v1.x(), v2.x()});
+            const float y_min = std::min({v0.y(), v1.y(), v2.y()}), y_max = std::max({v0.y(), v1.y(), v2.y()});
+            st.x_min = x_min; // 取整
+            st.x_max = x_max;
+            st.y_min = y_min;
+            st.y_max = y_max;
+            st.z_min = std::min({v0.z(), v1.z(), v2.z()});
+            st.z_max = std::max({v0.z(), v1.z(), v2.z()});
+            if (st.x_max < 0 || st.y_max < 0 || st.x_min >= width || st.y_min >= height)
+            {
+                continue;
+            }
+
+            // Culling. The signed area is positive for counter-clockwise triangles, and the
+            // pixels are sampled at integer coordinates, so a bounding box with no integer
+            // between its bounds on one axis holds no sample.
+            const float dx1 = v1.x() - v0.x(), dy1 = v1.y() - v0.y();
+            const float dx2 = v2.x() - v0.x(), dy2 = v2.y() - v0.y();
+            const float area = dx1 * dy2 - dx2 * dy1;
+            if (!(std::abs(area) > 0))
+            {
+                n_degenerate++;
+                continue;
+            }
+            if ((culling == Culling::Back && area < 0) || (culling == Culling::Front && area > 0))
+            {
+                n_facing++;
+                continue;
+            }
+            if (std::ceil(x_min) > x_max || std::ceil(y_min) > y_max)
+            {
+                n_sub_pixel++;
+                continue;
+            }
+            n_drawn++;
+
+            // Planes of the varyings, relative to vertex 0 so that their values near the
+            // triangle do not come out of the difference of large numbers
+            auto set_plane = [&](float plane[3], float f0, float f1, float f2)
+            {
+                plane[0] = f0;
+                plane[1] = ((f1 - f0) * dy2 - (f2 - f0) * dy1) / area;
+                plane[2] = ((f2 - f0) * dx1 - (f1 - f0) * dx2) / area;
+            };
+            const float inv_w[] = {1 / p[0]->clip.w(), 1 / p[1]->clip.w(), 1 / p[2]->clip.w()};
+            st.x0 = v0.x();
+            st.y0 = v0.y();
+            set_plane(st.inv_w, inv_w[0], inv_w[1], inv_w[2]);
+            for (int k = 0; k < VARYING_COUNT; k++)
+            {
+                set_plane(st.varyings[k], p[0]->varyings[k] * inv_w[0], p[1]->varyings[k] * inv_w[1], p[2]->varyings[k] * inv_w[2]);
+            }
+
+            int tx0 = std::max(st.x_min, 0) / TILE_SIZE, tx1 = std::min(st.x_max, width - 1) / TILE_SIZE;
+            int ty0 = std::max(st.y_min, 0) / TILE_SIZE, ty1 = std::min(st.y_max, height - 1) / TILE_SIZE;
+            for (int ty = ty0; ty <= ty1; ty++)
+            {
+                for (int tx = tx0; tx <= tx1; tx++)
+                {
+                    bins[ty * n_tile_x + tx].push_back(i);
+                }
+            }
+        }
+        triangles += n_drawn;
+        culled_facing += n_facing;
+        culled_degenerate += n_degenerate;
+        culled_sub_pixel += n_sub_pixel;
+    };
+    run_workers(n_thrd, geometry_worker);
+
+    stats.triangles = triangles;
+    stats.culled_facing = culled_facing;
+    stats.culled_degenerate = culled_degenerate;
+    stats.culled_sub_pixel = culled_sub_pixel;
+    return n_thrd;
 }
-static Eigen::Vector3f interpolate(float alpha, float beta, float gamma, const Eigen::Vector3f &vert1, const Eigen::Vector3f &vert2, const Eigen::Vector3f &vert3, float weight)
+
+void rst::rasterizer::draw_edges(ind_buf_id ind_buffer)
 {
-    return (alpha * vert1 + beta * vert2 + gamma * vert3) / weight;
+    const auto &edges = edge_buf[ind_buffer.ind_id];
+    const int n_edge = edges.size();
+    const int n_thrd = std::max(1u, std::thread::hardware_concurrency());
+    const int band_height = (height + n_thrd - 1) / n_thrd;
+    const float w_sign = visible_w_sign(projection);
+
+    screen_lines.resize(n_thrd);
+    band_bins.resize(n_thrd);
+
+    // Every worker clips a contiguous range of edges and bins them into the bands they cross
+    auto geometry_worker = [&](int t)
+    {
+        auto &lines = screen_lines[t];
+        auto &bins = band_bins[t];
+        lines.clear();
+        bins.resize(n_thrd);
+        for (auto &bin : bins)
+        {
+            bin.clear();
+        }
+
+        const int chunk = (n_edge + n_thrd - 1) / n_thrd;
+        for (int i = t * chunk; i < std::min(n_edge, (t + 1) * chunk); i++)
+        {
+            const post_vertex &a = post_vertices[edges[i][0]], &b = post_vertices[edges[i][1]];
+            if ((a.outcode & b.outcode) != 0)
+            {
+                continue;
+            }
+            Eigen::Vector3f sa = a.screen, sb = b.screen;
+            if (((a.outcode | b.outcode) & CLIP_PLANES) != 0)
+            {
+                Eigen::Vector4f ca = a.clip, cb = b.clip;
+                if (!clip_line(ca, cb, w_sign))
+                    continue;
+                sa = to_screen(ca, width, height);
+                sb = to_screen(cb, width, height);
+            }
+            if (!clip_to_viewport(sa, sb, width - 1, height - 1))
+            {
+                continue;
+            }
+
+            // The rows of the end points, and one more on each side where Bresenham can overshoot
+            int b0 = std::max(0, (int)std::min(sa.y(), sb.y()) - 1) / band_height;
+            int b1 = std::min(height - 1, (int)std::max(sa.y(), sb.y()) + 1) / band_height;
+            for (int band = b0; band <= b1; band++)
+            {
+                bins[band].push_back(lines.size());
+            }
+            lines.push_back({sa, sb});
+        }
+    };
+    run_workers(n_thrd, geometry_worker);
+
+    // Every worker draws the rows of its band, so no pixel is written by two of them
+    auto raster_worker = [&](int band)
+    {
+        const int y0 = band * band_height, y1 = std::min(height, y0 + band_height);
+        for (int t = 0; t < n_thrd; t++)
+        {
+            for (int i : band_bins[t][band])
+            {
+                draw_line(screen_lines[t][i][0], screen_lines[t][i][1], y0, y1);
+            }
+        }
+    };
+    run_workers(n_thrd, raster_worker);
 }
 
-static Eigen::Vector2f interpolate(float alpha, float beta, float gamma, const Eigen::Vector2f &vert1, const Eigen::Vector2f &vert2, const Eigen::Vector2f &vert3, float weight)
+void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type)
 {
-    auto u = (alpha * vert1[0] + beta * vert2[0] + gamma * vert3[0]);
-    auto v = (alpha * vert1[1] + beta * vert2[1] + gamma * vert3[1]);
+    draw(pos_buffer, ind_buffer, col_buffer, type, per_fragment([this](const fragment_shader_payload &payload)
+                                                                { return fragment_shader(payload); }));
+}
 
-    u /= weight;
-    v /= weight;
+void rst::rasterizer::draw(vtx_buf_id vtx_buffer, ind_buf_id ind_buffer, Primitive type)
+{
+    draw(vtx_buffer, ind_buffer, type, per_fragment([this](const fragment_shader_payload &payload)
+                                                    { return fragment_shader(payload); }));
+}
 
-    return Eigen::Vector2f(u, v);
+void rst::rasterizer::draw(std::vector<Triangle *> &TriangleList)
+{
+    draw(TriangleList, per_fragment([this](const fragment_shader_payload &payload)
+                                    { return fragment_shader(payload); }));
 }
+
 // Screen space rasterization
-void rst::rasterizer::rasterize_triangle(const Triangle &t, const std::array<Eigen::Vector3f, 3> &view_pos)
+int rst::rasterizer::rasterize_triangle(const screen_triangle &st, int x0, int y0, int x1, int y1, Pass pass, tile_fragments &frags)
 {
-    auto v = t.toVector4();
+    frags.count = 0;
+
+    // In the shading pass of the pre-pass mode the visible fragments are those at the stored depth
+    const bool equal_passes = pass == Pass::Shade;
+    const int n_block_x = (width + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    const int tile = (y0 / TILE_SIZE) * ((width + TILE_SIZE - 1) / TILE_SIZE) + x0 / TILE_SIZE;
 
-    bool rst = insideTriangle(350, 200, t.v);
+    // The depth bounds below are widened by z_eps so that the rounding of the per-pixel depths
+    // can never put a fragment outside of them
+    const float z_eps = 1e-4f;
 
-    // AABB bounding box
-    int x1{INT_FAST16_MAX}, x2{-INT_FAST16_MAX}, y1{INT_FAST16_MAX}, y2{-INT_FAST16_MAX}; // 取整
+    // Coarse rejection of a triangle entirely behind what the tile already holds
+    if (equal_passes ? st.z_min - z_eps > hiz_tile_max[tile] : st.z_min - z_eps >= hiz_tile_max[tile])
+        return 0;
 
+    const Eigen::Vector3f v[] = {post_vertices[st.v[0]].screen, post_vertices[st.v[1]].screen, post_vertices[st.v[2]].screen};
+
+    // Edge functions e[i](x, y) = a[i] * (x - ox[i]) + b[i] * (y - oy[i]) of the edge opposite to
+    // vertex i, positive inside whatever the winding. The two triangles sharing an edge compute
+    // it from the same end point with the same operations and only differ in its sign, so their
+    // values at a sample are exact opposites. Samples on the edge itself go to the triangle for
+    // which it is a top or left edge, so no sample along a shared edge is missed or drawn twice.
+    const float dx1 = v[1].x() - v[0].x(), dy1 = v[1].y() - v[0].y();
+    const float dx2 = v[2].x() - v[0].x(), dy2 = v[2].y() - v[0].y();
+    const float area = dx1 * dy2 - dx2 * dy1;
+    if (!(std::abs(area) > 0))
+        return 0;
+    float a[3], b[3], ox[3], oy[3], margin[3];
+    bool top_left[3];
     for (int i = 0; i < 3; i++)
     {
-        if (t.v[i].x() < x1)
-            x1 = t.v[i].x();
-        if (t.v[i].x() > x2)
-            x2 = t.v[i].x();
-        if (t.v[i].y() < y1)
-            y1 = t.v[i].y();
-        if (t.v[i].y() > y2)
-            y2 = t.v[i].y();
+        const Eigen::Vector3f *p = &v[(i + 1) % 3], *q = &v[(i + 2) % 3];
+        float sign = area > 0 ? 1.f : -1.f;
+        if (q->x() < p->x() || (q->x() == p->x() && q->y() < p->y()))
+        {
+            std::swap(p, q);
+            sign = -sign;
+        }
+        a[i] = sign * (p->y() - q->y());
+        b[i] = sign * (q->x() - p->x());
+        ox[i] = p->x();
+        oy[i] = p->y();
+        top_left[i] = a[i] > 0 || (a[i] == 0 && b[i] < 0);
+        // A thousandth of a pixel, far above the rounding of e[i] on screen
+        margin[i] = 1e-3f * (std::abs(a[i]) + std::abs(b[i]));
     }
-    // iterate through the pixel and find if the current pixel is inside the triangle
-    for (int x = x1; x <= x2; x++)
+
+    // Screen space depth is an affine function of x and y too
+    const float az = ((v[1].z() - v[0].z()) * dy2 - (v[2].z() - v[0].z()) * dy1) / area;
+    const float bz = ((v[2].z() - v[0].z()) * dx1 - (v[1].z() - v[0].z()) * dx2) / area;
+    const float cz = v[0].z() - az * v[0].x() - bz * v[0].y();
+
+    // bounding box clipped to the tile
+    int xs = std::max(st.x_min, x0), xe = std::min(st.x_max, x1 - 1);
+    int ys = std::max(st.y_min, y0), ye = std::min(st.y_max, y1 - 1);
+
+    const __m128 lane = _mm_setr_ps(0, 1, 2, 3);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 a0 = _mm_set1_ps(a[0]), a1 = _mm_set1_ps(a[1]), a2 = _mm_set1_ps(a[2]);
+    const __m128 ox0 = _mm_set1_ps(ox[0]), ox1 = _mm_set1_ps(ox[1]), ox2 = _mm_set1_ps(ox[2]);
+    const __m128 az4 = _mm_set1_ps(az);
+    auto inside = [&](int i, __m128 e)
     {
-        for (int y = y1; y <= y2; y++)
+        return top_left[i] ? _mm_cmpge_ps(e, zero) : _mm_cmpgt_ps(e, zero);
+    };
+    const __m128 x_lo = _mm_set1_ps(xs), x_hi = _mm_set1_ps(xe);
+
+    int count = 0;
+    bool tile_written = false;
+    for (int by = ys - (ys - y0) % BLOCK_SIZE; by <= ye; by += BLOCK_SIZE)
+    {
+        for (int bx = xs - (xs - x0) % BLOCK_SIZE; bx <= xe; bx += BLOCK_SIZE)
         {
-            if (insideTriangle(x, y, t.v))
+            // Trivial reject when one edge function is negative everywhere in the block,
+            // trivial accept when all three are positive everywhere, both by a margin so that
+            // the samples near the edges always get the exact test. Both extremes of a linear
+            // function over the block are at corners picked by the signs of its gradient.
+            bool reject = false, accept = true;
+            for (int i = 0; i < 3; i++)
             {
+                float x_max = a[i] > 0 ? bx + BLOCK_SIZE - 1 : bx, x_min = a[i] > 0 ? bx : bx + BLOCK_SIZE - 1;
+                float y_max = b[i] > 0 ? by + BLOCK_SIZE - 1 : by, y_min = b[i] > 0 ? by : by + BLOCK_SIZE - 1;
+                reject |= a[i] * (x_max - ox[i]) + b[i] * (y_max - oy[i]) < -margin[i];
+                accept &= a[i] * (x_min - ox[i]) + b[i] * (y_min - oy[i]) > margin[i];
+            }
+            if (reject)
+                continue;
 
-                auto [alpha, beta, gamma] = computeBarycentric2D(x, y, t.v);
+            // Depth range of the triangle over the block, from the depth plane at the block
+            // corners and the vertex depths, against the range already in the block: skip the
+            // block when it is hidden and the per-pixel depth test when it is certainly in front.
+            const int block = (by / BLOCK_SIZE) * n_block_x + bx / BLOCK_SIZE;
+            float zx_near = az > 0 ? bx : bx + BLOCK_SIZE - 1, zy_near = bz > 0 ? by : by + BLOCK_SIZE - 1;
+            float zx_far = az > 0 ? bx + BLOCK_SIZE - 1 : bx, zy_far = bz > 0 ? by + BLOCK_SIZE - 1 : by;
+            float block_z_min = std::max(st.z_min, az * zx_near + bz * zy_near + cz) - z_eps;
+            float block_z_max = std::min(st.z_max, az * zx_far + bz * zy_far + cz) + z_eps;
+            if (equal_passes ? block_z_min > hiz_max[block] : block_z_min >= hiz_max[block])
+                continue;
+            const bool depth_accept = !equal_passes && block_z_max < hiz_min[block];
 
-                float w_reciprocal = 1.0 / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());                            // Z
-                float z_interpolated = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w(); // zp
-                z_interpolated *= w_reciprocal;
-                auto ind = (height - 1 - y) * width + x;
+            bool block_written = false;
+            float block_written_min = std::numeric_limits<float>::infinity();
+            for (int y = std::max(by, ys); y <= std::min(by + BLOCK_SIZE - 1, ye); y++)
+            {
+                const __m128 row0 = _mm_set1_ps(b[0] * (y - oy[0]));
+                const __m128 row1 = _mm_set1_ps(b[1] * (y - oy[1]));
+                const __m128 row2 = _mm_set1_ps(b[2] * (y - oy[2]));
+                const __m128 row_z = _mm_set1_ps(bz * y + cz);
+                const int row = (height - 1 - y) * width;
 
-                if (depth_buf[ind] > z_interpolated)
+                for (int qx = bx; qx < bx + BLOCK_SIZE && qx <= xe; qx += 4)
                 {
+                    __m128 px = _mm_add_ps(_mm_set1_ps(qx), lane);
+                    __m128 mask = _mm_and_ps(_mm_cmpge_ps(px, x_lo), _mm_cmple_ps(px, x_hi));
+                    if (!accept)
+                    {
+                        __m128 e0 = _mm_add_ps(_mm_mul_ps(a0, _mm_sub_ps(px, ox0)), row0);
+                        __m128 e1 = _mm_add_ps(_mm_mul_ps(a1, _mm_sub_ps(px, ox1)), row1);
+                        __m128 e2 = _mm_add_ps(_mm_mul_ps(a2, _mm_sub_ps(px, ox2)), row2);
+                        mask = _mm_and_ps(mask, _mm_and_ps(inside(0, e0), _mm_and_ps(inside(1, e1), inside(2, e2))));
+                    }
+                    if (_mm_movemask_ps(mask) == 0)
+                        continue;
 
-                    auto interpolated_shadingcoords = interpolate(alpha, beta, gamma, view_pos[0], view_pos[1], view_pos[2], 1);
-                    auto interpolated_color = interpolate(alpha, beta, gamma, t.color[0], t.color[1], t.color[2], 1);
-                    auto interpolated_normal = interpolate(alpha, beta, gamma, t.normal[0], t.normal[1], t.normal[2], 1);
-                    auto interpolated_texcoords = interpolate(alpha, beta, gamma, t.tex_coords[0], t.tex_coords[1], t.tex_coords[2], 1);
+                    __m128 z_interpolated = _mm_add_ps(_mm_mul_ps(az4, px), row_z);
 
-                    fragment_shader_payload payload(interpolated_color, interpolated_normal.normalized(), interpolated_texcoords, texture ? (&*texture) : nullptr);
-                    payload.view_pos = interpolated_shadingcoords;
-                    auto pixel_color = fragment_shader(payload);
+                    if (!depth_accept)
+                    {
+                        // The last quad of a row may hang over the right border of the screen
+                        alignas(16) float depth[4];
+                        for (int l = 0; l < 4; l++)
+                            depth[l] = qx + l < width ? depth_buf[row + qx + l] : 0;
+                        __m128 stored = _mm_load_ps(depth);
+                        mask = _mm_and_ps(mask, equal_passes ? _mm_cmpeq_ps(z_interpolated, stored) : _mm_cmplt_ps(z_interpolated, stored));
+                    }
+                    int bits = _mm_movemask_ps(mask);
+                    if (bits == 0)
+                        continue;
 
-                    depth_buf[ind] = z_interpolated;
-                    set_pixel(Vector2i(x, y), pixel_color);
+                    alignas(16) float z[4];
+                    _mm_store_ps(z, z_interpolated);
+                    for (int l = 0; l < 4; l++)
+                    {
+                        if (!(bits & (1 << l)))
+                            continue;
+
+                        int x = qx + l;
+                        count++;
+                        if (pass != Pass::Shade && pass != Pass::Transparent)
+                        {
+                            depth_buf[row + x] = z[l];
+                            block_written = true;
+                            block_written_min = std::min(block_written_min, z[l]);
+                        }
+                        if (pass == Pass::DepthOnly)
+                            continue;
+
+                        int f = frags.count++;
+                        frags.x[f] = x;
+                        frags.y[f] = y;
+                    }
                 }
             }
+
+            if (block_written)
+            {
+                update_hiz_block(block, block_written_min);
+                tile_written = true;
+            }
+        }
+    }
+
+    if (tile_written)
+    {
+        update_hiz_tile(tile);
+    }
+    return count;
+}
+
+void rst::rasterizer::interpolate_fragments(const screen_triangle &st, const tile_fragments &frags, int start, unsigned varyings, fragment_batch &batch)
+{
+    const int n = batch.count;
+    float dx[fragment_batch::capacity], dy[fragment_batch::capacity], w[fragment_batch::capacity];
+    for (int i = 0; i < n; i++)
+    {
+        dx[i] = frags.x[start + i] - st.x0;
+        dy[i] = frags.y[start + i] - st.y0;
+        w[i] = 1 / (st.inv_w[0] + st.inv_w[1] * dx[i] + st.inv_w[2] * dy[i]);
+    }
+
+    batch.texture = texture ? (&*texture) : nullptr;
+    float *const out[VARYING_COUNT] = {batch.view_pos[0], batch.view_pos[1], batch.view_pos[2],
+                                       batch.normal[0], batch.normal[1], batch.normal[2],
+                                       batch.color[0], batch.color[1], batch.color[2],
+                                       batch.tex_coords[0], batch.tex_coords[1]};
+    for (int k = 0; k < VARYING_COUNT; k++)
+    {
+        if (!(varyings & (1u << k)))
+            continue;
+        const float *plane = st.varyings[k];
+        for (int i = 0; i < n; i++)
+        {
+            out[k][i] = (plane[0] + plane[1] * dx[i] + plane[2] * dy[i]) * w[i];
+        }
+    }
+
+    // Derivatives of u = f / g, the ratio of two planes: du/dx = (df/dx - u * dg/dx) / g
+    if (varyings & VARYINGS_TEX_COORDS)
+    {
+        for (int k = 0; k < 2; k++)
+        {
+            const float *plane = st.varyings[VARYING_TEX_COORDS + k];
+            for (int i = 0; i < n; i++)
+            {
+                batch.tex_coords_dx[k][i] = (plane[1] - batch.tex_coords[k][i] * st.inv_w[1]) * w[i];
+                batch.tex_coords_dy[k][i] = (plane[2] - batch.tex_coords[k][i] * st.inv_w[2]) * w[i];
+            }
+        }
+    }
+    if (varyings & VARYINGS_NORMAL)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            float n2 = batch.normal[0][i] * batch.normal[0][i] + batch.normal[1][i] * batch.normal[1][i] + batch.normal[2][i] * batch.normal[2][i];
+            float length = n2 > 0 ? std::sqrt(n2) : 1.f;
+            batch.normal[0][i] /= length;
+            batch.normal[1][i] /= length;
+            batch.normal[2][i] /= length;
+        }
+    }
+}
+
+void rst::rasterizer::write_gbuffer(const screen_triangle &st, const tile_fragments &frags, fragment_batch &batch)
+{
+    for (int start = 0; start < frags.count; start += fragment_batch::capacity)
+    {
+        batch.count = std::min(frags.count - start, fragment_batch::capacity);
+        interpolate_fragments(st, frags, start, VARYINGS_ALL, batch);
+        for (int i = 0; i < batch.count; i++)
+        {
+            int ind = (height - 1 - frags.y[start + i]) * width + frags.x[start + i];
+            gbuf_view_pos[ind] = Eigen::Vector3f(batch.view_pos[0][i], batch.view_pos[1][i], batch.view_pos[2][i]);
+            gbuf_color[ind] = Eigen::Vector3f(batch.color[0][i], batch.color[1][i], batch.color[2][i]);
+            gbuf_normal[ind] = Eigen::Vector3f(batch.normal[0][i], batch.normal[1][i], batch.normal[2][i]);
+            gbuf_tex_coords[ind] = Eigen::Vector2f(batch.tex_coords[0][i], batch.tex_coords[1][i]);
+            gbuf_tex_coords_d[ind] = Eigen::Vector4f(batch.tex_coords_dx[0][i], batch.tex_coords_dx[1][i],
+                                                     batch.tex_coords_dy[0][i], batch.tex_coords_dy[1][i]);
+            gbuf_written[ind] = 1;
+        }
+    }
+}
+
+void rst::rasterizer::composite_tile(int x0, int y0, int x1, int y1, const tile_blend &blend)
+{
+    for (int y = y0; y < y1; y++)
+    {
+        const int row = (height - 1 - y) * width;
+        for (int x = x0; x < x1; x++)
+        {
+            const int p = (y - y0) * TILE_SIZE + x - x0;
+            const float reveal = blend.reveal[p];
+            if (reveal == 1)
+                continue;
+            // Weighted average of the colors, covering the opaque color by the total opacity
+            const Eigen::Vector4f &accum = blend.accum[p];
+            const Eigen::Vector3f average = accum.head<3>() / std::max(accum.w(), 1e-5f);
+            frame_buf[row + x] = average * (1 - reveal) + frame_buf[row + x] * reveal;
         }
     }
 }
 
+void rst::rasterizer::update_hiz_block(int block, float written_min)
+{
+    // Depths only decrease, so the nearest depth follows the writes while the farthest one has
+    // to be found again among the pixels of the block
+    const int n_block_x = (width + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    const int x0 = (block % n_block_x) * BLOCK_SIZE, y0 = (block / n_block_x) * BLOCK_SIZE;
+    float z_max = -std::numeric_limits<float>::infinity();
+    for (int y = y0; y < std::min(y0 + BLOCK_SIZE, height); y++)
+    {
+        const int row = (height - 1 - y) * width;
+        for (int x = x0; x < std::min(x0 + BLOCK_SIZE, width); x++)
+        {
+            z_max = std::max(z_max, depth_buf[row + x]);
+        }
+    }
+    hiz_min[block] = std::min(hiz_min[block], written_min);
+    hiz_max[block] = z_max;
+}
+
+void rst::rasterizer::update_hiz_tile(int tile)
+{
+    const int n_tile_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    const int n_block_x = (width + BLOCK_SIZE - 1) / BLOCK_SIZE, n_block_y = (height + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    const int bx0 = (tile % n_tile_x) * (TILE_SIZE / BLOCK_SIZE), by0 = (tile / n_tile_x) * (TILE_SIZE / BLOCK_SIZE);
+    float z_max = -std::numeric_limits<float>::infinity();
+    for (int by = by0; by < std::min(by0 + TILE_SIZE / BLOCK_SIZE, n_block_y); by++)
+    {
+        for (int bx = bx0; bx < std::min(bx0 + TILE_SIZE / BLOCK_SIZE, n_block_x); bx++)
+        {
+            z_max = std::max(z_max, hiz_max[by * n_block_x + bx]);
+        }
+    }
+    hiz_tile_max[tile] = z_max;
+}
+
 void rst::rasterizer::set_model(const Eigen::Matrix4f &m)
 {
     model = m;
@@ -332,6 +1082,9 @@ void rst::rasterizer::clear(rst::Buffers buff)
     if ((buff & rst::Buffers::Depth) == rst::Buffers::Depth)
     {
         std::fill(depth_buf.begin(), depth_buf.end(), std::numeric_limits<float>::infinity());
+        std::fill(hiz_min.begin(), hiz_min.end(), std::numeric_limits<float>::infinity());
+        std::fill(hiz_max.begin(), hiz_max.end(), std::numeric_limits<float>::infinity());
+        std::fill(hiz_tile_max.begin(), hiz_tile_max.end(), std::numeric_limits<float>::infinity());
     }
 }
 
@@ -339,19 +1092,69 @@ rst::rasterizer::rasterizer(int w, int h) : width(w), height(h)
 {
     frame_buf.resize(w * h);
     depth_buf.resize(w * h);
+    hiz_min.resize(((w + BLOCK_SIZE - 1) / BLOCK_SIZE) * ((h + BLOCK_SIZE - 1) / BLOCK_SIZE));
+    hiz_max.resize(hiz_min.size());
+    hiz_tile_max.resize(((w + TILE_SIZE - 1) / TILE_SIZE) * ((h + TILE_SIZE - 1) / TILE_SIZE));
 
     texture = std::nullopt;
 }
 
+std::vector<uint8_t> &rst::rasterizer::output_buffer(PixelFormat format)
+{
+    // One pass over the frame buffer does the conversion to bytes and the channel order
+    const int channels = format == PixelFormat::RGBA8 ? 4 : 3;
+    output_buf.resize(width * height * channels);
+    const float *in = frame_buf.data()->data();
+    uint8_t *out = output_buf.data();
+    auto to_byte = [](float v)
+    { return (uint8_t)std::lrint(std::min(255.f, std::max(0.f, v))); };
+
+    const int n_thrd = std::max(1u, std::thread::hardware_concurrency());
+    const int n_pixel = width * height;
+    auto pack_worker = [&](int t)
+    {
+        const int chunk = (n_pixel + n_thrd - 1) / n_thrd;
+        const int end = std::min(n_pixel, (t + 1) * chunk);
+        if (format == PixelFormat::RGBA8)
+        {
+            for (int i = t * chunk; i < end; i++)
+            {
+                out[4 * i] = to_byte(in[3 * i]);
+                out[4 * i + 1] = to_byte(in[3 * i + 1]);
+                out[4 * i + 2] = to_byte(in[3 * i + 2]);
+                out[4 * i + 3] = 255;
+            }
+        }
+        else
+        {
+            for (int i = t * chunk; i < end; i++)
+            {
+                out[3 * i] = to_byte(in[3 * i + 2]);
+                out[3 * i + 1] = to_byte(in[3 * i + 1]);
+                out[3 * i + 2] = to_byte(in[3 * i]);
+            }
+        }
+    };
+    run_workers(n_thrd, pack_worker);
+    return output_buf;
+}
+
+Eigen::Vector3f rst::rasterizer::screen_position(const Eigen::Vector4f &clip) const
+{
+    return to_screen(clip, width, height);
+}
+
 int rst::rasterizer::get_index(int x, int y)
 {
-    return (height - y) * width + x;
+    return (height - 1 - y) * width + x;
 }
 
 void rst::rasterizer::set_pixel(const Vector2i &point, const Eigen::Vector3f &color)
 {
     // old index: auto ind = point.y() + point.x() * width;
-    int ind = (height - point.y()) * width + point.x();
+    if (point.x() < 0 || point.x() >= width || point.y() < 0 || point.y() >= height)
+        return;
+    int ind = (height - 1 - point.y()) * width + point.x();
     frame_buf[ind] = color;
 }
 
@@ -7,6 +7,13 @@
 #include <eigen3/Eigen/Eigen>
 #include <optional>
 #include <algorithm>
+#include <cstdint>
+#include <array>
+#include <atomic>
+#include <future>
+#include <memory>
+#include <thread>
+#include <type_traits>
 #include "global.hpp"
 #include "Shader.hpp"
 #include "Triangle.hpp"
@@ -37,6 +44,87 @@ namespace rst
         Triangle
     };
 
+    // Byte layouts of output_buffer(). BGR8 is the layout of a CV_8UC3 cv::Mat, RGBA8 the one of
+    // most image files and textures.
+    enum class PixelFormat
+    {
+        BGR8,
+        RGBA8
+    };
+
+    // How draw() runs the fragment shader
+    enum class Shading
+    {
+        Forward,      // on every fragment passing the depth test when it is drawn
+        DepthPrepass, // fill the depth buffer first, then shade the visible fragments only
+        Deferred,     // write the shader inputs to a G-buffer, then shade every visible pixel once
+        DepthOnly     // fill the depth buffer and never run the shader, for shadow maps
+    };
+
+    // Which triangles draw() skips by their winding on screen. Front faces are counter-clockwise
+    // with y up, like OpenGL.
+    enum class Culling
+    {
+        None,
+        Back,
+        Front
+    };
+
+    // Counters of the last draw(). fragments passed the depth test when they were drawn, which is
+    // how many times forward shading runs the shader; shaded is how many times it actually ran.
+    // The triangles left after clipping whose bounding box meets the screen are either drawn
+    // (triangles) or culled for the first of these reasons: zero area, facing away, or no sample
+    // point inside their bounding box.
+    struct draw_stats
+    {
+        long fragments = 0;
+        long shaded = 0;
+        long triangles = 0;
+        long culled_degenerate = 0;
+        long culled_facing = 0;
+        long culled_sub_pixel = 0;
+    };
+
+    // Square screen tiles of the raster stage. A tile is only ever touched by the worker that took
+    // it, so the depth test and the framebuffer writes need no synchronisation.
+    constexpr int TILE_SIZE = 32;
+
+    // The triangles are walked in square pixel blocks, every row of a block being two SSE quads.
+    // The blocks are also the finest level of the hierarchical Z.
+    constexpr int BLOCK_SIZE = 8;
+
+    // Fragments of one triangle inside one tile
+    struct tile_fragments
+    {
+        int count = 0;
+        int x[TILE_SIZE * TILE_SIZE], y[TILE_SIZE * TILE_SIZE];
+    };
+
+    // Weighted blended transparency sums of the pixels of one tile, by (y - y0) * TILE_SIZE +
+    // (x - x0): the colors times their weight and the weights in accum, the product of the
+    // transparencies in reveal
+    struct tile_blend
+    {
+        Eigen::Vector4f accum[TILE_SIZE * TILE_SIZE];
+        float reveal[TILE_SIZE * TILE_SIZE];
+    };
+
+    // Runs worker(0) .. worker(n_thrd - 1) on their own threads and waits for all of them
+    template <typename F>
+    void run_workers(int n_thrd, F&& worker)
+    {
+        std::vector<std::future<void>> futures;
+        futures.reserve(n_thrd);
+        for (int t = 0; t < n_thrd; t++)
+        {
+            futures.emplace_back(std::async(std::launch::async, worker, t));
+        }
+        for (auto& f : futures)
+        {
+            f.get();
+        }
+    }
+
     /*
      * For the curious : The draw function takes two buffer id's as its arguments. These two structs
      * make sure that if you mix up with their orders, the compiler won't compile it.
@@ -57,14 +145,139 @@ namespace rst
         int col_id = 0;
     };
 
+    struct tex_buf_id
+    {
+        int tex_id = 0;
+    };
+
+    struct vtx_buf_id
+    {
+        int vtx_id = 0;
+    };
+
+    // Where the attributes are in an interleaved vertex buffer: every vertex takes stride floats,
+    // and each attribute starts at its offset in floats, or is -1 when the vertices do not have
+    // it. Colors are in [0, 255] like load_colors().
+    struct vertex_layout
+    {
+        int stride = 3;
+        int position = 0;
+        int normal = -1;
+        int color = -1;
+        int tex_coords = -1;
+    };
+
+    // Buffers of one type, each in its own contiguous vector. A handle is the index of the slot of
+    // its buffer, so a draw finds its buffers without a search, and a vector passed as an rvalue is
+    // moved in rather than copied.
+    template <typename T>
+    class buffer_pool
+    {
+    public:
+        int add(std::vector<T> data)
+        {
+            slots.push_back(std::move(data));
+            return (int)slots.size() - 1;
+        }
+
+        const std::vector<T>& operator[](int id) const { return slots[id]; }
+
+    private:
+        std::vector<std::vector<T>> slots;
+    };
+
+
+    // Slots of the varyings, the vertex attributes interpolated over the triangles. They are
+    // packed in one float array, so clipping and interpolation handle them all in the same loop
+    // and a new attribute only needs its slots here and its value from the vertex stage.
+    enum varying_slot
+    {
+        VARYING_VIEW_POS = 0,
+        VARYING_NORMAL = 3, // view space
+        VARYING_COLOR = 6,
+        VARYING_TEX_COORDS = 9,
+        VARYING_COUNT = 11
+    };
+
+    // Sets of varyings, one bit per slot. A batch shader declares the ones it reads with a
+    // static constexpr unsigned member varyings; the others are not interpolated for it.
+    enum varying_mask : unsigned
+    {
+        VARYINGS_VIEW_POS = 7u << VARYING_VIEW_POS,
+        VARYINGS_NORMAL = 7u << VARYING_NORMAL,
+        VARYINGS_COLOR = 7u << VARYING_COLOR,
+        VARYINGS_TEX_COORDS = 3u << VARYING_TEX_COORDS,
+        VARYINGS_ALL = (1u << VARYING_COUNT) - 1
+    };
+
+    // Varyings read by a batch shader, all of them unless it declares otherwise
+    template <typename Shader, typename = void>
+    struct shader_varyings
+    {
+        static constexpr unsigned value = VARYINGS_ALL;
+    };
+
+    template <typename Shader>
+    struct shader_varyings<Shader, std::void_t<decltype(Shader::varyings)>>
+    {
+        static constexpr unsigned value = Shader::varyings;
+    };
+
+    // A vertex out of the vertex stage, shared by every triangle using it
+    struct post_vertex
+    {
+        Eigen::Vector4f clip;   // before the perspective division
+        int outcode;            // clip_bits the vertex is outside of
+        Eigen::Vector3f screen; // pixel coordinates and depth
+        float varyings[VARYING_COUNT];
+    };
+
+    // Half-spaces of clip space a vertex can be outside of. Triangles crossing the near plane or
+    // the guard band, GUARD_BAND times the size of the viewport around it, are clipped; the
+    // viewport edges only serve to cull the triangles entirely outside one of them.
+    enum clip_bits
+    {
+        CLIP_NEAR = 1 << 0,
+        CLIP_GUARD_LEFT = 1 << 1,
+        CLIP_GUARD_RIGHT = 1 << 2,
+        CLIP_GUARD_BOTTOM = 1 << 3,
+        CLIP_GUARD_TOP = 1 << 4,
+        CLIP_LEFT = 1 << 5,
+        CLIP_RIGHT = 1 << 6,
+        CLIP_BOTTOM = 1 << 7,
+        CLIP_TOP = 1 << 8,
+        CLIP_PLANES = CLIP_NEAR | CLIP_GUARD_LEFT | CLIP_GUARD_RIGHT | CLIP_GUARD_BOTTOM | CLIP_GUARD_TOP
+    };
+    constexpr float GUARD_BAND = 4;
+
+    // A triangle after the geometry stage: its vertices in the post-transform cache and the
+    // pixel range its bounding box covers
+    struct screen_triangle
+    {
+        int v[3];
+        int x_min, x_max, y_min, y_max;
+        float z_min, z_max;
+
+        // 1 / w and every varying divided by w are affine in screen space, and their ratio is
+        // the perspective-correct varying. Each plane is its value at vertex 0, at (x0, y0),
+        // followed by its steps along x and y.
+        float x0, y0;
+        float inv_w[3];
+        float varyings[VARYING_COUNT][3];
+    };
+
     class rasterizer
     {
     public:
         rasterizer(int w, int h);
-        pos_buf_id load_positions(const std::vector<Eigen::Vector3f>& positions);
-        ind_buf_id load_indices(const std::vector<Eigen::Vector3i>& indices);
-        col_buf_id load_colors(const std::vector<Eigen::Vector3f>& colors);
-        col_buf_id load_normals(const std::vector<Eigen::Vector3f>& normals);
+        pos_buf_id load_positions(std::vector<Eigen::Vector3f> positions);
+        ind_buf_id load_indices(std::vector<Eigen::Vector3i> indices);
+        col_buf_id load_colors(std::vector<Eigen::Vector3f> colors);
+        col_buf_id load_normals(std::vector<Eigen::Vector3f> normals);
+        tex_buf_id load_tex_coords(std::vector<Eigen::Vector2f> tex_coords);
+
+        // All the attributes of the vertices in one buffer, see vertex_layout
+        vtx_buf_id load_vertices(std::vector<float> vertices, const vertex_layout& layout);
 
         void set_model(const Eigen::Matrix4f& m);
         void set_view(const Eigen::Matrix4f& v);
@@ -79,15 +292,114 @@ namespace rst
 
         void clear(Buffers buff);
 
+        // Primitive::Line draws the edges of the triangles, each edge shared by two of them once,
+        // over what is in the frame buffer
         void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type);
+        void draw(vtx_buf_id vtx_buffer, ind_buf_id ind_buffer, Primitive type);
         void draw(std::vector<Triangle *> &TriangleList);
 
+        // Same as the draws above with a batch shader (see fragment_batch) instead of the
+        // fragment shader set above. The raster loop is compiled for the shader type, so the
+        // shader inlines into it.
+        template <typename Shader>
+        void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type, Shader shader);
+        template <typename Shader>
+        void draw(vtx_buf_id vtx_buffer, ind_buf_id ind_buffer, Primitive type, Shader shader);
+        template <typename Shader>
+        void draw(std::vector<Triangle *> &TriangleList, Shader shader);
+
+        void set_shading(Shading s) { shading = s; }
+        void set_culling(Culling c) { culling = c; }
+
+        // Opacity of the triangles of the next draws. Below 1 they are blended with weighted
+        // blended order-independent transparency (McGuire and Bavoil): shaded forward whatever the
+        // shading mode, depth tested against what is already drawn without writing the depth, and
+        // composited over the frame buffer tile by tile, so the order of the triangles does not
+        // matter.
+        void set_opacity(float a) { opacity = a; }
+
+        // Draw lines with Wu's anti-aliasing instead of Bresenham's algorithm
+        void set_line_antialiasing(bool on) { line_aa = on; }
+        const draw_stats& last_draw_stats() const { return stats; }
+
         std::vector<Eigen::Vector3f>& frame_buffer() { return frame_buf; }
 
+        // The depth buffer is laid out like the frame buffer. screen_position() takes a point in
+        // clip space to the pixel coordinates and depth the raster stage compares, so that a
+        // shadow map lookup matches the depths the map was rendered with.
+        const std::vector<float>& depth_buffer() const { return depth_buf; }
+        Eigen::Vector3f screen_position(const Eigen::Vector4f& clip) const;
+
+        // The frame buffer with 8 bits per channel, clamped to [0, 255] and rounded, in format. The
+        // bytes stay valid until the next call, so a cv::Mat can wrap them without a copy.
+        std::vector<uint8_t>& output_buffer(PixelFormat format = PixelFormat::BGR8);
+
     private:
-        void draw_line(Eigen::Vector3f begin, Eigen::Vector3f end);
+        enum class Pass
+        {
+            Full,        // depth test, shade, write depth and color
+            DepthOnly,   // depth test, write depth
+            Shade,       // shade where the depth buffer holds exactly this fragment
+            GBuffer,     // depth test, write depth and the shader inputs
+            Transparent  // depth test, shade, add the color to the blend sums of the tile
+        };
+
+        // Draw the pixels of the line in the rows [row0, row1). The end points must be inside
+        // the viewport.
+        void draw_line(Eigen::Vector3f begin, Eigen::Vector3f end, int row0, int row1);
+        void draw_line_aa(Eigen::Vector3f begin, Eigen::Vector3f end, int row0, int row1);
+
+        // Draws the edges of the index buffer between the vertices of the vertex stage. The edges
+        // are clipped and binned to one horizontal band of the screen per worker in parallel, then
+        // every worker draws the lines of its band.
+        void draw_edges(ind_buf_id ind_buffer);
+
+        // Vertex stage: fill post_vertices with the transformed vertices and screen_tris with
+        // the vertex indices of the triangles. The indexed version transforms every vertex of the
+        // buffer once however many triangles share it.
+        void process_vertices(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer);
+        void process_vertices(vtx_buf_id vtx_buffer, ind_buf_id ind_buffer);
+        void process_vertices(int n_vert, const std::vector<Eigen::Vector3i>& ind, const std::function<post_vertex(int)>& vertex);
+        void process_vertices(std::vector<Triangle *> &TriangleList);
+
+        // Drops the triangles outside the view and replaces the ones crossing the near plane or
+        // the guard band by the fan of their clipped polygon, whose new vertices are appended to
+        // post_vertices. Keeps the order of the triangles.
+        void clip_triangles();
+
+        // Triangle setup, culling and binning: bounds of screen_tris and tile_bins, returns the
+        // number of workers. Fills the triangle counters of stats.
+        int bin_triangles();
 
-        void rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& world_pos);
+        template <typename Shader>
+        void raster_stage(Shader& shader);
+
+        // Rasterizes the part of st inside the tile [x0, x1) x [y0, y1). The fragments left to
+        // shade or to store in the G-buffer go to frags. Returns the number of fragments written
+        // (or to shade in the Shade pass).
+        int rasterize_triangle(const screen_triangle& st, int x0, int y0, int x1, int y1, Pass pass, tile_fragments& frags);
+
+        // Attributes of the fragments [start, start + batch.count) of frags
+        void interpolate_fragments(const screen_triangle& st, const tile_fragments& frags, int start, unsigned varyings, fragment_batch& batch);
+        void write_gbuffer(const screen_triangle& st, const tile_fragments& frags, fragment_batch& batch);
+
+        template <typename Shader>
+        void shade_fragments(const screen_triangle& st, const tile_fragments& frags, Shader& shader, fragment_batch& batch);
+
+        // Shades the fragments and adds them to the blend sums of the tile whose corner is (x0, y0),
+        // which composite_tile then blends over the frame buffer
+        template <typename Shader>
+        void blend_fragments(const screen_triangle& st, const tile_fragments& frags, Shader& shader, fragment_batch& batch,
+                             int x0, int y0, tile_blend& blend);
+        void composite_tile(int x0, int y0, int x1, int y1, const tile_blend& blend);
+
+        // Runs the shader on the G-buffer pixels of the tile, returns how many
+        template <typename Shader>
+        int shade_gbuffer(int x0, int y0, int x1, int y1, Shader& shader, fragment_batch& batch);
+
+        // Bring the hierarchical Z of a block, then of a tile, up to date after depth writes
+        void update_hiz_block(int block, float written_min);
+        void update_hiz_tile(int tile);
 
         // VERTEX SHADER -> MVP -> Clipping -> /.W -> VIEWPORT -> DRAWLINE/DRAWTRI -> FRAGSHADER
 
@@ -98,10 +410,15 @@ namespace rst
 
         int normal_id = -1;
 
-        std::map<int, std::vector<Eigen::Vector3f>> pos_buf;
-        std::map<int, std::vector<Eigen::Vector3i>> ind_buf;
-        std::map<int, std::vector<Eigen::Vector3f>> col_buf;
-        std::map<int, std::vector<Eigen::Vector3f>> nor_buf;
+        buffer_pool<Eigen::Vector3f> pos_buf;
+        buffer_pool<Eigen::Vector3i> ind_buf;
+        buffer_pool<std::array<int, 2>> edge_buf; // the edges of ind_buf, by ind_id
+        buffer_pool<Eigen::Vector3f> col_buf;
+        buffer_pool<Eigen::Vector3f> nor_buf;
+        buffer_pool<Eigen::Vector2f> tex_buf;
+        buffer_pool<float> vtx_buf;
+        std::vector<vertex_layout> vtx_layouts; // by vtx_id
+        int tex_coords_id = -1;
 
         std::optional<Texture> texture;
 
@@ -109,12 +426,244 @@ namespace rst
         std::function<Eigen::Vector3f(vertex_shader_payload)> vertex_shader;
 
         std::vector<Eigen::Vector3f> frame_buf;
+        std::vector<uint8_t> output_buf;
         std::vector<float> depth_buf;
+
+        // Hierarchical Z: nearest and farthest depth of every 8x8 pixel block and farthest depth
+        // of every tile, kept up to date as the depth buffer is written
+        std::vector<float> hiz_min, hiz_max;
+        std::vector<float> hiz_tile_max;
+
+        // Shader inputs of the visible fragment of each pixel, laid out like depth_buf
+        std::vector<Eigen::Vector3f> gbuf_view_pos;
+        std::vector<Eigen::Vector3f> gbuf_color;
+        std::vector<Eigen::Vector3f> gbuf_normal;
+        std::vector<Eigen::Vector2f> gbuf_tex_coords;
+        std::vector<Eigen::Vector4f> gbuf_tex_coords_d; // d/dx then d/dy
+        std::vector<char> gbuf_written;
+
+        Shading shading = Shading::Forward;
+        Culling culling = Culling::None;
+        float opacity = 1;
+        draw_stats stats;
+
+        // Output of the geometry stage, kept between frames to reuse the allocations.
+        // tile_bins[worker][tile] lists the triangles of that worker touching the tile.
+        std::vector<post_vertex> post_vertices;
+        std::vector<screen_triangle> screen_tris;
+        std::vector<std::vector<std::vector<int>>> tile_bins;
+
+        // Output of the clipping of draw_edges, binned like the triangles by worker, but to bands
+        std::vector<std::vector<std::array<Eigen::Vector3f, 2>>> screen_lines;
+        std::vector<std::vector<std::vector<int>>> band_bins;
+        bool line_aa = false;
+
         int get_index(int x, int y);
 
         int width, height;
+    };
+}
+
+template <typename Shader>
+void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type, Shader shader)
+{
+    process_vertices(pos_buffer, ind_buffer, col_buffer);
+    if (type == Primitive::Line)
+    {
+        draw_edges(ind_buffer);
+        return;
+    }
+    clip_triangles();
+    raster_stage(shader);
+}
+
+template <typename Shader>
+void rst::rasterizer::draw(vtx_buf_id vtx_buffer, ind_buf_id ind_buffer, Primitive type, Shader shader)
+{
+    process_vertices(vtx_buffer, ind_buffer);
+    if (type == Primitive::Line)
+    {
+        draw_edges(ind_buffer);
+        return;
+    }
+    clip_triangles();
+    raster_stage(shader);
+}
 
-        int next_id = 0;
-        int get_next_id() { return next_id++; }
+template <typename Shader>
+void rst::rasterizer::draw(std::vector<Triangle *> &TriangleList, Shader shader)
+{
+    process_vertices(TriangleList);
+    clip_triangles();
+    raster_stage(shader);
+}
+
+template <typename Shader>
+void rst::rasterizer::raster_stage(Shader &shader)
+{
+    const int n_thrd = bin_triangles();
+    const int n_tile_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    const int n_tile = n_tile_x * ((height + TILE_SIZE - 1) / TILE_SIZE);
+
+    if (shading == Shading::Deferred)
+    {
+        gbuf_view_pos.resize(width * height);
+        gbuf_color.resize(width * height);
+        gbuf_normal.resize(width * height);
+        gbuf_tex_coords.resize(width * height);
+        gbuf_tex_coords_d.resize(width * height);
+        gbuf_written.assign(width * height, 0);
+    }
+
+    // Raster stage: the workers pull tiles until none is left and draw the triangles binned there
+    std::atomic<int> next_tile{0};
+    std::atomic<long> fragments{0}, shaded{0};
+    Pass pass = Pass::Full;
+    if (opacity < 1)
+        pass = Pass::Transparent;
+    else if (shading == Shading::DepthPrepass || shading == Shading::DepthOnly)
+        pass = Pass::DepthOnly;
+    else if (shading == Shading::Deferred)
+        pass = Pass::GBuffer;
+    auto raster_worker = [&](int)
+    {
+        auto frags = std::make_unique<tile_fragments>();
+        auto blend = pass == Pass::Transparent ? std::make_unique<tile_blend>() : nullptr;
+        fragment_batch batch;
+        long count = 0;
+        for (int tile = next_tile++; tile < n_tile; tile = next_tile++)
+        {
+            int x0 = (tile % n_tile_x) * TILE_SIZE;
+            int y0 = (tile / n_tile_x) * TILE_SIZE;
+            int x1 = std::min(x0 + TILE_SIZE, width);
+            int y1 = std::min(y0 + TILE_SIZE, height);
+            if (pass == Pass::Shade && shading == Shading::Deferred)
+            {
+                count += shade_gbuffer(x0, y0, x1, y1, shader, batch);
+                continue;
+            }
+            if (pass == Pass::Transparent)
+            {
+                std::fill(std::begin(blend->accum), std::end(blend->accum), Eigen::Vector4f::Zero());
+                std::fill(std::begin(blend->reveal), std::end(blend->reveal), 1.f);
+            }
+            for (const auto &bins : tile_bins)
+            {
+                for (int i : bins[tile])
+                {
+                    count += rasterize_triangle(screen_tris[i], x0, y0, x1, y1, pass, *frags);
+                    if (pass == Pass::GBuffer)
+                        write_gbuffer(screen_tris[i], *frags, batch);
+                    else if (pass == Pass::Transparent)
+                        blend_fragments(screen_tris[i], *frags, shader, batch, x0, y0, *blend);
+                    else if (pass != Pass::DepthOnly)
+                        shade_fragments(screen_tris[i], *frags, shader, batch);
+                }
+            }
+            if (pass == Pass::Transparent)
+                composite_tile(x0, y0, x1, y1, *blend);
+        }
+        (pass == Pass::Shade ? shaded : fragments) += count;
+    };
+    run_workers(n_thrd, raster_worker);
+
+    if ((shading == Shading::DepthPrepass || shading == Shading::Deferred) && pass != Pass::Transparent)
+    {
+        next_tile = 0;
+        pass = Pass::Shade;
+        run_workers(n_thrd, raster_worker);
+    }
+
+    stats.fragments = fragments;
+    stats.shaded = pass == Pass::Full || pass == Pass::Transparent ? fragments.load() : shaded.load();
+}
+
+template <typename Shader>
+void rst::rasterizer::shade_fragments(const screen_triangle &st, const tile_fragments &frags, Shader &shader, fragment_batch &batch)
+{
+    for (int start = 0; start < frags.count; start += fragment_batch::capacity)
+    {
+        batch.count = std::min(frags.count - start, fragment_batch::capacity);
+        interpolate_fragments(st, frags, start, shader_varyings<Shader>::value, batch);
+        shader(batch);
+        for (int i = 0; i < batch.count; i++)
+        {
+            set_pixel(Vector2i(frags.x[start + i], frags.y[start + i]),
+                      Eigen::Vector3f(batch.out_color[0][i], batch.out_color[1][i], batch.out_color[2][i]));
+        }
+    }
+}
+
+template <typename Shader>
+void rst::rasterizer::blend_fragments(const screen_triangle &st, const tile_fragments &frags, Shader &shader, fragment_batch &batch,
+                                      int x0, int y0, tile_blend &blend)
+{
+    for (int start = 0; start < frags.count; start += fragment_batch::capacity)
+    {
+        batch.count = std::min(frags.count - start, fragment_batch::capacity);
+        // The weights need the view space depth even when the shader does not
+        interpolate_fragments(st, frags, start, shader_varyings<Shader>::value | VARYINGS_VIEW_POS, batch);
+        shader(batch);
+        for (int i = 0; i < batch.count; i++)
+        {
+            // McGuire and Bavoil's weight for the distance along the view axis: the nearer
+            // fragments dominate the average color of a pixel
+            const float d = std::abs(batch.view_pos[2][i]);
+            const float weight = opacity * std::min(3e3f, std::max(1e-2f, 10 / (1e-5f + std::pow(d / 5, 2.f) + std::pow(d / 200, 6.f))));
+            const int p = (frags.y[start + i] - y0) * TILE_SIZE + frags.x[start + i] - x0;
+            blend.accum[p] += Eigen::Vector4f(batch.out_color[0][i], batch.out_color[1][i], batch.out_color[2][i], 1) * weight;
+            blend.reveal[p] *= 1 - opacity;
+        }
+    }
+}
+
+template <typename Shader>
+int rst::rasterizer::shade_gbuffer(int x0, int y0, int x1, int y1, Shader &shader, fragment_batch &batch)
+{
+    int xs[fragment_batch::capacity], ys[fragment_batch::capacity];
+    auto flush = [&]()
+    {
+        shader(batch);
+        for (int i = 0; i < batch.count; i++)
+        {
+            set_pixel(Vector2i(xs[i], ys[i]), Eigen::Vector3f(batch.out_color[0][i], batch.out_color[1][i], batch.out_color[2][i]));
+        }
+        batch.count = 0;
     };
+
+    int count = 0;
+    batch.count = 0;
+    batch.texture = texture ? (&*texture) : nullptr;
+    for (int y = y0; y < y1; y++)
+    {
+        const int row = (height - 1 - y) * width;
+        for (int x = x0; x < x1; x++)
+        {
+            if (!gbuf_written[row + x])
+                continue;
+
+            int i = batch.count++;
+            for (int k = 0; k < 3; k++)
+            {
+                batch.view_pos[k][i] = gbuf_view_pos[row + x][k];
+                batch.color[k][i] = gbuf_color[row + x][k];
+                batch.normal[k][i] = gbuf_normal[row + x][k];
+            }
+            batch.tex_coords[0][i] = gbuf_tex_coords[row + x][0];
+            batch.tex_coords[1][i] = gbuf_tex_coords[row + x][1];
+            for (int k = 0; k < 2; k++)
+            {
+                batch.tex_coords_dx[k][i] = gbuf_tex_coords_d[row + x][k];
+                batch.tex_coords_dy[k][i] = gbuf_tex_coords_d[row + x][k + 2];
+            }
+            xs[i] = x;
+            ys[i] = y;
+            count++;
+            if (batch.count == fragment_batch::capacity)
+                flush();
+        }
+    }
+    if (batch.count > 0)
+        flush();
+    return count;
 }
@@ -0,0 +1,344 @@
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include "BVH.hpp"
+
+struct BVHBuildNode
+{
+    Bounds3 bounds;
+    std::unique_ptr<BVHBuildNode> children[2];
+    int splitAxis = 0, firstPrimOffset = 0, nPrimitives = 0;
+
+    void InitLeaf(int first, int n, const Bounds3& b)
+    {
+        firstPrimOffset = first;
+        nPrimitives = n;
+        bounds = b;
+    }
+
+    void InitInterior(int axis, BVHBuildNode* c0, BVHBuildNode* c1)
+    {
+        children[0].reset(c0);
+        children[1].reset(c1);
+        bounds = Union(c0->bounds, c1->bounds);
+        splitAxis = axis;
+        nPrimitives = 0;
+    }
+};
+
+BVHAccel::BVHAccel(std::vector<PrimitiveRef> p, int maxPrimsInNode, SplitMethod splitMethod)
+    : maxPrimsInNode(std::min(255, maxPrimsInNode))
+    , splitMethod(splitMethod)
+    , primitives(std::move(p))
+{
+    auto start = std::chrono::steady_clock::now();
+    if (primitives.empty())
+        return;
+
+    std::vector<Bounds3> bounds(primitives.size());
+    for (size_t i = 0; i < primitives.size(); ++i)
+        bounds[i] = primitives[i].object->getBounds(primitives[i].index);
+
+    int totalNodes = 0;
+    std::vector<PrimitiveRef> orderedPrims;
+    orderedPrims.reserve(primitives.size());
+    std::unique_ptr<BVHBuildNode> root(
+        recursiveBuild(primitives, bounds, 0, (int)primitives.size(), totalNodes, orderedPrims));
+    primitives.swap(orderedPrims);
+
+    nodes.resize(totalNodes);
+    int offset = 0;
+    flattenBVHTree(root.get(), offset);
+    assert(offset == totalNodes);
+
+    auto stop = std::chrono::steady_clock::now();
+    printf("BVH Generation complete: %zu primitives, %d nodes, %lld ms\n", primitives.size(), totalNodes,
+           (long long)std::chrono::duration_cast<std::chrono::milliseconds>(stop - start).count());
+}
+
+Bounds3 BVHAccel::WorldBound() const
+{
+    return nodes.empty() ? Bounds3() : nodes[0].bounds;
+}
+
+BVHBuildNode* BVHAccel::recursiveBuild(std::vector<PrimitiveRef>& prims, std::vector<Bounds3>& bounds, int start,
+                                       int end, int& totalNodes, std::vector<PrimitiveRef>& orderedPrims)
+{
+    BVHBuildNode* node = new BVHBuildNode();
+    totalNodes++;
+
+    // Compute bounds of all primitives in BVH node
+    Bounds3 nodeBounds;
+    for (int i = start; i < end; ++i)
+        nodeBounds = Union(nodeBounds, bounds[i]);
+
+    auto makeLeaf = [&]() {
+        int first = (int)orderedPrims.size();
+        for (int i = start; i < end; ++i)
+            orderedPrims.push_back(prims[i]);
+        node->InitLeaf(first, end - start, nodeBounds);
+        return node;
+    };
+
+    int nPrims = end - start;
+    if (nPrims == 1)
+        return makeLeaf();
+
+    Bounds3 centroidBounds;
+    for (int i = start; i < end; ++i)
+        centroidBounds = Union(centroidBounds, bounds[i].Centroid());
+    int dim = centroidBounds.maxExtent();
+
+    // All centroids coincide, no axis can separate them
+    if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim])
+        return makeLeaf();
+
+    // prims and bounds are kept in the same order, permute both by an index list
+    std::vector<int> order(nPrims);
+    for (int i = 0; i < nPrims; ++i)
+        order[i] = start + i;
+    auto applyOrder = [&]() {
+        std::vector<PrimitiveRef> p(nPrims);
+        std::vector<Bounds3> b(nPrims);
+        for (int i = 0; i < nPrims; ++i)
+        {
+            p[i] = prims[order[i]];
+            b[i] = bounds[order[i]];
+        }
+        std::copy(p.begin(), p.end(), prims.begin() + start);
+        std::copy(b.begin(), b.end(), bounds.begin() + start);
+    };
+
+    int mid = start + nPrims / 2;
+    if (splitMethod == SplitMethod::NAIVE || nPrims <= 4)
+    {
+        // Median split along the widest centroid axis
+        std::nth_element(order.begin(), order.begin() + nPrims / 2, order.end(), [&](int a, int b) {
+            return bounds[a].Centroid()[dim] < bounds[b].Centroid()[dim];
+        });
+        applyOrder();
+    }
+    else
+    {
+        // Binned SAH: evaluate the split cost at the boundaries of nBuckets buckets
+        constexpr int nBuckets = 12;
+        struct BucketInfo
+        {
+            int count = 0;
+            Bounds3 bounds;
+        } buckets[nBuckets];
+
+        auto bucketOf = [&](const Bounds3& b) {
+            int k = (int)(nBuckets * centroidBounds.Offset(b.Centroid())[dim]);
+            return std::min(k, nBuckets - 1);
+        };
+
+        for (int i = start; i < end; ++i)
+        {
+            int k = bucketOf(bounds[i]);
+            buckets[k].count++;
+            buckets[k].bounds = Union(buckets[k].bounds, bounds[i]);
+        }
+
+        float cost[nBuckets - 1];
+        for (int i = 0; i < nBuckets - 1; ++i)
+        {
+            Bounds3 b0, b1;
+            int count0 = 0, count1 = 0;
+            for (int j = 0; j <= i; ++j)
+            {
+                b0 = Union(b0, buckets[j].bounds);
+                count0 += buckets[j].count;
+            }
+            for (int j = i + 1; j < nBuckets; ++j)
+            {
+                b1 = Union(b1, buckets[j].bounds);
+                count1 += buckets[j].count;
+            }
+            float c0 = count0 ? count0 * b0.SurfaceArea() : 0.f;
+            float c1 = count1 ? count1 * b1.SurfaceArea() : 0.f;
+            cost[i] = 0.125f + (c0 + c1) / nodeBounds.SurfaceArea();
+        }
+
+        int minCostSplitBucket = 0;
+        for (int i = 1; i < nBuckets - 1; ++i)
+            if (cost[i] < cost[minCostSplitBucket])
+                minCostSplitBucket = i;
+
+        float leafCost = (float)nPrims;
+        if (nPrims > maxPrimsInNode || cost[minCostSplitBucket] < leafCost)
+        {
+            auto midIt = std::partition(order.begin(), order.end(),
+                                        [&](int i) { return bucketOf(bounds[i]) <= minCostSplitBucket; });
+            applyOrder();
+            mid = start + (int)(midIt - order.begin());
+            if (mid == start || mid == end)
+                mid = start + nPrims / 2;
+        }
+        else
+        {
+            return makeLeaf();
+        }
+    }
+
+    node->InitInterior(dim, recursiveBuild(prims, bounds, start, mid, totalNodes, orderedPrims),
+                       recursiveBuild(prims, bounds, mid, end, totalNodes, orderedPrims));
+    return node;
+}
+
+int BVHAccel::flattenBVHTree(BVHBuildNode* node, int& offset)
+{
+    LinearBVHNode& linearNode = nodes[offset];
+    linearNode.bounds = node->bounds;
+    int myOffset = offset++;
+    if (node->nPrimitives > 0)
+    {
+        linearNode.primitivesOffset = node->firstPrimOffset;
+        linearNode.nPrimitives = (uint16_t)node->nPrimitives;
+    }
+    else
+    {
+        linearNode.axis = (uint8_t)node->splitAxis;
+        linearNode.nPrimitives = 0;
+        flattenBVHTree(node->children[0].get(), offset);
+        nodes[myOffset].secondChildOffset = flattenBVHTree(node->children[1].get(), offset);
+    }
+    return myOffset;
+}
+
+bool BVHAccel::Intersect(const Vector3f& orig, const Vector3f& dir, hit_payload& hit) const
+{
+    if (nodes.empty())
+        return false;
+
+    bool hitAnything = false;
+    float tNear = kInfinity;
+    Vector3f invDir(1.f / dir.x, 1.f / dir.y, 1.f / dir.z);
+    int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+
+    // Front-to-back traversal with an explicit stack, nearer child first
+    int toVisitOffset = 0, currentNodeIndex = 0;
+    int nodesToVisit[64];
+    while (true)
+    {
+        const LinearBVHNode& node = nodes[currentNodeIndex];
+        if (node.bounds.IntersectP(orig, invDir, dirIsNeg, tNear))
+        {
+            if (node.nPrimitives > 0)
+            {
+                for (int i = 0; i < node.nPrimitives; ++i)
+                {
+                    const PrimitiveRef& prim = primitives[node.primitivesOffset + i];
+                    float tK = kInfinity;
+                    Vector2f uvK;
+                    if (prim.object->intersectPrimitive(prim.index, orig, dir, tK, uvK) && tK < tNear)
+                    {
+                        tNear = tK;
+                        hit.tNear = tK;
+                        hit.index = prim.index;
+                        hit.uv = uvK;
+                        hit.hit_obj = prim.object;
+                        hitAnything = true;
+                    }
+                }
+                if (toVisitOffset == 0)
+                    break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            }
+            else
+            {
+                if (dirIsNeg[node.axis])
+                {
+                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                    currentNodeIndex = node.secondChildOffset;
+                }
+                else
+                {
+                    nodesToVisit[toVisitOffset++] = node.secondChildOffset;
+                    currentNodeIndex = currentNodeIndex + 1;
+                }
+            }
+        }
+        else
+        {
+            if (toVisitOffset == 0)
+                break;
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        }
+    }
+    return hitAnything;
+}
+
+uint32_t BVHAccel::IntersectP(const ShadowRay* rays, int n) const
+{
+    assert(n <= kMaxShadowBatch);
+    if (nodes.empty() || n == 0)
+        return 0;
+
+    Vector3f invDir[kMaxShadowBatch];
+    int dirIsNeg[kMaxShadowBatch][3];
+    for (int r = 0; r < n; ++r)
+    {
+        invDir[r] = Vector3f(1.f / rays[r].dir.x, 1.f / rays[r].dir.y, 1.f / rays[r].dir.z);
+        dirIsNeg[r][0] = invDir[r].x < 0;
+        dirIsNeg[r][1] = invDir[r].y < 0;
+        dirIsNeg[r][2] = invDir[r].z < 0;
+    }
+
+    const uint32_t allRays = n == 32 ? 0xffffffffu : ((1u << n) - 1);
+    uint32_t occluded = 0;
+
+    // Every stack entry remembers which rays entered the parent, so a subtree is only
+    // tested against the rays that can reach it
+    struct StackEntry
+    {
+        int node;
+        uint32_t mask;
+    } nodesToVisit[64];
+    int toVisitOffset = 0;
+    nodesToVisit[toVisitOffset++] = {0, allRays};
+
+    while (toVisitOffset > 0)
+    {
+        StackEntry entry = nodesToVisit[--toVisitOffset];
+        uint32_t active = entry.mask & ~occluded;
+        if (!active)
+            continue;
+
+        const LinearBVHNode& node = nodes[entry.node];
+        uint32_t hitMask = 0;
+        for (uint32_t m = active; m; m &= m - 1)
+        {
+            int r = countTrailingZeros(m);
+            if (node.bounds.IntersectP(rays[r].orig, invDir[r], dirIsNeg[r], rays[r].tMax))
+                hitMask |= 1u << r;
+        }
+        if (!hitMask)
+            continue;
+
+        if (node.nPrimitives > 0)
+        {
+            for (int i = 0; i < node.nPrimitives; ++i)
+            {
+                const PrimitiveRef& prim = primitives[node.primitivesOffset + i];
+                for (uint32_t m = hitMask & ~occluded; m; m &= m - 1)
+                {
+                    int r = countTrailingZeros(m);
+                    float t = kInfinity;
+                    Vector2f uv;
+                    if (prim.object->intersectPrimitive(prim.index, rays[r].orig, rays[r].dir, t, uv) &&
+                        t < rays[r].tMax)
+                        occluded |= 1u << r;
+                }
+            }
+            if (occluded == allRays)
+                break;
+        }
+        else
+        {
+            nodesToVisit[toVisitOffset++] = {node.secondChildOffset, hitMask};
+            nodesToVisit[toVisitOffset++] = {entry.node + 1, hitMask};
+        }
+    }
+    return occluded;
+}
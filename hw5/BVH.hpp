@@ -0,0 +1,81 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include "Bounds3.hpp"
+#include "Object.hpp"
+#include "Vector.hpp"
+
+// One primitive of an object: the whole sphere, or a single triangle of a mesh
+struct PrimitiveRef
+{
+    Object* object;
+    uint32_t index;
+};
+
+struct hit_payload
+{
+    float tNear;
+    uint32_t index;
+    Vector2f uv;
+    Object* hit_obj;
+};
+
+// Occlusion query: is anything hit in (0, tMax) along orig + t * dir?
+struct ShadowRay
+{
+    Vector3f orig;
+    Vector3f dir;
+    float tMax;
+};
+
+struct BVHBuildNode;
+
+// Depth-first flattened node: the left child always follows its parent,
+// interior nodes store the offset of the right child.
+struct LinearBVHNode
+{
+    Bounds3 bounds;
+    union
+    {
+        int primitivesOffset;  // leaf
+        int secondChildOffset; // interior
+    };
+    uint16_t nPrimitives; // 0 -> interior node
+    uint8_t axis;
+};
+
+class BVHAccel
+{
+public:
+    enum class SplitMethod
+    {
+        NAIVE,
+        SAH
+    };
+
+    BVHAccel(std::vector<PrimitiveRef> p, int maxPrimsInNode = 4, SplitMethod splitMethod = SplitMethod::SAH);
+
+    Bounds3 WorldBound() const;
+
+    // Closest hit along orig + t * dir, t in (0, inf)
+    bool Intersect(const Vector3f& orig, const Vector3f& dir, hit_payload& hit) const;
+
+    // Resolves up to kMaxShadowBatch occlusion queries in one traversal. The rays share node
+    // fetches, and each ray leaves the traversal at its first blocker inside tMax.
+    // Bit i of the result is set when rays[i] is occluded.
+    static constexpr int kMaxShadowBatch = 32;
+    uint32_t IntersectP(const ShadowRay* rays, int n) const;
+
+    int TotalNodes() const { return (int)nodes.size(); }
+
+private:
+    BVHBuildNode* recursiveBuild(std::vector<PrimitiveRef>& prims, std::vector<Bounds3>& bounds, int start, int end,
+                                 int& totalNodes, std::vector<PrimitiveRef>& orderedPrims);
+    int flattenBVHTree(BVHBuildNode* node, int& offset);
+
+    const int maxPrimsInNode;
+    const SplitMethod splitMethod;
+    std::vector<PrimitiveRef> primitives;
+    std::vector<LinearBVHNode> nodes;
+};
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <limits>
+#include "Vector.hpp"
+
+class Bounds3
+{
+public:
+    Vector3f pMin, pMax; // two points to specify the bounding box
+    Bounds3()
+    {
+        float minNum = std::numeric_limits<float>::lowest();
+        float maxNum = std::numeric_limits<float>::max();
+        pMax = Vector3f(minNum, minNum, minNum);
+        pMin = Vector3f(maxNum, maxNum, maxNum);
+    }
+    Bounds3(const Vector3f& p)
+        : pMin(p)
+        , pMax(p)
+    {}
+    Bounds3(const Vector3f& p1, const Vector3f& p2)
+        : pMin(Vector3f::Min(p1, p2))
+        , pMax(Vector3f::Max(p1, p2))
+    {}
+
+    Vector3f Diagonal() const
+    {
+        return pMax - pMin;
+    }
+
+    int maxExtent() const
+    {
+        Vector3f d = Diagonal();
+        if (d.x > d.y && d.x > d.z)
+            return 0;
+        else if (d.y > d.z)
+            return 1;
+        else
+            return 2;
+    }
+
+    float SurfaceArea() const
+    {
+        Vector3f d = Diagonal();
+        return 2 * (d.x * d.y + d.x * d.z + d.y * d.z);
+    }
+
+    Vector3f Centroid() const
+    {
+        return 0.5 * pMin + 0.5 * pMax;
+    }
+
+    // Relative position of p inside the box, (0,0,0) at pMin and (1,1,1) at pMax
+    Vector3f Offset(const Vector3f& p) const
+    {
+        Vector3f o = p - pMin;
+        if (pMax.x > pMin.x)
+            o.x /= pMax.x - pMin.x;
+        if (pMax.y > pMin.y)
+            o.y /= pMax.y - pMin.y;
+        if (pMax.z > pMin.z)
+            o.z /= pMax.z - pMin.z;
+        return o;
+    }
+
+    const Vector3f& operator[](int i) const
+    {
+        return (i == 0) ? pMin : pMax;
+    }
+
+    // Slab test against [0, tMax).
+    // invDir is (1/dir.x, 1/dir.y, 1/dir.z), dirIsNeg[i] is 1 when dir[i] < 0
+    bool IntersectP(const Vector3f& orig, const Vector3f& invDir, const int dirIsNeg[3], float tMax) const
+    {
+        float tMin = ((*this)[dirIsNeg[0]].x - orig.x) * invDir.x;
+        float tFar = ((*this)[1 - dirIsNeg[0]].x - orig.x) * invDir.x;
+        float tyMin = ((*this)[dirIsNeg[1]].y - orig.y) * invDir.y;
+        float tyMax = ((*this)[1 - dirIsNeg[1]].y - orig.y) * invDir.y;
+        if (tMin > tyMax || tyMin > tFar)
+            return false;
+        if (tyMin > tMin)
+            tMin = tyMin;
+        if (tyMax < tFar)
+            tFar = tyMax;
+
+        float tzMin = ((*this)[dirIsNeg[2]].z - orig.z) * invDir.z;
+        float tzMax = ((*this)[1 - dirIsNeg[2]].z - orig.z) * invDir.z;
+        if (tMin > tzMax || tzMin > tFar)
+            return false;
+        if (tzMin > tMin)
+            tMin = tzMin;
+        if (tzMax < tFar)
+            tFar = tzMax;
+
+        return tMin < tMax && tFar > 0;
+    }
+};
+
+inline Bounds3 Union(const Bounds3& b1, const Bounds3& b2)
+{
+    Bounds3 ret;
+    ret.pMin = Vector3f::Min(b1.pMin, b2.pMin);
+    ret.pMax = Vector3f::Max(b1.pMax, b2.pMax);
+    return ret;
+}
+
+inline Bounds3 Union(const Bounds3& b, const Vector3f& p)
+{
+    Bounds3 ret;
+    ret.pMin = Vector3f::Min(b.pMin, p);
+    ret.pMax = Vector3f::Max(b.pMax, p);
+    return ret;
+}
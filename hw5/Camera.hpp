@@ -0,0 +1,62 @@
+#pragma once
+
+#include "Vector.hpp"
+#include "global.hpp"
+
+// Pinhole camera. Everything that stays the same from pixel to pixel is computed once in the
+// constructor; the direction towards pixel (i, j) is firstPixel + i * dx + j * dy before
+// normalization, so a render can be repeated with another camera without stale state.
+class Camera
+{
+public:
+    // fov is the vertical field of view in degrees. up only has to be roughly perpendicular to
+    // the viewing direction.
+    Camera(const Vector3f& eye, const Vector3f& lookAt, const Vector3f& up, float fov, int width, int height)
+        : eye(eye)
+        , width(width)
+        , height(height)
+    {
+        Vector3f forward = normalize(lookAt - eye);
+        Vector3f right = normalize(crossProduct(forward, up));
+        Vector3f trueUp = crossProduct(right, forward);
+
+        // The image plane is at distance 1 in front of the eye
+        float scale = std::tan(deg2rad(fov * 0.5f));
+        float imageAspectRatio = width / (float)height;
+        dx = right * (2 * scale * imageAspectRatio / width);
+        dy = trueUp * (-2 * scale / height);
+        firstPixel = forward - right * (scale * imageAspectRatio) + trueUp * scale + (dx + dy) * 0.5f;
+    }
+
+    const Vector3f& Position() const { return eye; }
+    int Width() const { return width; }
+    int Height() const { return height; }
+
+    // Normalized directions of the rays through the pixel centers of the tile [x0, x1) x [y0, y1),
+    // row by row. The components go to separate arrays so the inner loop vectorizes.
+    void GenerateRays(int x0, int y0, int x1, int y1, float* dirX, float* dirY, float* dirZ) const
+    {
+        int n = 0;
+        for (int j = y0; j < y1; ++j)
+        {
+            Vector3f row = firstPixel + dx * (float)x0 + dy * (float)j;
+            for (int i = 0; i < x1 - x0; ++i)
+            {
+                float x = row.x + dx.x * i;
+                float y = row.y + dx.y * i;
+                float z = row.z + dx.z * i;
+                float invLength = 1 / std::sqrt(x * x + y * y + z * z);
+                dirX[n + i] = x * invLength;
+                dirY[n + i] = y * invLength;
+                dirZ[n + i] = z * invLength;
+            }
+            n += x1 - x0;
+        }
+    }
+
+private:
+    Vector3f eye;
+    int width, height;
+    Vector3f firstPixel; // unnormalized direction towards the center of pixel (0, 0)
+    Vector3f dx, dy;     // change of that direction per column and per row
+};
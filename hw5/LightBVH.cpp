@@ -0,0 +1,76 @@
+#include <algorithm>
+#include <cmath>
+#include "LightBVH.hpp"
+#include "global.hpp"
+
+LightBVH::LightBVH(const std::vector<std::unique_ptr<Light>>& sceneLights)
+{
+    lights.reserve(sceneLights.size());
+    for (const auto& light : sceneLights)
+        lights.push_back(light.get());
+    if (lights.empty())
+        return;
+
+    nodes.reserve(2 * lights.size() - 1);
+    recursiveBuild(0, (int)lights.size());
+}
+
+int LightBVH::recursiveBuild(int start, int end)
+{
+    int nodeIndex = (int)nodes.size();
+    nodes.emplace_back();
+
+    LinearLightNode node;
+    node.power = 0;
+    for (int i = start; i < end; ++i)
+    {
+        const Vector3f& I = lights[i]->intensity;
+        node.bounds = Union(node.bounds, lights[i]->position);
+        node.power += std::max(I.x, std::max(I.y, I.z));
+    }
+    node.lightsOffset = start;
+    node.nLights = end - start;
+    node.secondChildOffset = 0;
+
+    if (node.nLights > 1)
+    {
+        // Median split along the widest axis of the light positions
+        int dim = node.bounds.maxExtent();
+        int mid = start + node.nLights / 2;
+        std::nth_element(lights.begin() + start, lights.begin() + mid, lights.begin() + end,
+                         [dim](const Light* a, const Light* b) { return a->position[dim] < b->position[dim]; });
+        recursiveBuild(start, mid);
+        node.secondChildOffset = recursiveBuild(mid, end);
+    }
+
+    nodes[nodeIndex] = node;
+    return nodeIndex;
+}
+
+float LightBVH::ContributionBound(const LinearLightNode& node, const Vector3f& p, const PhongLobe& lobe) const
+{
+    // Every light of the node lies in the bounding sphere of its box, so the directions from p
+    // towards them stay inside the cone around w with half angle thetaB
+    Vector3f diagonal = node.bounds.Diagonal();
+    float r2 = 0.25f * dotProduct(diagonal, diagonal);
+    Vector3f d = node.bounds.Centroid() - p;
+    float dist2 = dotProduct(d, d);
+    if (dist2 <= r2)
+        return node.power * (lobe.kDiffuse + lobe.kSpecular);
+
+    Vector3f w = d / std::sqrt(dist2);
+    float sinThetaB = std::sqrt(r2 / dist2);
+    float cosThetaB = std::sqrt(1 - r2 / dist2);
+
+    // Largest cosine between axis and a direction of the cone: cos(max(0, theta - thetaB))
+    auto cosBound = [&](const Vector3f& axis) {
+        float cosTheta = clamp(-1, 1, dotProduct(axis, w));
+        if (cosTheta >= cosThetaB)
+            return 1.f;
+        float sinTheta = std::sqrt(1 - cosTheta * cosTheta);
+        return std::max(0.f, cosTheta * cosThetaB + sinTheta * sinThetaB);
+    };
+
+    return node.power *
+           (lobe.kDiffuse * cosBound(lobe.N) + lobe.kSpecular * std::pow(cosBound(lobe.R), lobe.specularExponent));
+}
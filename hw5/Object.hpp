@@ -1,5 +1,6 @@
 #pragma once
 
+#include "Bounds3.hpp"
 #include "Vector.hpp"
 #include "global.hpp"
 
@@ -22,6 +23,17 @@ public:
     virtual void getSurfaceProperties(const Vector3f&, const Vector3f&, const uint32_t&, const Vector2f&, Vector3f&,
                                       Vector2f&) const = 0;
 
+    // An object is made of one or more primitives (a sphere is one, a mesh has one per triangle).
+    // The scene BVH is built over primitives so meshes do not need a linear scan of their triangles.
+    virtual uint32_t getNumPrimitives() const
+    {
+        return 1;
+    }
+
+    virtual Bounds3 getBounds(uint32_t prim) const = 0;
+
+    virtual bool intersectPrimitive(uint32_t prim, const Vector3f&, const Vector3f&, float&, Vector2f&) const = 0;
+
     virtual Vector3f evalDiffuseColor(const Vector2f&) const
     {
         return diffuseColor;
@@ -5,14 +5,10 @@
 #include "Renderer.hpp"
 #include "Scene.hpp"
 #include <optional>
+#include <atomic>
 #include <future>
 #include <thread>
 
-inline float deg2rad(const float &deg)
-{
-    return deg * M_PI / 180.0;
-}
-
 // Compute reflection direction
 Vector3f reflect(const Vector3f &I, const Vector3f &N)
 {
@@ -88,172 +84,200 @@ float fresnel(const Vector3f &I, const Vector3f &N, const float &ior)
 }
 
 // [comment]
-// Returns true if the ray intersects an object, false otherwise.
+// Returns the closest hit of the ray against the scene BVH, std::nullopt if nothing is hit.
 //
 // \param orig is the ray origin
 // \param dir is the ray direction
-// \param objects is the list of objects the scene contains
-// \param[out] tNear contains the distance to the cloesest intersected object.
-// \param[out] index stores the index of the intersect triangle if the interesected object is a mesh.
-// \param[out] uv stores the u and v barycentric coordinates of the intersected point
-// \param[out] *hitObject stores the pointer to the intersected object (used to retrieve material information, etc.)
-// \param isShadowRay is it a shadow ray. We can return from the function sooner as soon as we have found a hit.
+// \param scene is the scene, its BVH must have been built with Scene::buildBVH()
+//
+// The payload holds the distance to the closest intersected object (tNear), the index of the
+// intersected triangle if the object is a mesh, the u and v barycentric coordinates of the
+// intersected point and a pointer to the intersected object.
 // [/comment]
 std::optional<hit_payload> trace(
-    const Vector3f &orig, const Vector3f &dir,
-    const std::vector<std::unique_ptr<Object>> &objects)
+    const Vector3f &orig, const Vector3f &dir, const Scene &scene)
 {
-    float tNear = kInfinity;
-    std::optional<hit_payload> payload;
-    for (const auto &object : objects)
-    {
-        float tNearK = kInfinity;
-        uint32_t indexK;
-        Vector2f uvK;
-        if (object->intersect(orig, dir, tNearK, indexK, uvK) && tNearK < tNear)
-        {
-            payload.emplace();
-            payload->hit_obj = object.get();
-            payload->tNear = tNearK;
-            payload->index = indexK;
-            payload->uv = uvK;
-            tNear = tNearK;
-        }
-    }
-
-    return payload;
+    hit_payload payload;
+    if (scene.get_bvh().Intersect(orig, dir, payload))
+        return payload;
+    return std::nullopt;
 }
 
 // [comment]
 // Implementation of the Whitted-style light transport algorithm (E [S*] (D|G) L)
 //
 // This function is the function that compute the color at the intersection point
-// of a ray defined by a position and a direction. Note that thus function is recursive (it calls itself).
+// of a ray defined by a position and a direction.
 //
 // If the material of the intersected object is either reflective or reflective and refractive,
-// then we compute the reflection/refraction direction and cast two new rays into the scene
-// by calling the castRay() function recursively. When the surface is transparent, we mix
-// the reflection and refraction color using the result of the fresnel equations (it computes
-// the amount of reflection and refraction depending on the surface normal, incident view direction
-// and surface refractive index).
+// then we compute the reflection/refraction direction and cast two new rays into the scene.
+// When the surface is transparent, we mix the reflection and refraction color using the result
+// of the fresnel equations (it computes the amount of reflection and refraction depending on the
+// surface normal, incident view direction and surface refractive index).
 //
 // If the surface is diffuse/glossy we use the Phong illumation model to compute the color
 // at the intersection point.
+//
+// The color of a ray is a weighted sum of the colors found at the leaves of its ray tree, so
+// instead of recursing we keep the pending rays on an explicit stack together with their weight
+// (the product of the kr / 1-kr factors on the way down). A branch whose weight drops below
+// scene.minRayWeight can not change the pixel noticeably and is never traced.
 // [/comment]
+struct RayTask
+{
+    Vector3f orig;
+    Vector3f dir;
+    int depth;
+    float weight;
+};
+
 Vector3f castRay(
     const Vector3f &orig, const Vector3f &dir, const Scene &scene,
     int depth)
 {
-    if (depth > scene.maxDepth)
-    {
-        return Vector3f(0.0, 0.0, 0.0);
-    }
+    uint64_t raysCast = 0, raysPruned = 0, lightsShaded = 0, lightsCulled = 0;
+    Vector3f pixelColor = 0;
 
-    Vector3f hitColor = scene.backgroundColor;
-    if (auto payload = trace(orig, dir, scene.get_objects()); payload)
+    std::vector<RayTask> stack;
+    stack.reserve(2 * (scene.maxDepth + 2));
+    // Children deeper than maxDepth contribute black, exactly like the recursive version
+    auto push = [&](const Vector3f &o, const Vector3f &d, int childDepth, float weight)
     {
-        Vector3f hitPoint = orig + dir * payload->tNear;
-        Vector3f N;  // normal
-        Vector2f st; // st coordinates
-        payload->hit_obj->getSurfaceProperties(hitPoint, dir, payload->index, payload->uv, N, st);
-        switch (payload->hit_obj->materialType)
-        {
-        case REFLECTION_AND_REFRACTION:
-        {
-            Vector3f reflectionDirection = normalize(reflect(dir, N));
-            Vector3f refractionDirection = normalize(refract(dir, N, payload->hit_obj->ior));
-            Vector3f reflectionRayOrig = (dotProduct(reflectionDirection, N) < 0) ? hitPoint - N * scene.epsilon : hitPoint + N * scene.epsilon;
-            Vector3f refractionRayOrig = (dotProduct(refractionDirection, N) < 0) ? hitPoint - N * scene.epsilon : hitPoint + N * scene.epsilon;
-            Vector3f reflectionColor = castRay(reflectionRayOrig, reflectionDirection, scene, depth + 1);
-            Vector3f refractionColor = castRay(refractionRayOrig, refractionDirection, scene, depth + 1);
-            float kr = fresnel(dir, N, payload->hit_obj->ior);
-            hitColor = reflectionColor * kr + refractionColor * (1 - kr);
-            break;
-        }
-        case REFLECTION:
+        if (childDepth > scene.maxDepth)
+            return;
+        if (weight < scene.minRayWeight)
         {
-            float kr = fresnel(dir, N, payload->hit_obj->ior);
-            Vector3f reflectionDirection = reflect(dir, N);
-            Vector3f reflectionRayOrig = (dotProduct(reflectionDirection, N) < 0) ? hitPoint + N * scene.epsilon : hitPoint - N * scene.epsilon;
-            hitColor = castRay(reflectionRayOrig, reflectionDirection, scene, depth + 1) * kr;
-            break;
+            ++raysPruned;
+            return;
         }
-        default:
-        {
-            // [comment]
-            // We use the Phong illumation model int the default case. The phong model
-            // is composed of a diffuse and a specular reflection component.
-            // [/comment]
-            Vector3f lightAmt = 0, specularColor = 0;
-            Vector3f shadowPointOrig = (dotProduct(dir, N) < 0) ? hitPoint + N * scene.epsilon : hitPoint - N * scene.epsilon;
-            // [comment]
-            // Loop over all lights in the scene and sum their contribution up
-            // We also apply the lambert cosine law
-            // [/comment]
-            for (auto &light : scene.get_lights())
-            {
-                Vector3f lightDir = light->position - hitPoint;
-                // square of the distance between hitPoint and the light
-                float lightDistance2 = dotProduct(lightDir, lightDir);
-                lightDir = normalize(lightDir);
-                float LdotN = std::max(0.f, dotProduct(lightDir, N));
-                // is the point in shadow, and is the nearest occluding object closer to the object than the light itself?
-                auto shadow_res = trace(shadowPointOrig, lightDir, scene.get_objects());
-                bool inShadow = shadow_res && (shadow_res->tNear * shadow_res->tNear < lightDistance2);
+        stack.push_back({o, d, childDepth, weight});
+    };
+    push(orig, dir, depth, 1.f);
 
-                lightAmt += inShadow ? 0 : light->intensity * LdotN;
-                Vector3f reflectionDirection = reflect(-lightDir, N);
+    while (!stack.empty())
+    {
+        RayTask task = stack.back();
+        stack.pop_back();
+        ++raysCast;
 
-                specularColor += powf(std::max(0.f, -dotProduct(reflectionDirection, dir)),
-                                      payload->hit_obj->specularExponent) *
-                                 light->intensity;
+        Vector3f hitColor = scene.backgroundColor;
+        if (auto payload = trace(task.orig, task.dir, scene); payload)
+        {
+            Vector3f hitPoint = task.orig + task.dir * payload->tNear;
+            Vector3f N;  // normal
+            Vector2f st; // st coordinates
+            payload->hit_obj->getSurfaceProperties(hitPoint, task.dir, payload->index, payload->uv, N, st);
+            switch (payload->hit_obj->materialType)
+            {
+            case REFLECTION_AND_REFRACTION:
+            {
+                Vector3f reflectionDirection = normalize(reflect(task.dir, N));
+                Vector3f refractionDirection = normalize(refract(task.dir, N, payload->hit_obj->ior));
+                Vector3f reflectionRayOrig = (dotProduct(reflectionDirection, N) < 0) ? hitPoint - N * scene.epsilon : hitPoint + N * scene.epsilon;
+                Vector3f refractionRayOrig = (dotProduct(refractionDirection, N) < 0) ? hitPoint - N * scene.epsilon : hitPoint + N * scene.epsilon;
+                float kr = fresnel(task.dir, N, payload->hit_obj->ior);
+                push(reflectionRayOrig, reflectionDirection, task.depth + 1, task.weight * kr);
+                push(refractionRayOrig, refractionDirection, task.depth + 1, task.weight * (1 - kr));
+                continue;
+            }
+            case REFLECTION:
+            {
+                float kr = fresnel(task.dir, N, payload->hit_obj->ior);
+                Vector3f reflectionDirection = reflect(task.dir, N);
+                Vector3f reflectionRayOrig = (dotProduct(reflectionDirection, N) < 0) ? hitPoint + N * scene.epsilon : hitPoint - N * scene.epsilon;
+                push(reflectionRayOrig, reflectionDirection, task.depth + 1, task.weight * kr);
+                continue;
+            }
+            default:
+            {
+                // [comment]
+                // We use the Phong illumation model int the default case. The phong model
+                // is composed of a diffuse and a specular reflection component.
+                // [/comment]
+                Vector3f lightAmt = 0, specularColor = 0;
+                Vector3f shadowPointOrig = (dotProduct(task.dir, N) < 0) ? hitPoint + N * scene.epsilon : hitPoint - N * scene.epsilon;
+                // [comment]
+                // Loop over all lights in the scene and sum their contribution up
+                // We also apply the lambert cosine law
+                //
+                // The light BVH leaves out lights that together can add less than
+                // scene.lightCullThreshold here. The shadow rays of the others are gathered and
+                // resolved together by one occlusion-only BVH traversal, which stops each ray at its
+                // first blocker closer than the light.
+                // [/comment]
+                ShadowRay shadowRays[BVHAccel::kMaxShadowBatch];
+                const Light *shadowLights[BVHAccel::kMaxShadowBatch];
+                int n = 0;
+                auto flushShadowBatch = [&]()
+                {
+                    // is the point in shadow, and is the nearest occluding object closer to the object than the light itself?
+                    uint32_t inShadow = scene.get_bvh().IntersectP(shadowRays, n);
+                    for (int k = 0; k < n; ++k)
+                    {
+                        const Vector3f &lightDir = shadowRays[k].dir;
+                        float LdotN = std::max(0.f, dotProduct(lightDir, N));
+                        lightAmt += (inShadow >> k & 1) ? 0 : shadowLights[k]->intensity * LdotN;
+                        Vector3f reflectionDirection = reflect(-lightDir, N);
+
+                        specularColor += powf(std::max(0.f, -dotProduct(reflectionDirection, task.dir)),
+                                              payload->hit_obj->specularExponent) *
+                                         shadowLights[k]->intensity;
+                    }
+                    lightsShaded += n;
+                    n = 0;
+                };
+
+                PhongLobe lobe{N, reflect(task.dir, N), payload->hit_obj->specularExponent,
+                               payload->hit_obj->Kd, payload->hit_obj->Ks};
+                lightsCulled += scene.get_light_bvh().VisitLights(hitPoint, lobe, scene.lightCullThreshold, [&](const Light &light)
+                {
+                    Vector3f lightDir = light.position - hitPoint;
+                    // distance between hitPoint and the light
+                    float lightDistance = std::sqrt(dotProduct(lightDir, lightDir));
+                    shadowRays[n] = {shadowPointOrig, lightDir / lightDistance, lightDistance};
+                    shadowLights[n++] = &light;
+                    if (n == BVHAccel::kMaxShadowBatch)
+                        flushShadowBatch();
+                });
+                if (n > 0)
+                    flushShadowBatch();
+
+                hitColor = lightAmt * payload->hit_obj->evalDiffuseColor(st) * payload->hit_obj->Kd + specularColor * payload->hit_obj->Ks;
+                break;
+            }
             }
-
-            hitColor = lightAmt * payload->hit_obj->evalDiffuseColor(st) * payload->hit_obj->Kd + specularColor * payload->hit_obj->Ks;
-            break;
-        }
         }
+        pixelColor += hitColor * task.weight;
     }
 
-    return hitColor;
+    scene.rayStats.raysCast += raysCast;
+    scene.rayStats.raysPruned += raysPruned;
+    scene.rayStats.lightsShaded += lightsShaded;
+    scene.rayStats.lightsCulled += lightsCulled;
+    return pixelColor;
 }
 
-std::vector<Vector3f> RenderKernel(const Scene &scene, Vector3f &eye_pos, const size_t n_row, const size_t begin_row, size_t t)
-{
-    uint64_t id = std::hash<std::thread::id>{}(std::this_thread::get_id());
+// Square tiles handed out to the worker threads. Small enough that the glass spheres (which cost
+// far more per pixel than the floor or the background) are spread over all threads.
+constexpr int TILE_SIZE = 16;
 
-    std::vector<Vector3f> framebuffer(scene.width * n_row);
+// Renders the pixels of one tile straight into the shared framebuffer.
+// Tiles never overlap, so the workers need no synchronisation on the framebuffer.
+void RenderKernel(const Scene &scene, const Camera &camera, std::vector<Vector3f> &framebuffer,
+                  int x0, int y0, int x1, int y1)
+{
+    float dirX[TILE_SIZE * TILE_SIZE], dirY[TILE_SIZE * TILE_SIZE], dirZ[TILE_SIZE * TILE_SIZE];
+    camera.GenerateRays(x0, y0, x1, y1, dirX, dirY, dirZ);
 
-    static const float scale = std::tan(deg2rad(scene.fov * 0.5f));
-    static const float imageAspectRatio = scene.width / (float)scene.height; // static const 能否保证线程安全?
-    int m = 0;
-    for (int j = begin_row; j < (begin_row + n_row); ++j)
+    int n = 0;
+    for (int j = y0; j < y1; ++j)
     {
-        for (int i = 0; i < scene.width; ++i)
+        for (int i = x0; i < x1; ++i, ++n)
         {
-
-            float x_ndc = 2.f * i / scene.width - 1.f;
-
-            float y_ndc = 1.f - 2.f * j / scene.height;
-
-            float x = x_ndc * scale * imageAspectRatio;
-            float y = y_ndc * scale;
-
-            Vector3f dir = Vector3f(x, y, -1); // Don't forget to normalize this direction!
-            dir = normalize(dir);
-            framebuffer[m++] = castRay(eye_pos, dir, scene, 0);
-        }
-        if (t == 0)
-        {
-            UpdateProgress(j / (float)n_row);
+            framebuffer[j * camera.Width() + i] =
+                castRay(camera.Position(), Vector3f(dirX[n], dirY[n], dirZ[n]), scene, 0);
         }
     }
-    if (t == 0)
-    {
-        std::cout << "\nWait for other threds\n";
-    }
-
-    return framebuffer;
 }
 
 // [comment]
@@ -315,40 +339,56 @@ void Renderer::Render(const Scene &scene)
 }
 */
 
-void Renderer::Render(const Scene &scene)
+void Renderer::Render(const Scene &scene, const Camera &camera)
 {
-    Vector3f eye_pos(0);
+    const int width = camera.Width(), height = camera.Height();
 
-    // MultiThread Render
-    std::vector<Vector3f> final_framebuffer;
-    const size_t n_thrd = 1;
-    const size_t n_row = scene.height / n_thrd;
+    // MultiThread Render: every worker pulls the next tile index until all tiles are done
+    std::vector<Vector3f> final_framebuffer(width * height);
+    const size_t n_thrd = std::max(1u, std::thread::hardware_concurrency());
+    const int n_tile_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    const int n_tile_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+    const int n_tile = n_tile_x * n_tile_y;
+
+    std::atomic<int> next_tile{0};
+    std::atomic<int> completed{0};
+    auto worker = [&](size_t t)
+    {
+        for (int tile = next_tile++; tile < n_tile; tile = next_tile++)
+        {
+            int x0 = (tile % n_tile_x) * TILE_SIZE;
+            int y0 = (tile / n_tile_x) * TILE_SIZE;
+            RenderKernel(scene, camera, final_framebuffer, x0, y0,
+                         std::min(x0 + TILE_SIZE, width), std::min(y0 + TILE_SIZE, height));
+            int done = ++completed;
+            if (t == 0)
+            {
+                UpdateProgress(done / (float)n_tile);
+            }
+        }
+    };
 
-    std::vector<std::future<std::vector<Vector3f>>> futures_framebuffer;
-    futures_framebuffer.reserve(n_thrd);
+    std::vector<std::future<void>> futures;
+    futures.reserve(n_thrd);
     for (size_t t = 0; t < n_thrd; t++)
     {
-        futures_framebuffer.emplace_back(std::async(std::launch::async, [&scene, &eye_pos, n_row, t]() -> std::vector<Vector3f>
-                                                    { return RenderKernel(scene, eye_pos, n_row, n_row * t, t); }));
+        futures.emplace_back(std::async(std::launch::async, worker, t));
     }
-    std::atomic<int> completed{0};
-    for (size_t t = 0; t < n_thrd; t++)
+    for (auto &f : futures)
     {
-        auto partial = futures_framebuffer[t].get();
-        final_framebuffer.insert(
-            final_framebuffer.end(),
-            std::make_move_iterator(partial.begin()),
-            std::make_move_iterator(partial.end()));
-
-        ++completed;
-        UpdateProgress(float(completed) / n_thrd);
+        f.get();
     }
+    UpdateProgress(1.f);
+    std::cout << "\n";
+    std::cout << "Whitted rays traced: " << scene.rayStats.raysCast
+              << ", branches pruned below weight " << scene.minRayWeight << ": " << scene.rayStats.raysPruned << "\n";
+    std::cout << "Lights shaded: " << scene.rayStats.lightsShaded
+              << ", culled with threshold " << scene.lightCullThreshold << ": " << scene.rayStats.lightsCulled << "\n";
 
     // save final_framebuffer to file
-    FILE *fp = nullptr;
-    fopen_s(&fp, "binary.ppm", "wb");
-    (void)fprintf(fp, "P6\n%d %d\n255\n", scene.width, scene.height);
-    for (auto i = 0; i < scene.height * scene.width; ++i)
+    FILE *fp = fopen("binary.ppm", "wb");
+    (void)fprintf(fp, "P6\n%d %d\n255\n", width, height);
+    for (auto i = 0; i < height * width; ++i)
     {
         static unsigned char color[3];
         color[0] = (char)(255 * clamp(0, 1, final_framebuffer[i].x));
@@ -1,18 +1,11 @@
 #pragma once
+#include "Camera.hpp"
 #include "Scene.hpp"
 
-struct hit_payload
-{
-    float tNear;
-    uint32_t index;
-    Vector2f uv;
-    Object* hit_obj;
-};
-
 class Renderer
 {
 public:
-    void Render(const Scene& scene);
+    void Render(const Scene& scene, const Camera& camera);
 
 private:
 };
\ No newline at end of file
@@ -3,3 +3,16 @@
 //
 
 #include "Scene.hpp"
+
+void Scene::buildBVH()
+{
+    printf(" - Generating BVH...\n\n");
+    std::vector<PrimitiveRef> prims;
+    for (const auto &object : objects)
+    {
+        for (uint32_t i = 0; i < object->getNumPrimitives(); ++i)
+            prims.push_back({object.get(), i});
+    }
+    bvh = std::make_unique<BVHAccel>(std::move(prims), 4, BVHAccel::SplitMethod::SAH);
+    lightBvh = std::make_unique<LightBVH>(lights);
+}
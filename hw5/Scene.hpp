@@ -1,10 +1,22 @@
 #pragma once
 
+#include <atomic>
 #include <vector>
 #include <memory>
 #include "Vector.hpp"
 #include "Object.hpp"
 #include "Light.hpp"
+#include "BVH.hpp"
+#include "LightBVH.hpp"
+
+// Ray and light counters of the Whitted integrator, shared by all render threads
+struct RayStats
+{
+    std::atomic<uint64_t> raysCast{0};
+    std::atomic<uint64_t> raysPruned{0};
+    std::atomic<uint64_t> lightsShaded{0};
+    std::atomic<uint64_t> lightsCulled{0};
+};
 
 class Scene
 {
@@ -16,6 +28,11 @@ public:
     Vector3f backgroundColor = Vector3f(0.235294, 0.67451, 0.843137);
     int maxDepth = 9;
     float epsilon = 0.00001;
+    // reflection/refraction branches whose accumulated Fresnel weight is below this are not traced
+    float minRayWeight = 0.001f;
+    // lights are skipped at a hit point as long as what they could add there stays below this in total
+    float lightCullThreshold = 0.001f;
+    mutable RayStats rayStats;
 
     Scene(int w, int h) : width(w), height(h)
     {
@@ -27,8 +44,15 @@ public:
     [[nodiscard]] const std::vector<std::unique_ptr<Object>> &get_objects() const { return objects; }
     [[nodiscard]] const std::vector<std::unique_ptr<Light>> &get_lights() const { return lights; }
 
+    // Call after every object and light has been added; trace() goes through the BVH only
+    void buildBVH();
+    [[nodiscard]] const BVHAccel &get_bvh() const { return *bvh; }
+    [[nodiscard]] const LightBVH &get_light_bvh() const { return *lightBvh; }
+
 private:
     // creating the scene (adding objects and lights)
     std::vector<std::unique_ptr<Object>> objects;
     std::vector<std::unique_ptr<Light>> lights;
+    std::unique_ptr<BVHAccel> bvh;
+    std::unique_ptr<LightBVH> lightBvh;
 };
\ No newline at end of file
@@ -31,6 +31,19 @@ public:
         return true;
     }
 
+    Bounds3 getBounds(uint32_t) const override
+    {
+        return Bounds3(center - radius, center + radius);
+    }
+
+    bool intersectPrimitive(uint32_t, const Vector3f& orig, const Vector3f& dir, float& tnear,
+                            Vector2f&) const override
+    {
+        uint32_t index;
+        Vector2f uv;
+        return intersect(orig, dir, tnear, index, uv);
+    }
+
     void getSurfaceProperties(const Vector3f& P, const Vector3f&, const uint32_t&, const Vector2f&,
                               Vector3f& N, Vector2f&) const override
     {
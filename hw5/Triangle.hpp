@@ -4,34 +4,44 @@
 
 #include <cstring>
 
-bool rayTriangleIntersect(const Vector3f &v0, const Vector3f &v1, const Vector3f &v2, const Vector3f &orig,
-                          const Vector3f &dir, float &tnear, float &u, float &v)
+inline bool rayTriangleIntersect(const Vector3f &v0, const Vector3f &v1, const Vector3f &v2, const Vector3f &orig,
+                                 const Vector3f &dir, float &tnear, float &u, float &v)
 {
     // tNear contains the distance to the cloesest intersected object.   即交点的t
     // uv stores the u and v barycentric coordinates of the intersected point     即 交点的重心坐标? (b1,b2)
-    // TODO: Implement this function that tests whether the triangle
-    // that's specified bt v0, v1 and v2 intersects with the ray (whose
-    // origin is *orig* and direction is *dir*)
-    // Also don't forget to update tnear, u and v.
-
-    Vector3f S = orig - v0;
+    // Moller-Trumbore: reject on u and v before paying for the single division,
+    // so most of the misses coming out of the BVH leaves cost only dot/cross products.
     Vector3f E1 = v1 - v0;
     Vector3f E2 = v2 - v0;
     Vector3f S1 = crossProduct(dir, E2);
-    Vector3f S2 = crossProduct(S, E1);
-
     float S1E1 = dotProduct(S1, E1);
-    float t = dotProduct(S2, E2) / S1E1;
-    float b1 = dotProduct(S1, S) / S1E1;
-    float b2 = dotProduct(S2, dir) / S1E1;
-    if (t > 0 && b1 >= 0 && b2 >= 0 && b1 <= 1 && b2 <= 1 && b1 + b2 <= 1)
+    if (fabsf(S1E1) < 1e-12f)
+        return false;
+
+    Vector3f S = orig - v0;
+    float b1 = dotProduct(S1, S);
+    Vector3f S2 = crossProduct(S, E1);
+    float b2 = dotProduct(S2, dir);
+    if (S1E1 > 0)
     {
-        tnear = t;
-        u = b1;
-        v = b2;
-        return true;
+        if (b1 < 0 || b1 > S1E1 || b2 < 0 || b1 + b2 > S1E1)
+            return false;
     }
-    return false;
+    else
+    {
+        if (b1 > 0 || b1 < S1E1 || b2 > 0 || b1 + b2 < S1E1)
+            return false;
+    }
+
+    float invS1E1 = 1 / S1E1;
+    float t = dotProduct(S2, E2) * invS1E1;
+    if (t <= 0)
+        return false;
+
+    tnear = t;
+    u = b1 * invS1E1;
+    v = b2 * invS1E1;
+    return true;
 }
 
 class MeshTriangle : public Object
@@ -78,6 +88,28 @@ public:
         return intersect;
     }
 
+    uint32_t getNumPrimitives() const override
+    {
+        return numTriangles;
+    }
+
+    Bounds3 getBounds(uint32_t prim) const override
+    {
+        const Vector3f &v0 = vertices[vertexIndex[prim * 3]];
+        const Vector3f &v1 = vertices[vertexIndex[prim * 3 + 1]];
+        const Vector3f &v2 = vertices[vertexIndex[prim * 3 + 2]];
+        return Union(Bounds3(v0, v1), v2);
+    }
+
+    bool intersectPrimitive(uint32_t prim, const Vector3f &orig, const Vector3f &dir, float &tnear,
+                            Vector2f &uv) const override
+    {
+        const Vector3f &v0 = vertices[vertexIndex[prim * 3]];
+        const Vector3f &v1 = vertices[vertexIndex[prim * 3 + 1]];
+        const Vector3f &v2 = vertices[vertexIndex[prim * 3 + 2]];
+        return rayTriangleIntersect(v0, v1, v2, orig, dir, tnear, uv.x, uv.y);
+    }
+
     void getSurfaceProperties(const Vector3f &, const Vector3f &, const uint32_t &index, const Vector2f &uv, Vector3f &N,
                               Vector2f &st) const override
     {
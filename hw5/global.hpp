@@ -1,8 +1,12 @@
 #pragma once
 
 #include <cmath>
+#include <cstdint>
 #include <iostream>
 #include <random>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 #define M_PI 3.14159265358979323846
 
@@ -13,6 +17,11 @@ inline float clamp(const float& lo, const float& hi, const float& v)
     return std::max(lo, std::min(hi, v));
 }
 
+inline float deg2rad(const float& deg)
+{
+    return deg * M_PI / 180.0;
+}
+
 inline bool solveQuadratic(const float& a, const float& b, const float& c, float& x0, float& x1)
 {
     float discr = b * b - 4 * a * c;
@@ -31,6 +40,18 @@ inline bool solveQuadratic(const float& a, const float& b, const float& c, float
     return true;
 }
 
+// Index of the lowest set bit, v must not be 0
+inline int countTrailingZeros(uint32_t v)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, v);
+    return (int)index;
+#else
+    return __builtin_ctz(v);
+#endif
+}
+
 enum MaterialType
 {
     DIFFUSE_AND_GLOSSY,
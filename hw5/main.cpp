@@ -37,9 +37,12 @@ int main()
     scene.Add(std::move(mesh));
     scene.Add(std::make_unique<Light>(Vector3f(-20, 70, 20), 0.5));
     scene.Add(std::make_unique<Light>(Vector3f(30, 50, -12), 0.5));
+    scene.buildBVH();
+
+    Camera camera(Vector3f(0), Vector3f(0, 0, -1), Vector3f(0, 1, 0), scene.fov, scene.width, scene.height);
 
     Renderer r;
-    r.Render(scene);
+    r.Render(scene, camera);
 
     return 0;
 }
\ No newline at end of file
@@ -145,4 +145,56 @@ Intersection BVHAccel::getIntersection(BVHBuildNode *node, const Ray &ray, int d
     if (inter_right.happened)
         return inter_right;
     return {};
+}
+
+bool BVHAccel::IntersectP(const Ray &ray) const
+{
+    return IntersectP(&ray, 1) != 0;
+}
+
+uint32_t BVHAccel::IntersectP(const Ray *rays, int n) const
+{
+    assert(n <= kMaxShadowBatch);
+    if (!root || n == 0)
+        return 0;
+
+    const uint32_t allRays = n == 32 ? 0xffffffffu : ((1u << n) - 1);
+    uint32_t occluded = 0;
+
+    // Each entry carries the rays that reached its parent, so a subtree is only tested
+    // against rays that can still hit it
+    std::pair<BVHBuildNode *, uint32_t> nodesToVisit[64];
+    int toVisitOffset = 0;
+    nodesToVisit[toVisitOffset++] = {root, allRays};
+    while (toVisitOffset > 0)
+    {
+        auto [node, mask] = nodesToVisit[--toVisitOffset];
+
+        uint32_t hitMask = 0;
+        for (int r = 0; r < n; ++r)
+        {
+            if (((mask & ~occluded) >> r & 1) &&
+                node->bounds.IntersectSegment(rays[r], rays[r].direction_inv, rays[r].t_max))
+                hitMask |= 1u << r;
+        }
+        if (!hitMask)
+            continue;
+
+        if (node->left == nullptr && node->right == nullptr)
+        {
+            for (int r = 0; r < n; ++r)
+            {
+                if ((hitMask >> r & 1) && node->object->intersect(rays[r]))
+                    occluded |= 1u << r;
+            }
+            if (occluded == allRays)
+                break;
+            continue;
+        }
+        if (node->left != nullptr)
+            nodesToVisit[toVisitOffset++] = {node->left, hitMask};
+        if (node->right != nullptr)
+            nodesToVisit[toVisitOffset++] = {node->right, hitMask};
+    }
+    return occluded;
 }
\ No newline at end of file
@@ -39,7 +39,12 @@ public:
 
     Intersection Intersect(const Ray &ray) const;
     Intersection getIntersection(BVHBuildNode *node, const Ray &ray, int depth = 0) const;
+    // Occlusion queries: true/bit set when anything is hit in (0, ray.t_max).
+    // The batched form resolves up to kMaxShadowBatch rays in one traversal, each ray
+    // dropping out at its first blocker.
+    static constexpr int kMaxShadowBatch = 32;
     bool IntersectP(const Ray &ray) const;
+    uint32_t IntersectP(const Ray *rays, int n) const;
     BVHBuildNode *root;
 
     // BVHAccel Private Methods
@@ -45,7 +45,7 @@ public:
         return 2 * (d.x * d.y + d.x * d.z + d.y * d.z);
     }
 
-    Vector3f Centroid() { return 0.5 * pMin + 0.5 * pMax; }
+    Vector3f Centroid() const { return 0.5 * pMin + 0.5 * pMax; }
     Bounds3 Intersect(const Bounds3 &b)
     {
         return Bounds3(Vector3f(fmax(pMin.x, b.pMin.x), fmax(pMin.y, b.pMin.y),
@@ -86,6 +86,17 @@ public:
 
     inline bool IntersectP(const Ray &ray, const Vector3f &invDir,
                            const std::array<int, 3> &dirisNeg) const;
+
+    // Slab test restricted to the segment t in [0, tMax], used by occlusion queries
+    bool IntersectSegment(const Ray &ray, const Vector3f &invDir, float tMax) const
+    {
+        float t0x = (pMin.x - ray.origin.x) * invDir.x, t1x = (pMax.x - ray.origin.x) * invDir.x;
+        float t0y = (pMin.y - ray.origin.y) * invDir.y, t1y = (pMax.y - ray.origin.y) * invDir.y;
+        float t0z = (pMin.z - ray.origin.z) * invDir.z, t1z = (pMax.z - ray.origin.z) * invDir.z;
+        float t_enter = std::max({std::min(t0x, t1x), std::min(t0y, t1y), std::min(t0z, t1z), 0.f});
+        float t_exit = std::min({std::max(t0x, t1x), std::max(t0y, t1y), std::max(t0z, t1z), tMax});
+        return t_enter <= t_exit;
+    }
 };
 
 inline bool Bounds3::IntersectP(const Ray &ray, const Vector3f &invDir,
@@ -0,0 +1,90 @@
+#ifndef RAYTRACING_LIGHTBVH_H
+#define RAYTRACING_LIGHTBVH_H
+
+#include <memory>
+#include <vector>
+#include "Bounds3.hpp"
+#include "Light.hpp"
+#include "Vector.hpp"
+
+// What the Phong model at a shading point makes of one unit of light intensity arriving from
+// direction L: kDiffuse * max(0, N.L) + kSpecular * max(0, R.L)^specularExponent,
+// R being the view direction mirrored about N.
+struct PhongLobe
+{
+    Vector3f N;
+    Vector3f R;
+    float specularExponent;
+    float kDiffuse;
+    float kSpecular;
+};
+
+// Depth-first flattened node, the left child follows its parent. The lights of a subtree are
+// contiguous in LightBVH::lights. Point lights shine in every direction, so a node only bounds the
+// positions and the summed intensity of its lights; the orientation cone used for culling is the
+// cone the node subtends as seen from the shading point.
+struct LinearLightNode
+{
+    Bounds3 bounds;
+    float power;           // sum of the largest intensity channel of the lights below
+    int lightsOffset;      // first light of the subtree
+    int nLights;           // 1 -> leaf
+    int secondChildOffset; // interior only
+};
+
+class LightBVH
+{
+public:
+    // Area lights are not shaded by the Whitted integrator and are left out
+    explicit LightBVH(const std::vector<std::unique_ptr<Light>> &sceneLights);
+
+    // Calls visit(light) for the lights that matter to the Phong shading described by lobe at p.
+    // threshold is split among the subtrees in proportion to their power, and a subtree whose upper
+    // bound stays below its share is skipped as a whole, so everything skipped at p adds up to less
+    // than threshold no matter how many lights there are. Returns the number of lights skipped.
+    template <typename F>
+    int VisitLights(const Vector3f &p, const PhongLobe &lobe, float threshold, F &&visit) const
+    {
+        if (nodes.empty())
+            return 0;
+
+        float budget = threshold / nodes[0].power;
+        int culled = 0;
+        int toVisitOffset = 0;
+        int nodesToVisit[64];
+        nodesToVisit[toVisitOffset++] = 0;
+        while (toVisitOffset > 0)
+        {
+            int current = nodesToVisit[--toVisitOffset];
+            const LinearLightNode &node = nodes[current];
+            if (ContributionBound(node, p, lobe) < budget * node.power)
+            {
+                culled += node.nLights;
+                continue;
+            }
+            if (node.nLights == 1)
+            {
+                visit(*lights[node.lightsOffset]);
+            }
+            else
+            {
+                nodesToVisit[toVisitOffset++] = node.secondChildOffset;
+                nodesToVisit[toVisitOffset++] = current + 1;
+            }
+        }
+        return culled;
+    }
+
+    // Upper bound of the shading the lights of node can produce at p
+    float ContributionBound(const LinearLightNode &node, const Vector3f &p, const PhongLobe &lobe) const;
+
+    float TotalPower() const { return nodes.empty() ? 0.f : nodes[0].power; }
+
+private:
+    int recursiveBuild(int start, int end);
+
+    std::vector<const Light *> lights;
+    std::vector<LinearLightNode> nodes;
+};
+
+#endif // RAYTRACING_LIGHTBVH_H
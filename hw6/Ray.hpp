@@ -19,6 +19,8 @@ struct Ray{
 
     }
 
+    Ray() : Ray(Vector3f(0, 0, 0), Vector3f(0, 0, 1)) {}
+
     Vector3f operator()(double t) const{return origin+direction*t;}
 
     friend std::ostream &operator<<(std::ostream& os, const Ray& r){
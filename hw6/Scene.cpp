@@ -8,6 +8,7 @@ void Scene::buildBVH()
 {
     printf(" - Generating BVH...\n\n");
     this->bvh = new BVHAccel(objects, 1, BVHAccel::SplitMethod::NAIVE);
+    this->lightBvh = new LightBVH(lights);
 }
 
 Intersection Scene::intersect(const Ray &ray) const
@@ -40,104 +41,158 @@ bool Scene::trace(
 // Implementation of the Whitted-syle light transport algorithm (E [S*] (D|G) L)
 //
 // This function is the function that compute the color at the intersection point
-// of a ray defined by a position and a direction. Note that thus function is recursive (it calls itself).
+// of a ray defined by a position and a direction.
 //
 // If the material of the intersected object is either reflective or reflective and refractive,
-// then we compute the reflection/refracton direction and cast two new rays into the scene
-// by calling the castRay() function recursively. When the surface is transparent, we mix
-// the reflection and refraction color using the result of the fresnel equations (it computes
-// the amount of reflection and refractin depending on the surface normal, incident view direction
-// and surface refractive index).
+// then we compute the reflection/refracton direction and cast two new rays into the scene.
+// When the surface is transparent, we mix the reflection and refraction color using the result
+// of the fresnel equations (it computes the amount of reflection and refractin depending on the
+// surface normal, incident view direction and surface refractive index).
 //
 // If the surface is duffuse/glossy we use the Phong illumation model to compute the color
 // at the intersection point.
+//
+// Rather than recursing, pending rays live on an explicit stack with the product of the
+// kr / 1-kr factors that lead to them. Branches lighter than minRayWeight are pruned.
 Vector3f Scene::castRay(const Ray &ray, int depth) const
 {
-    if (depth > this->maxDepth)
-    {
-        return Vector3f(0.0, 0.0, 0.0);
-    }
-    Intersection intersection = Scene::intersect(ray);
-    Material *m = intersection.m;
-    Object *hitObject = intersection.obj;
-    Vector3f hitColor = this->backgroundColor;
-    //    float tnear = kInfinity;
-    Vector2f uv;
-    uint32_t index = 0;
-    if (intersection.happened)
+    struct RayTask
     {
+        Ray ray;
+        int depth;
+        float weight;
+    };
 
-        Vector3f hitPoint = intersection.coords;
-        Vector3f N = intersection.normal; // normal
-        Vector2f st;                      // st coordinates
-        hitObject->getSurfaceProperties(hitPoint, ray.direction, index, uv, N, st);
-        //        Vector3f tmp = hitPoint;
-        switch (m->getType())
-        {
-        case REFLECTION_AND_REFRACTION:
-        {
-            Vector3f reflectionDirection = normalize(reflect(ray.direction, N));
-            Vector3f refractionDirection = normalize(refract(ray.direction, N, m->ior));
-            Vector3f reflectionRayOrig = (dotProduct(reflectionDirection, N) < 0) ? hitPoint - N * EPSILON : hitPoint + N * EPSILON;
-            Vector3f refractionRayOrig = (dotProduct(refractionDirection, N) < 0) ? hitPoint - N * EPSILON : hitPoint + N * EPSILON;
-            Vector3f reflectionColor = castRay(Ray(reflectionRayOrig, reflectionDirection), depth + 1);
-            Vector3f refractionColor = castRay(Ray(refractionRayOrig, refractionDirection), depth + 1);
-            float kr;
-            fresnel(ray.direction, N, m->ior, kr);
-            hitColor = reflectionColor * kr + refractionColor * (1 - kr);
-            break;
-        }
-        case REFLECTION:
+    uint64_t raysCast = 0, raysPruned = 0, lightsShaded = 0, lightsCulled = 0;
+    Vector3f pixelColor = 0;
+
+    std::vector<RayTask> stack;
+    stack.reserve(2 * (maxDepth + 2));
+    // Children deeper than maxDepth contribute black, exactly like the recursive version
+    auto push = [&](const Ray &r, int childDepth, float weight)
+    {
+        if (childDepth > maxDepth)
+            return;
+        if (weight < minRayWeight)
         {
-            float kr;
-            fresnel(ray.direction, N, m->ior, kr);
-            Vector3f reflectionDirection = reflect(ray.direction, N);
-            Vector3f reflectionRayOrig = (dotProduct(reflectionDirection, N) < 0) ? hitPoint + N * EPSILON : hitPoint - N * EPSILON;
-            hitColor = castRay(Ray(reflectionRayOrig, reflectionDirection), depth + 1) * kr;
-            break;
+            ++raysPruned;
+            return;
         }
-        default:
+        stack.push_back({r, childDepth, weight});
+    };
+    push(ray, depth, 1.f);
+
+    while (!stack.empty())
+    {
+        RayTask task = stack.back();
+        stack.pop_back();
+        ++raysCast;
+        const Ray &ray = task.ray;
+
+        Intersection intersection = Scene::intersect(ray);
+        Material *m = intersection.m;
+        Object *hitObject = intersection.obj;
+        Vector3f hitColor = this->backgroundColor;
+        //    float tnear = kInfinity;
+        Vector2f uv;
+        uint32_t index = 0;
+        if (intersection.happened)
         {
-            // [comment]
-            // We use the Phong illumation model int the default case. The phong model
-            // is composed of a diffuse and a specular reflection component.
-            // [/comment]
-            Vector3f lightAmt = 0, specularColor = 0;
-            Vector3f shadowPointOrig = (dotProduct(ray.direction, N) < 0) ? hitPoint + N * EPSILON : hitPoint - N * EPSILON;
-            // [comment]
-            // Loop over all lights in the scene and sum their contribution up
-            // We also apply the lambert cosine law
-            // [/comment]
-            for (uint32_t i = 0; i < get_lights().size(); ++i)
+
+            Vector3f hitPoint = intersection.coords;
+            Vector3f N = intersection.normal; // normal
+            Vector2f st;                      // st coordinates
+            hitObject->getSurfaceProperties(hitPoint, ray.direction, index, uv, N, st);
+            //        Vector3f tmp = hitPoint;
+            switch (m->getType())
             {
-                auto area_ptr = dynamic_cast<AreaLight *>(this->get_lights()[i].get());
-                if (area_ptr)
-                {
-                    // Do nothing for this assignment
-                }
-                else
+            case REFLECTION_AND_REFRACTION:
+            {
+                Vector3f reflectionDirection = normalize(reflect(ray.direction, N));
+                Vector3f refractionDirection = normalize(refract(ray.direction, N, m->ior));
+                Vector3f reflectionRayOrig = (dotProduct(reflectionDirection, N) < 0) ? hitPoint - N * EPSILON : hitPoint + N * EPSILON;
+                Vector3f refractionRayOrig = (dotProduct(refractionDirection, N) < 0) ? hitPoint - N * EPSILON : hitPoint + N * EPSILON;
+                float kr;
+                fresnel(ray.direction, N, m->ior, kr);
+                push(Ray(reflectionRayOrig, reflectionDirection), task.depth + 1, task.weight * kr);
+                push(Ray(refractionRayOrig, refractionDirection), task.depth + 1, task.weight * (1 - kr));
+                continue;
+            }
+            case REFLECTION:
+            {
+                float kr;
+                fresnel(ray.direction, N, m->ior, kr);
+                Vector3f reflectionDirection = reflect(ray.direction, N);
+                Vector3f reflectionRayOrig = (dotProduct(reflectionDirection, N) < 0) ? hitPoint + N * EPSILON : hitPoint - N * EPSILON;
+                push(Ray(reflectionRayOrig, reflectionDirection), task.depth + 1, task.weight * kr);
+                continue;
+            }
+            default:
+            {
+                // [comment]
+                // We use the Phong illumation model int the default case. The phong model
+                // is composed of a diffuse and a specular reflection component.
+                // [/comment]
+                Vector3f lightAmt = 0, specularColor = 0;
+                Vector3f shadowPointOrig = (dotProduct(ray.direction, N) < 0) ? hitPoint + N * EPSILON : hitPoint - N * EPSILON;
+                // [comment]
+                // Loop over all lights in the scene and sum their contribution up
+                // We also apply the lambert cosine law
+                //
+                // The light BVH hands out only the point lights that matter at this hit point.
+                // Their shadow rays are gathered into a batch and resolved by one occlusion-only
+                // traversal; each ray stops at its first blocker before the light.
+                // [/comment]
+                Ray shadowRays[BVHAccel::kMaxShadowBatch];
+                const Light *shadowLights[BVHAccel::kMaxShadowBatch];
+                int n = 0;
+                auto flushShadowBatch = [&]()
                 {
-                    Vector3f lightDir = get_lights()[i]->position - hitPoint;
-                    // square of the distance between hitPoint and the light
-                    float lightDistance2 = dotProduct(lightDir, lightDir);
-                    lightDir = normalize(lightDir);
-                    float LdotN = std::max(0.f, dotProduct(lightDir, N));
-                    Object *shadowHitObject = nullptr;
-                    float tNearShadow = kInfinity;
                     // is the point in shadow, and is the nearest occluding object closer to the object than the light itself?
-                    bool inShadow = bvh->Intersect(Ray(shadowPointOrig, lightDir)).happened;
-                    lightAmt += (1 - inShadow) * get_lights()[i]->intensity * LdotN;
-                    Vector3f reflectionDirection = reflect(-lightDir, N);
-                    specularColor += powf(std::max(0.f, -dotProduct(reflectionDirection, ray.direction)),
-                                          m->specularExponent) *
-                                     get_lights()[i]->intensity;
-                }
+                    uint32_t inShadow = bvh->IntersectP(shadowRays, n);
+                    for (int k = 0; k < n; ++k)
+                    {
+                        const Vector3f &lightDir = shadowRays[k].direction;
+                        float LdotN = std::max(0.f, dotProduct(lightDir, N));
+                        lightAmt += (1 - (inShadow >> k & 1)) * shadowLights[k]->intensity * LdotN;
+                        Vector3f reflectionDirection = reflect(-lightDir, N);
+                        specularColor += powf(std::max(0.f, -dotProduct(reflectionDirection, ray.direction)),
+                                              m->specularExponent) *
+                                         shadowLights[k]->intensity;
+                    }
+                    lightsShaded += n;
+                    n = 0;
+                };
+
+                // lightAmt scales the specular sum as well, so a light can reach the pixel through
+                // either factor; the other factor is at most the total light power
+                float totalPower = lightBvh->TotalPower();
+                PhongLobe lobe{N, reflect(ray.direction, N), m->specularExponent,
+                               m->Kd + m->Ks * totalPower, m->Ks * totalPower};
+                lightsCulled += lightBvh->VisitLights(hitPoint, lobe, lightCullThreshold, [&](const Light &light)
+                {
+                    Vector3f lightDir = light.position - hitPoint;
+                    // distance between hitPoint and the light
+                    float lightDistance = std::sqrt(dotProduct(lightDir, lightDir));
+                    shadowRays[n] = Ray(shadowPointOrig, lightDir / lightDistance);
+                    shadowRays[n].t_max = lightDistance;
+                    shadowLights[n++] = &light;
+                    if (n == BVHAccel::kMaxShadowBatch)
+                        flushShadowBatch();
+                });
+                if (n > 0)
+                    flushShadowBatch();
+                hitColor = lightAmt * (hitObject->evalDiffuseColor(st) * m->Kd + specularColor * m->Ks);
+                break;
+            }
             }
-            hitColor = lightAmt * (hitObject->evalDiffuseColor(st) * m->Kd + specularColor * m->Ks);
-            break;
-        }
         }
+        pixelColor += hitColor * task.weight;
     }
 
-    return hitColor;
-}
\ No newline at end of file
+    rayStats.raysCast += raysCast;
+    rayStats.raysPruned += raysPruned;
+    rayStats.lightsShaded += lightsShaded;
+    rayStats.lightsCulled += lightsCulled;
+    return pixelColor;
+}
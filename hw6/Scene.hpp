@@ -4,14 +4,24 @@
 
 #pragma once
 
+#include <atomic>
 #include <vector>
 #include "Vector.hpp"
 #include "Object.hpp"
 #include "Light.hpp"
 #include "AreaLight.hpp"
 #include "BVH.hpp"
+#include "LightBVH.hpp"
 #include "Ray.hpp"
 
+// Ray and light counters of the Whitted integrator, shared by all render threads
+struct RayStats
+{
+    std::atomic<uint64_t> raysCast{0};
+    std::atomic<uint64_t> raysPruned{0};
+    std::atomic<uint64_t> lightsShaded{0};
+    std::atomic<uint64_t> lightsCulled{0};
+};
 
 class Scene
 {
@@ -22,6 +32,11 @@ public:
     double fov = 90;
     Vector3f backgroundColor = Vector3f(0.235294, 0.67451, 0.843137);
     int maxDepth = 5;
+    // reflection/refraction branches whose accumulated Fresnel weight is below this are not traced
+    float minRayWeight = 0.001f;
+    // lights are skipped at a hit point as long as what they could add there stays below this in total
+    float lightCullThreshold = 0.001f;
+    mutable RayStats rayStats;
 
     Scene(int w, int h) : width(w), height(h)
     {}
@@ -33,6 +48,8 @@ public:
     const std::vector<std::unique_ptr<Light> >&  get_lights() const { return lights; }
     Intersection intersect(const Ray& ray) const;
     BVHAccel *bvh;
+    LightBVH *lightBvh;
+    // Builds the object BVH and the light BVH, call after everything has been added
     void buildBVH();
     Vector3f castRay(const Ray &ray, int depth) const;
     bool trace(const Ray &ray, const std::vector<Object*> &objects, float &tNear, uint32_t &index, Object **hitObject);
@@ -26,7 +26,7 @@ public:
         if (!solveQuadratic(a, b, c, t0, t1)) return false;
         if (t0 < 0) t0 = t1;
         if (t0 < 0) return false;
-        return true;
+        return t0 < ray.t_max;
     }
     bool intersect(const Ray& ray, float &tnear, uint32_t &index) const
     {
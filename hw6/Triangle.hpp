@@ -128,7 +128,8 @@ public:
         bvh = new BVHAccel(ptrs);
     }
 
-    bool intersect(const Ray &ray) { return true; }
+    // Any triangle hit in (0, ray.t_max)
+    bool intersect(const Ray &ray) { return bvh && bvh->IntersectP(ray); }
 
     bool intersect(const Ray &ray, float &tnear, uint32_t &index) const
     {
@@ -204,7 +205,28 @@ public:
     Material *m;
 };
 
-inline bool Triangle::intersect(const Ray &ray) { return true; }
+// Occlusion test with the same culling as getIntersection, limited to t in (0, ray.t_max)
+inline bool Triangle::intersect(const Ray &ray)
+{
+    if (dotProduct(ray.direction, normal) > 0)
+        return false;
+    Vector3f pvec = crossProduct(ray.direction, e2);
+    double det = dotProduct(e1, pvec);
+    if (fabs(det) < EPSILON)
+        return false;
+
+    double det_inv = 1. / det;
+    Vector3f tvec = ray.origin - v0;
+    double u = dotProduct(tvec, pvec) * det_inv;
+    if (u < 0 || u > 1)
+        return false;
+    Vector3f qvec = crossProduct(tvec, e1);
+    double v = dotProduct(ray.direction, qvec) * det_inv;
+    if (v < 0 || u + v > 1)
+        return false;
+    double t = dotProduct(e2, qvec) * det_inv;
+    return t > 0 && t < ray.t_max;
+}
 inline bool Triangle::intersect(const Ray &ray, float &tnear,
                                 uint32_t &index) const
 {
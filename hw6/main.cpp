@@ -21,10 +21,11 @@ int main(int argc, char **argv)
     scene.Add(std::make_unique<Light>(Vector3f(20, 70, 20), 1));
     scene.buildBVH();
 
+    Camera camera(Vector3f(-1, 5, 10), Vector3f(-1, 5, 9), Vector3f(0, 1, 0), scene.fov, scene.width, scene.height);
     Renderer r;
 
     auto start = std::chrono::system_clock::now();
-    r.Render(scene);
+    r.Render(scene, camera);
     auto stop = std::chrono::system_clock::now();
 
     std::cout << "Render complete: \n";
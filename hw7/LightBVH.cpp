@@ -0,0 +1,188 @@
+#include <algorithm>
+#include <cmath>
+#include "LightBVH.hpp"
+
+namespace
+{
+    float safeSqrt(float x) { return std::sqrt(std::max(0.f, x)); }
+    float safeAcos(float x) { return std::acos(clamp(-1, 1, x)); }
+
+    // cos(max(0, a - b)) and sin(max(0, a - b)) from the sines and cosines of a and b
+    float cosSubClamped(float sinA, float cosA, float sinB, float cosB)
+    {
+        if (cosA > cosB)
+            return 1;
+        return cosA * cosB + sinA * sinB;
+    }
+
+    float sinSubClamped(float sinA, float cosA, float sinB, float cosB)
+    {
+        if (cosA > cosB)
+            return 0;
+        return sinA * cosB - cosA * sinB;
+    }
+}
+
+float LightBounds::Importance(const Vector3f &p, const Vector3f &n) const
+{
+    Vector3f pc = bounds.Centroid();
+    Vector3f d = p - pc;
+    float d2 = dotProduct(d, d);
+    Vector3f diagonal = bounds.Diagonal();
+    float r2 = 0.25f * dotProduct(diagonal, diagonal);
+    Vector3f wi = d2 > 0 ? d / std::sqrt(d2) : Vector3f(0, 0, 1);
+
+    // Every emitter is inside the bounding sphere of the box, seen from p within theta_b of -wi
+    float cosTheta_b = d2 > r2 ? safeSqrt(1 - r2 / d2) : -1;
+    float sinTheta_b = safeSqrt(1 - cosTheta_b * cosTheta_b);
+
+    // Smallest angle between a normal of the cone and a direction from the emitters to p
+    float cosTheta_w = dotProduct(w, wi);
+    float sinTheta_w = safeSqrt(1 - cosTheta_w * cosTheta_w);
+    float sinTheta_o = safeSqrt(1 - cosTheta_o * cosTheta_o);
+    float cosTheta_x = cosSubClamped(sinTheta_w, cosTheta_w, sinTheta_o, cosTheta_o);
+    float sinTheta_x = sinSubClamped(sinTheta_w, cosTheta_w, sinTheta_o, cosTheta_o);
+    float cosThetap = cosSubClamped(sinTheta_x, cosTheta_x, sinTheta_b, cosTheta_b);
+    if (cosThetap <= cosTheta_e)
+        return 0;
+
+    // Clamping the distance to the box radius keeps a nearby group from taking every sample
+    float importance = phi * cosThetap / std::max(d2, r2);
+
+    // Only the hemisphere above n receives light
+    float cosTheta_i = -dotProduct(wi, n);
+    float sinTheta_i = safeSqrt(1 - cosTheta_i * cosTheta_i);
+    float cosThetap_i = cosSubClamped(sinTheta_i, cosTheta_i, sinTheta_b, cosTheta_b);
+    return std::max(0.f, importance * cosThetap_i);
+}
+
+LightBounds Union(const LightBounds &a, const LightBounds &b)
+{
+    LightBounds ret;
+    ret.bounds = Union(a.bounds, b.bounds);
+    ret.phi = a.phi + b.phi;
+    ret.cosTheta_e = std::min(a.cosTheta_e, b.cosTheta_e);
+
+    // Smallest cone holding both normal cones
+    float theta_a = safeAcos(a.cosTheta_o), theta_b = safeAcos(b.cosTheta_o);
+    float theta_d = safeAcos(dotProduct(a.w, b.w));
+    if (std::min(theta_d + theta_b, (float)M_PI) <= theta_a)
+    {
+        ret.w = a.w;
+        ret.cosTheta_o = a.cosTheta_o;
+        return ret;
+    }
+    if (std::min(theta_d + theta_a, (float)M_PI) <= theta_b)
+    {
+        ret.w = b.w;
+        ret.cosTheta_o = b.cosTheta_o;
+        return ret;
+    }
+
+    ret.w = a.w;
+    ret.cosTheta_o = -1;
+    float theta_o = (theta_a + theta_d + theta_b) / 2;
+    Vector3f wr = crossProduct(a.w, b.w);
+    if (theta_o >= M_PI || dotProduct(wr, wr) == 0)
+        return ret;
+
+    // Rotate a.w towards b.w by theta_o - theta_a, wr being orthogonal to a.w
+    float theta_r = theta_o - theta_a;
+    ret.w = normalize(a.w * std::cos(theta_r) + crossProduct(normalize(wr), a.w) * std::sin(theta_r));
+    ret.cosTheta_o = std::cos(theta_o);
+    return ret;
+}
+
+LightBVH::LightBVH(const std::vector<Object *> &objects)
+{
+    for (auto object : objects)
+        object->getEmitters(emitters);
+    if (emitters.empty())
+        return;
+
+    nodes.reserve(2 * emitters.size() - 1);
+    recursiveBuild(0, (int)emitters.size());
+}
+
+int LightBVH::recursiveBuild(int start, int end)
+{
+    int nodeIndex = (int)nodes.size();
+    nodes.emplace_back();
+
+    LinearLightNode node;
+    node.emittersOffset = start;
+    node.nEmitters = end - start;
+    node.secondChildOffset = 0;
+
+    if (node.nEmitters == 1)
+    {
+        const Emitter &e = emitters[start];
+        LightBounds &lb = node.lightBounds;
+        lb.bounds = e.bounds;
+        lb.phi = std::max({e.emission.x, e.emission.y, e.emission.z}) * e.area;
+        lb.w = e.axis;
+        lb.cosTheta_o = e.cosTheta;
+        lb.cosTheta_e = 0;
+    }
+    else
+    {
+        // Median split along the widest axis of the emitter centroids
+        Bounds3 centroidBounds;
+        for (int i = start; i < end; ++i)
+            centroidBounds = Union(centroidBounds, emitters[i].bounds.Centroid());
+        int dim = centroidBounds.maxExtent();
+        int mid = start + node.nEmitters / 2;
+        auto centroid = [dim](const Emitter &e)
+        {
+            const Vector3f c = e.bounds.Centroid();
+            return c[dim];
+        };
+        std::nth_element(emitters.begin() + start, emitters.begin() + mid, emitters.begin() + end,
+                         [&](const Emitter &a, const Emitter &b) { return centroid(a) < centroid(b); });
+        int left = recursiveBuild(start, mid);
+        node.secondChildOffset = recursiveBuild(mid, end);
+        node.lightBounds = Union(nodes[left].lightBounds, nodes[node.secondChildOffset].lightBounds);
+    }
+
+    nodes[nodeIndex] = node;
+    return nodeIndex;
+}
+
+bool LightBVH::Sample(const Vector3f &p, const Vector3f &n, Intersection &pos, float &pdf) const
+{
+    if (nodes.empty() || nodes[0].lightBounds.Importance(p, n) == 0)
+        return false;
+
+    // One random number picks the whole path, it is rescaled to [0, 1) after every choice
+    float u = get_random_float();
+    float pmf = 1;
+    int current = 0;
+    while (nodes[current].nEmitters > 1)
+    {
+        int children[2] = {current + 1, nodes[current].secondChildOffset};
+        float ci[2] = {nodes[children[0]].lightBounds.Importance(p, n),
+                       nodes[children[1]].lightBounds.Importance(p, n)};
+        if (ci[0] == 0 && ci[1] == 0)
+            return false;
+
+        float p0 = ci[0] / (ci[0] + ci[1]);
+        if (u < p0)
+        {
+            current = children[0];
+            u = std::min(u / p0, 0x1.fffffep-1f);
+            pmf *= p0;
+        }
+        else
+        {
+            current = children[1];
+            u = std::min((u - p0) / (1 - p0), 0x1.fffffep-1f);
+            pmf *= 1 - p0;
+        }
+    }
+
+    const Emitter &e = emitters[nodes[current].emittersOffset];
+    e.object->Sample(pos, pdf);
+    pos.emit = e.emission;
+    pdf *= pmf;
+    return true;
+}
@@ -0,0 +1,55 @@
+#ifndef RAYTRACING_LIGHTBVH_H
+#define RAYTRACING_LIGHTBVH_H
+
+#include <vector>
+#include "global.hpp"
+#include "Bounds3.hpp"
+#include "Intersection.hpp"
+#include "Object.hpp"
+#include "Vector.hpp"
+
+// Where a group of emitters is, how much they emit and in which directions: the normals lie within
+// theta_o of w, and each surface emits within theta_e of its normal (pi / 2 for diffuse emitters).
+struct LightBounds
+{
+    Bounds3 bounds;
+    float phi = 0;
+    Vector3f w;
+    float cosTheta_o = 1;
+    float cosTheta_e = 0;
+
+    // Conservative estimate of what the emitters add at a point p with surface normal n.
+    // Zero only when no emitter of the group can light p.
+    float Importance(const Vector3f &p, const Vector3f &n) const;
+};
+
+LightBounds Union(const LightBounds &a, const LightBounds &b);
+
+// Depth-first flattened node, the left child follows its parent and the emitters of a subtree
+// are contiguous in LightBVH::emitters.
+struct LinearLightNode
+{
+    LightBounds lightBounds;
+    int emittersOffset;
+    int nEmitters;         // 1 -> leaf
+    int secondChildOffset; // interior only
+};
+
+class LightBVH
+{
+public:
+    explicit LightBVH(const std::vector<Object *> &objects);
+
+    // Walks down the tree choosing each child with probability proportional to its importance at
+    // p, then samples a point on the emitter reached, uniformly by area. pdf is the probability of
+    // the emitter times the area density. Returns false when no emitter can light p.
+    bool Sample(const Vector3f &p, const Vector3f &n, Intersection &pos, float &pdf) const;
+
+private:
+    int recursiveBuild(int start, int end);
+
+    std::vector<Emitter> emitters;
+    std::vector<LinearLightNode> nodes;
+};
+
+#endif // RAYTRACING_LIGHTBVH_H
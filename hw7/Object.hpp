@@ -10,6 +10,9 @@
 #include "Bounds3.hpp"
 #include "Ray.hpp"
 #include "Intersection.hpp"
+#include <vector>
+
+struct Emitter;
 
 class Object
 {
@@ -25,6 +28,19 @@ public:
     virtual float getArea()=0;
     virtual void Sample(Intersection &pos, float &pdf)=0;
     virtual bool hasEmit()=0;
+    // Appends the emitting surfaces of the object (itself, or the triangles of a mesh)
+    virtual void getEmitters(std::vector<Emitter> &emitters)=0;
+};
+
+// One emitting surface as seen by the light BVH. Its normals lie within acos(cosTheta) of axis.
+struct Emitter
+{
+    Object *object;
+    Bounds3 bounds;
+    Vector3f emission;
+    float area;
+    Vector3f axis;
+    float cosTheta;
 };
 
 
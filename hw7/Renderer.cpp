@@ -10,31 +10,26 @@
 #include <future>
 #include <thread>
 
-inline float deg2rad(const float &deg) { return deg * M_PI / 180.0; }
-
 const float EPSILON = 0.00001;
 
-std::vector<Vector3f> RenderKernel(const Scene &scene, Vector3f &eye_pos, const size_t n_row, const size_t begin_row, int spp, size_t t)
+std::vector<Vector3f> RenderKernel(const Scene &scene, const Camera &camera, const size_t n_row, const size_t begin_row, int spp, size_t t)
 {
     uint64_t id = std::hash<std::thread::id>{}(std::this_thread::get_id());
 
-    std::vector<Vector3f> framebuffer(scene.width * n_row);
+    const int width = camera.Width();
+    std::vector<Vector3f> framebuffer(width * n_row);
+    std::vector<float> dirX(width), dirY(width), dirZ(width);
 
-    static const float scale = std::tan(deg2rad(scene.fov * 0.5f));
-    static const float imageAspectRatio = scene.width / (float)scene.height; // static const 能否保证线程安全?
     int m = 0;
     for (int j = begin_row; j < (begin_row + n_row); ++j)
     {
-        for (int i = 0; i < scene.width; ++i)
+        camera.GenerateRays(0, j, width, j + 1, dirX.data(), dirY.data(), dirZ.data());
+        for (int i = 0; i < width; ++i)
         {
-            float x = (2 * (i + 0.5) / (float)scene.width - 1) *
-                      imageAspectRatio * scale;
-            float y = (1 - 2 * (j + 0.5) / (float)scene.height) * scale;
-            Vector3f dir = normalize(Vector3f(-x, y, 1));
-            dir = normalize(dir);
+            Ray ray(camera.Position(), Vector3f(dirX[i], dirY[i], dirZ[i]));
             for (int k = 0; k < spp; k++)
             {
-                framebuffer[m] += scene.castRay(Ray(eye_pos, dir), 0) / (float)spp;
+                framebuffer[m] += scene.castRay(ray, 0) / (float)spp;
             }
             m++;
         }
@@ -54,21 +49,23 @@ std::vector<Vector3f> RenderKernel(const Scene &scene, Vector3f &eye_pos, const
 // The main render function. This where we iterate over all pixels in the image,
 // generate primary rays and cast these rays into the scene. The content of the
 // framebuffer is saved to a file.
-void Renderer::Render(const Scene &scene)
+void Renderer::Render(const Scene &scene, const Camera &camera)
 {
-    Vector3f eye_pos(278, 273, -800);
+    const int width = camera.Width(), height = camera.Height();
 
     // MultiThread Render
     std::vector<Vector3f> final_framebuffer;
     const size_t n_thrd = Settings::n_thrd;
-    const size_t n_row = scene.height / n_thrd;
+    const size_t n_row = height / n_thrd;
 
     std::vector<std::future<std::vector<Vector3f>>> futures_framebuffer;
     futures_framebuffer.reserve(n_thrd);
     for (size_t t = 0; t < n_thrd; t++)
     {
-        futures_framebuffer.emplace_back(std::async(std::launch::async, [&scene, &eye_pos, n_row, t]() -> std::vector<Vector3f>
-                                                    { return RenderKernel(scene, eye_pos, n_row, n_row * t, Settings::spp, t); }));
+        // the last band also takes the rows left over by the division
+        const size_t rows = (t == n_thrd - 1) ? height - n_row * t : n_row;
+        futures_framebuffer.emplace_back(std::async(std::launch::async, [&scene, &camera, n_row, rows, t]() -> std::vector<Vector3f>
+                                                    { return RenderKernel(scene, camera, rows, n_row * t, Settings::spp, t); }));
     }
     std::atomic<int> completed{0};
     for (size_t t = 0; t < n_thrd; t++)
@@ -85,8 +82,8 @@ void Renderer::Render(const Scene &scene)
 
     // save framebuffer to file
     FILE *fp = fopen("binary.ppm", "wb");
-    (void)fprintf(fp, "P6\n%d %d\n255\n", scene.width, scene.height);
-    for (auto i = 0; i < scene.height * scene.width; ++i)
+    (void)fprintf(fp, "P6\n%d %d\n255\n", width, height);
+    for (auto i = 0; i < height * width; ++i)
     {
         static unsigned char color[3];
         color[0] = (unsigned char)(255 * std::pow(clamp(0, 1, final_framebuffer[i].x), 0.6f));
@@ -1,6 +1,7 @@
 //
 // Created by goksu on 2/25/20.
 //
+#include "Camera.hpp"
 #include "Scene.hpp"
 
 #pragma once
@@ -15,7 +16,7 @@ struct hit_payload
 class Renderer
 {
 public:
-    void Render(const Scene& scene);
+    void Render(const Scene& scene, const Camera& camera);
 
 private:
 };
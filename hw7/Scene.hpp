@@ -10,6 +10,7 @@
 #include "Light.hpp"
 #include "AreaLight.hpp"
 #include "BVH.hpp"
+#include "LightBVH.hpp"
 #include "Ray.hpp"
 
 class Scene
@@ -35,9 +36,11 @@ public:
     const std::vector<std::unique_ptr<Light>> &get_lights() const { return lights; }
     Intersection intersect(const Ray &ray) const;
     BVHAccel *bvh;
+    LightBVH *lightBvh;
+    // Builds the object BVH and the light BVH over the emitting surfaces
     void buildBVH();
     Vector3f castRay(const Ray &ray, int depth) const;
-    void sampleLight(Intersection &pos, float &pdf) const;
+    bool sampleLight(const Vector3f &p, const Vector3f &n, Intersection &pos, float &pdf) const;
     bool trace(const Ray &ray, const std::vector<Object *> &objects, float &tNear, uint32_t &index, Object **hitObject);
     std::tuple<Vector3f, Vector3f> HandleAreaLight(const AreaLight &light, const Vector3f &hitPoint, const Vector3f &N,
                                                    const Vector3f &shadowPointOrig,
@@ -91,6 +91,10 @@ public:
     bool hasEmit(){
         return m->hasEmission();
     }
+    void getEmitters(std::vector<Emitter> &emitters){
+        if (hasEmit())
+            emitters.push_back({this, getBounds(), m->getEmission(), area, Vector3f(0, 0, 1), -1});
+    }
 };
 
 
@@ -87,6 +87,11 @@ public:
     {
         return m->hasEmission();
     }
+    void getEmitters(std::vector<Emitter> &emitters)
+    {
+        if (hasEmit())
+            emitters.push_back({this, getBounds(), m->getEmission(), area, normal, 1});
+    }
 };
 
 class MeshTriangle : public Object
@@ -217,6 +222,12 @@ public:
     {
         return m->hasEmission();
     }
+    // Each triangle is an emitter of its own, so the light BVH can tell them apart by position and facing
+    void getEmitters(std::vector<Emitter> &emitters)
+    {
+        for (auto &tri : triangles)
+            tri.getEmitters(emitters);
+    }
 
     Bounds3 bounding_box;
     std::unique_ptr<Vector3f[]> vertices;
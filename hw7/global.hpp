@@ -12,6 +12,8 @@ const float kInfinity = std::numeric_limits<float>::max();
 inline float clamp(const float &lo, const float &hi, const float &v)
 { return std::max(lo, std::min(hi, v)); }
 
+inline float deg2rad(const float &deg) { return deg * M_PI / 180.0; }
+
 inline  bool solveQuadratic(const float &a, const float &b, const float &c, float &x0, float &x1)
 {
     float discr = b * b - 4 * a * c;
@@ -42,10 +42,11 @@ int main(int argc, char **argv)
 
     scene.buildBVH();
 
+    Camera camera(Vector3f(278, 273, -800), Vector3f(278, 273, 0), Vector3f(0, 1, 0), scene.fov, scene.width, scene.height);
     Renderer r;
 
     auto start = std::chrono::system_clock::now();
-    r.Render(scene);
+    r.Render(scene, camera);
     auto stop = std::chrono::system_clock::now();
 
     std::cout << "Render complete: \n";